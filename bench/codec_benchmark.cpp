@@ -0,0 +1,80 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <array>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "../z21/lan_x_command.h"
+#include "../z21/z21_dataset.h"
+#include "../z21/z21_protocol.h"
+
+
+// Encoding through the command classes, one virtual pack_into() per command.
+static void BM_EncodeVirtual(benchmark::State& state)
+{
+    std::array<uint8_t, 16> buffer;
+    uint8_t speed = 0;
+    for (auto _: state) {
+        LanX_SetLocoDrive command(3, speed++ & 0x7f, true);
+        const LanX_Command& base = command;
+        benchmark::DoNotOptimize(base.pack_into(buffer));
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_EncodeVirtual);
+
+// Encoding directly from the protocol description.
+static void BM_EncodeCodec(benchmark::State& state)
+{
+    std::array<uint8_t, 16> buffer;
+    uint8_t speed = 0;
+    for (auto _: state) {
+        benchmark::DoNotOptimize(codec::encode<protocol::SetLocoDrive>({3, static_cast<uint8_t>(speed++ & 0x7f), true}, buffer));
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_EncodeCodec);
+
+static std::vector<uint8_t> loco_info = {0xef, 0x00, 0x03, 0x04, 0xa8, 0x10, 0x00, 0x00, 0x00, 0x00, 0x50};
+
+// Identifying the message and unpacking it into a command class with a virtual call.
+static void BM_DecodeVirtual(benchmark::State& state)
+{
+    LanX_LocoInfo loco;
+    LanX_Command& command = loco;
+    std::vector<uint8_t> data = loco_info;
+    for (auto _: state) {
+        benchmark::DoNotOptimize(protocol::LanXDecoders::identify(data));
+        command.unpack(data);
+        benchmark::DoNotOptimize(loco.speed);
+    }
+}
+BENCHMARK(BM_DecodeVirtual);
+
+// Identifying and decoding directly from the protocol description.
+static void BM_DecodeCodec(benchmark::State& state)
+{
+    std::vector<uint8_t> data = loco_info;
+    for (auto _: state) {
+        benchmark::DoNotOptimize(protocol::LanXDecoders::identify(data));
+        benchmark::DoNotOptimize(codec::decode<protocol::LocoInfo>(data));
+    }
+}
+BENCHMARK(BM_DecodeCodec);
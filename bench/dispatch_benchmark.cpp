@@ -0,0 +1,132 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <array>
+#include <map>
+#include <optional>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "../z21/z21_dataset.h"
+#include "../z21/z21_protocol.h"
+
+
+// Received DataSets as (DataSet ID, X-Bus data), mixing what a Z21 typically broadcasts.
+static const std::vector<std::pair<uint16_t, std::vector<uint8_t>>> packets = {
+    {Z21_DataSet::LAN_X, {0xef, 0x00, 0x03, 0x04, 0x80, 0x00, 0x00, 0x00, 0x00, 0x68}},
+    {Z21_DataSet::LAN_X, {0x43, 0x00, 0x05, 0x01, 0x47}},
+    {Z21_DataSet::LAN_SYSTEMSTATE_DATACHANGED, {}},
+    {Z21_DataSet::LAN_X, {0x61, 0x01, 0x60}},
+    {Z21_DataSet::LAN_X, {0xef, 0x00, 0x04, 0x04, 0x80, 0x00, 0x00, 0x00, 0x00, 0x6f}},
+    {Z21_DataSet::LAN_X, {0x64, 0x14, 0x00, 0x1c, 0x06, 0x6e}},
+    {Z21_DataSet::LAN_GET_SERIAL_NUMBER, {}},
+    {Z21_DataSet::LAN_X, {0x81, 0x00, 0x81}},
+};
+
+static const std::vector<uint16_t> dataset_ids = {
+    Z21_DataSet::LAN_GET_SERIAL_NUMBER, Z21_DataSet::LAN_GET_CODE, Z21_DataSet::LAN_GET_HWINFO,
+    Z21_DataSet::LAN_GET_BROADCASTFLAGS, Z21_DataSet::LAN_GET_LOCOMODE, Z21_DataSet::LAN_GET_TURNOUTMODE,
+    Z21_DataSet::LAN_SYSTEMSTATE_DATACHANGED, Z21_DataSet::LAN_X};
+
+// X-Bus command of received data, as identified by a switch on the X-Header and DB0.
+static std::optional<LanXCommands> identify_switch(const std::vector<uint8_t>& data)
+{
+    switch (data[0]) {
+        case 0x43: return LanXCommands::LAN_X_TURNOUT_INFO;
+        case 0x44: return LanXCommands::LAN_X_EXT_ACCESSORY_INFO;
+        case 0x61:
+            switch (data[1]) {
+                case 0x00: return LanXCommands::LAN_X_BC_TRACK_POWER_OFF;
+                case 0x01: return LanXCommands::LAN_X_BC_TRACK_POWER_ON;
+                case 0x02: return LanXCommands::LAN_X_BC_PROGRAMMING_MODE;
+                case 0x08: return LanXCommands::LAN_X_BC_TRACK_SHORT_CIRCUIT;
+                case 0x12: return LanXCommands::LAN_X_CV_NACK_SC;
+                case 0x13: return LanXCommands::LAN_X_CV_NACK;
+                case 0x82: return LanXCommands::LAN_X_UNKNOWN_COMMAND;
+            }
+            return std::nullopt;
+        case 0x62: return LanXCommands::LAN_X_STATUS_CHANGED;
+        case 0x63: return LanXCommands::LAN_X_GET_VERSION_RESPONSE;
+        case 0x64: return LanXCommands::LAN_X_CV_RESULT;
+        case 0x81: return LanXCommands::LAN_X_BC_STOPPED;
+        case 0xef: return LanXCommands::LAN_X_LOCO_INFO;
+        case 0xf3: return LanXCommands::LAN_X_GET_FIRMWARE_VERSION_RESPONSE;
+    }
+    return std::nullopt;
+}
+
+// Dispatch as before: std::map of DataSet handlers (contains() and operator[]), then a switch and a
+// std::map of X-Bus handlers.
+static void BM_DispatchMap(benchmark::State& state)
+{
+    std::map<uint16_t, int> dataset_handlers;
+    for (uint16_t id: dataset_ids) {
+        dataset_handlers[id] = id;
+    }
+    std::map<LanXCommands, int> command_handlers;
+    for (size_t i = 0; i < protocol::LanXDecoders::count; i++) {
+        command_handlers[protocol::LanXDecoders::ids[i]] = i;
+    }
+
+    size_t i = 0;
+    for (auto _: state) {
+        const auto& [id, data] = packets[i++ % packets.size()];
+        int handler = -1;
+        if (dataset_handlers.contains(id)) {
+            handler = dataset_handlers[id];
+            if (id == Z21_DataSet::LAN_X) {
+                if (auto command = identify_switch(data)) {
+                    handler = command_handlers[*command];
+                }
+            }
+        }
+        benchmark::DoNotOptimize(handler);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_DispatchMap);
+
+// Dispatch through flat tables: DataSet handlers indexed by ID, X-Bus handlers by the constexpr lookup table.
+static void BM_DispatchFlat(benchmark::State& state)
+{
+    std::array<int, 0x100> dataset_handlers;
+    dataset_handlers.fill(-1);
+    for (uint16_t id: dataset_ids) {
+        dataset_handlers[id] = id;
+    }
+    std::array<int, protocol::LanXDecoders::count> command_handlers;
+    for (size_t i = 0; i < command_handlers.size(); i++) {
+        command_handlers[i] = i;
+    }
+
+    size_t i = 0;
+    for (auto _: state) {
+        const auto& [id, data] = packets[i++ % packets.size()];
+        int handler = id < dataset_handlers.size() ? dataset_handlers[id] : -1;
+        if (id == Z21_DataSet::LAN_X) {
+            size_t index = protocol::LanXDecoders::find(data);
+            if (index < command_handlers.size()) {
+                handler = command_handlers[index];
+            }
+        }
+        benchmark::DoNotOptimize(handler);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_DispatchFlat);
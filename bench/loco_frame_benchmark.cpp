@@ -0,0 +1,47 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <benchmark/benchmark.h>
+
+#include "../z21/loco_frame_cache.h"
+
+
+// Packing a drive command from scratch, as for addresses outside the cache.
+static void BM_PackDriveFrame(benchmark::State& state)
+{
+    uint8_t speed = 0;
+    for (auto _: state) {
+        LanX_SetLocoDrive lanx_command(3, speed++ & 0x7f, true);
+        Z21_Frame frame = LanX(&lanx_command).frame();
+        benchmark::DoNotOptimize(frame);
+    }
+}
+BENCHMARK(BM_PackDriveFrame);
+
+// Patching the speed into the cached drive frame.
+static void BM_PatchDriveFrame(benchmark::State& state)
+{
+    LocoFrameCache cache;
+    uint8_t speed = 0;
+    for (auto _: state) {
+        auto frame = cache.frame(3, LocoFrameCache::drive_slot, 0x80 | (speed++ & 0x7f));
+        benchmark::DoNotOptimize(frame.data());
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_PatchDriveFrame);
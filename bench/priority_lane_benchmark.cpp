@@ -0,0 +1,132 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include <sys/socket.h>
+#include <benchmark/benchmark.h>
+
+#include "../z21/z21.h"
+
+
+using boost::asio::ip::udp;
+
+// Stand-in for the command station, with the Z21 under test sending to it.
+class Station
+{
+public:
+    explicit Station(const Z21Config& config = Z21Config()) :
+        socket(io_context, udp::endpoint(boost::asio::ip::address_v4::loopback(), 0)),
+        z21("127.0.0.1", std::to_string(socket.local_endpoint().port()), config)
+    {
+        timeval timeout{1, 0};
+        setsockopt(socket.native_handle(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        z21.connect();
+        z21.listen();
+    }
+
+    ~Station()
+    {
+        stop_bulk();
+    }
+
+    // Keep the bulk lane full of CV reads from another thread.
+    void saturate_bulk()
+    {
+        bulk_running = true;
+        bulk_producer = std::thread([this]() {
+            uint16_t cv = 1;
+            while (bulk_running) {
+                z21.xbus_cv_read(cv++);
+            }
+        });
+        while (z21.send_stats().bulk_queue_depth < 1000) {
+            std::this_thread::yield();
+        }
+    }
+
+    void stop_bulk()
+    {
+        bulk_running = false;
+        if (bulk_producer.joinable()) {
+            bulk_producer.join();
+        }
+    }
+
+    // Receive until a datagram holds a DataSet with the given X-Bus header, false on timeout.
+    bool receive_until(uint8_t x_header)
+    {
+        std::array<uint8_t, 1500> buffer;
+        boost::system::error_code error;
+        while (true) {
+            size_t size = socket.receive(boost::asio::buffer(buffer), 0, error);
+            if (error) {
+                return false;
+            }
+            for (size_t pos = 0; pos + 4 < size; pos += buffer[pos]) {
+                if (buffer[pos + 2] == 0x40 && buffer[pos + 4] == x_header) {
+                    return true;
+                }
+            }
+        }
+    }
+
+    boost::asio::io_context io_context;
+    udp::socket socket;
+    Z21 z21;
+    std::atomic<bool> bulk_running{false};
+    std::thread bulk_producer;
+};
+
+
+// Time from a request until the command station has it, with the bulk lane idle or saturated.
+template<typename Request>
+static void measure_latency(benchmark::State& state, Request request, uint8_t x_header)
+{
+    Z21Config config;
+    config.bulk_rate = 2000;
+    Station station(config);
+    if (state.range(0)) {
+        station.saturate_bulk();
+    }
+
+    for (auto _: state) {
+        auto start = std::chrono::steady_clock::now();
+        request(station.z21);
+        if (!station.receive_until(x_header)) {
+            state.SkipWithError("request not received");
+            break;
+        }
+        state.SetIterationTime(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    state.counters["bulk_queue_depth"] = station.z21.send_stats().bulk_queue_depth;
+}
+
+static void BM_StopLatency(benchmark::State& state)
+{
+    measure_latency(state, [](Z21& z21) { z21.xbus_set_stop(); }, 0x80);
+}
+BENCHMARK(BM_StopLatency)->ArgName("bulk_saturated")->Arg(0)->Arg(1)->UseManualTime()->Unit(benchmark::kMicrosecond);
+
+static void BM_TurnoutLatency(benchmark::State& state)
+{
+    measure_latency(state, [](Z21& z21) { z21.xbus_set_turnout(12, 0x89); }, 0x53);
+}
+BENCHMARK(BM_TurnoutLatency)->ArgName("bulk_saturated")->Arg(0)->Arg(1)->UseManualTime()->Unit(benchmark::kMicrosecond);
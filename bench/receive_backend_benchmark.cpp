@@ -0,0 +1,140 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <array>
+#include <thread>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+#include <boost/log/trivial.hpp>
+
+#include "../z21/z21.h"
+
+
+using boost::asio::ip::udp;
+
+namespace
+{
+    // Receive path under test: asio one datagram per completion, asio with recvmmsg(), io_uring or a
+    // busy-polling thread.
+    enum Backend { ASIO_SINGLE, ASIO_BATCH, IO_URING, BUSY_POLL };
+
+    Z21Config config_for(int64_t backend)
+    {
+        Z21Config config;
+        config.receive_batch = backend == ASIO_BATCH || backend == BUSY_POLL ? 32 : 1;
+        switch (backend) {
+            case IO_URING:
+                config.receive_backend = ReceiveBackend::IO_URING;
+                break;
+            case BUSY_POLL:
+                config.receive_backend = ReceiveBackend::BUSY_POLL;
+                break;
+            default:
+                config.receive_backend = ReceiveBackend::ASIO;
+        }
+        return config;
+    }
+
+    /**
+     * Z21 instance receiving from a local socket standing in for the command station.
+     */
+    struct Station
+    {
+        explicit Station(int64_t backend) :
+            z21("127.0.0.1", std::to_string(socket.local_endpoint().port()), config_for(backend))
+        {
+            // Measure the receive path, not console logging of every DataSet.
+            boost::log::core::get()->set_filter(boost::log::trivial::severity >= boost::log::trivial::warning);
+            z21.connect();
+            z21.listen();
+
+            // LAN_GET_SERIAL_NUMBER tells where the Z21 instance listens.
+            std::array<uint8_t, 1500> buffer;
+            socket.receive_from(boost::asio::buffer(buffer), client);
+        }
+
+        ~Station()
+        {
+            boost::log::core::get()->reset_filter();
+        }
+
+        void report(benchmark::State& state, int64_t backend)
+        {
+            Z21ReceiveStats stats = z21.receive_stats();
+            if (backend == IO_URING && stats.receive_backend != ReceiveBackend::IO_URING) {
+                state.SkipWithError("io_uring not available");
+                return;
+            }
+            double datagrams = stats.datagrams_received;
+            state.counters["wakeups_per_datagram"] = stats.receive_wakeups / datagrams;
+            state.counters["syscalls_per_datagram"] = stats.receive_syscalls / datagrams;
+            // Includes time spent spinning on an empty socket with BUSY_POLL.
+            state.counters["cpu_ns_per_datagram"] = stats.receive_cpu_time.count() / datagrams;
+            state.SetItemsProcessed(stats.datagrams_received);
+        }
+
+        boost::asio::io_context io_context;
+        udp::socket socket{io_context, udp::endpoint(boost::asio::ip::address_v4::loopback(), 0)};
+        udp::endpoint client;
+        Z21 z21;
+    };
+
+    const std::vector<uint8_t> loco_info = {0x0e, 0x00, 0x40, 0x00, 0xef, 0x00, 0x03, 0x04, 0x80, 0x00, 0x00, 0x00, 0x00, 0x68};
+}
+
+// Bursts of LAN_X_LOCO_INFO datagrams, as the Z21 sends with all loco info broadcast flags set.
+static void BM_ReceiveBackendBurst(benchmark::State& state)
+{
+    constexpr size_t burst = 64;
+    Station station(state.range(0));
+
+    uint64_t expected = 0;
+    for (auto _: state) {
+        for (size_t i = 0; i < burst; i++) {
+            station.socket.send_to(boost::asio::buffer(loco_info), station.client);
+        }
+        expected += burst;
+        while (station.z21.receive_stats().datagrams_received < expected) {
+            std::this_thread::yield();
+        }
+    }
+    station.report(state, state.range(0));
+}
+BENCHMARK(BM_ReceiveBackendBurst)->Arg(ASIO_SINGLE)->Arg(ASIO_BATCH)->Arg(IO_URING)->Arg(BUSY_POLL)->UseRealTime();
+
+// Single datagrams, each sent once the previous one was handled: time per iteration is the latency from
+// sending to the receiving thread having handled it. BUSY_POLL needs a core of its own to show its lower
+// latency; sharing one with the sender, they take turns by scheduler time slice.
+static void BM_ReceiveBackendLatency(benchmark::State& state)
+{
+    Station station(state.range(0));
+
+    uint64_t expected = 0;
+    for (auto _: state) {
+        station.socket.send_to(boost::asio::buffer(loco_info), station.client);
+        expected++;
+        while (station.z21.receive_stats().datagrams_received < expected) {
+            std::this_thread::yield();
+        }
+    }
+    station.report(state, state.range(0));
+}
+BENCHMARK(BM_ReceiveBackendLatency)->Arg(ASIO_SINGLE)->Arg(ASIO_BATCH)->Arg(IO_URING)->Arg(BUSY_POLL)->UseRealTime();
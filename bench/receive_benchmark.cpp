@@ -0,0 +1,73 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+#include <boost/log/trivial.hpp>
+
+#include "../z21/z21.h"
+
+
+using boost::asio::ip::udp;
+
+// Bursts of LAN_X_LOCO_INFO datagrams, as the Z21 sends with all loco info broadcast flags set, received
+// one per completion (1) or drained with recvmmsg() (batch size).
+static void BM_ReceiveBurst(benchmark::State& state)
+{
+    constexpr size_t burst = 64;
+
+    // Measure the receive path, not console logging of every DataSet.
+    boost::log::core::get()->set_filter(boost::log::trivial::severity >= boost::log::trivial::warning);
+
+    boost::asio::io_context io_context;
+    udp::socket station(io_context, udp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+    Z21Config config;
+    config.receive_batch = state.range(0);
+    Z21 z21("127.0.0.1", std::to_string(station.local_endpoint().port()), config);
+    z21.connect();
+    z21.listen();
+
+    // LAN_GET_SERIAL_NUMBER tells where the Z21 instance listens.
+    std::array<uint8_t, 1500> buffer;
+    udp::endpoint client;
+    station.receive_from(boost::asio::buffer(buffer), client);
+
+    std::vector<uint8_t> loco_info = {0x0e, 0x00, 0x40, 0x00, 0xef, 0x00, 0x03, 0x04, 0x80, 0x00, 0x00, 0x00, 0x00, 0x68};
+    uint64_t expected = 0;
+    for (auto _: state) {
+        for (size_t i = 0; i < burst; i++) {
+            station.send_to(boost::asio::buffer(loco_info), client);
+        }
+        expected += burst;
+        while (z21.receive_stats().datagrams_received < expected) {
+            std::this_thread::yield();
+        }
+    }
+
+    Z21ReceiveStats stats = z21.receive_stats();
+    state.counters["datagrams_per_syscall"] = static_cast<double>(stats.datagrams_received) / stats.receive_syscalls;
+    state.counters["cpu_ns_per_datagram"] = static_cast<double>(stats.receive_cpu_time.count()) / stats.datagrams_received;
+    state.SetItemsProcessed(stats.datagrams_received);
+    boost::log::core::get()->reset_filter();
+}
+BENCHMARK(BM_ReceiveBurst)->Arg(1)->Arg(32)->UseRealTime();
@@ -0,0 +1,125 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include "../z21/accessory_state_table.h"
+
+
+using namespace testing;
+
+using TurnoutStatus = AccessoryStateTable::TurnoutStatus;
+
+
+class AccessoryStateTableTest : public ::testing::Test
+{
+protected:
+    virtual void SetUp()
+    {
+    }
+
+    virtual void TearDown()
+    {
+    }
+
+    bool set_turnout(uint16_t address, TurnoutStatus status)
+    {
+        return table.update(message::TurnoutInfo{address, status});
+    }
+
+    std::vector<uint16_t> unknown_turnouts(uint16_t first, uint16_t last)
+    {
+        std::vector<uint16_t> unknown;
+        table.unknown_turnouts(first, last, [&unknown](uint16_t address) { unknown.push_back(address); });
+        return unknown;
+    }
+
+    AccessoryStateTable table;
+};
+
+
+TEST_F(AccessoryStateTableTest, KeepsTurnoutStatus)
+{
+    ASSERT_EQ(table.turnout(12), TurnoutStatus::NOT_SWITCHED);
+
+    ASSERT_TRUE(set_turnout(12, TurnoutStatus::SWITCHED_P1));
+    ASSERT_TRUE(set_turnout(13, TurnoutStatus::SWITCHED_P0));
+    ASSERT_FALSE(set_turnout(13, TurnoutStatus::SWITCHED_P0));
+    ASSERT_TRUE(set_turnout(4095, TurnoutStatus::SWITCHED_P1));
+    ASSERT_FALSE(set_turnout(4096, TurnoutStatus::SWITCHED_P1));
+
+    ASSERT_EQ(table.turnout(12), TurnoutStatus::SWITCHED_P1);
+    ASSERT_EQ(table.turnout(13), TurnoutStatus::SWITCHED_P0);
+    ASSERT_EQ(table.turnout(14), TurnoutStatus::NOT_SWITCHED);
+    ASSERT_EQ(table.turnout(4095), TurnoutStatus::SWITCHED_P1);
+    ASSERT_EQ(table.turnout(4096), TurnoutStatus::NOT_SWITCHED);
+
+    // Not decodable makes the position unknown again.
+    ASSERT_TRUE(set_turnout(12, TurnoutStatus::UNKNOWN));
+    ASSERT_EQ(table.turnout(12), TurnoutStatus::NOT_SWITCHED);
+}
+
+TEST_F(AccessoryStateTableTest, VisitsTurnoutsInRange)
+{
+    set_turnout(30, TurnoutStatus::SWITCHED_P0);
+    set_turnout(33, TurnoutStatus::SWITCHED_P1);
+
+    std::vector<std::pair<uint16_t, TurnoutStatus>> visited;
+    table.turnouts(30, 33, [&visited](uint16_t address, TurnoutStatus status) { visited.emplace_back(address, status); });
+    ASSERT_THAT(visited, ElementsAre(Pair(30, TurnoutStatus::SWITCHED_P0), Pair(31, TurnoutStatus::NOT_SWITCHED),
+                                     Pair(32, TurnoutStatus::NOT_SWITCHED), Pair(33, TurnoutStatus::SWITCHED_P1)));
+}
+
+TEST_F(AccessoryStateTableTest, FindsUnknownTurnouts)
+{
+    for (uint16_t address = 0; address < 600; address++) {
+        if (address != 31 && address != 32 && address != 599) {
+            set_turnout(address, address % 2 ? TurnoutStatus::SWITCHED_P0 : TurnoutStatus::SWITCHED_P1);
+        }
+    }
+
+    ASSERT_THAT(unknown_turnouts(0, 599), ElementsAre(31, 32, 599));
+    ASSERT_THAT(unknown_turnouts(32, 598), ElementsAre(32));
+    ASSERT_THAT(unknown_turnouts(33, 63), IsEmpty());
+    ASSERT_THAT(unknown_turnouts(4090, 5000), ElementsAre(4090, 4091, 4092, 4093, 4094, 4095));
+    ASSERT_THAT(unknown_turnouts(10, 9), IsEmpty());
+    ASSERT_EQ(table.count_unknown_turnouts(0, 599), 3);
+    ASSERT_EQ(table.count_unknown_turnouts(0, 4095), 4096 - 597);
+}
+
+TEST_F(AccessoryStateTableTest, KeepsExtAccessoryState)
+{
+    ASSERT_FALSE(table.ext_accessory(5).has_value());
+
+    ASSERT_TRUE(table.update(message::ExtAccessoryInfo{5, 0x12, true}));
+    ASSERT_FALSE(table.update(message::ExtAccessoryInfo{5, 0x12, true}));
+    ASSERT_EQ(table.ext_accessory(5), 0x12);
+
+    // A zero state is still known.
+    ASSERT_TRUE(table.update(message::ExtAccessoryInfo{6, 0x00, true}));
+    ASSERT_EQ(table.ext_accessory(6), 0x00);
+
+    ASSERT_TRUE(table.update(message::ExtAccessoryInfo{5, 0x12, false}));
+    ASSERT_FALSE(table.ext_accessory(5).has_value());
+    ASSERT_FALSE(table.update(message::ExtAccessoryInfo{2048, 0x01, true}));
+}
@@ -0,0 +1,214 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include "../z21/z21.h"
+
+
+using namespace testing;
+using boost::asio::ip::udp;
+
+// Heap allocations made by the current thread, counted by the replaced global operator new below.
+static thread_local size_t allocation_count = 0;
+
+void* operator new(std::size_t size)
+{
+    allocation_count++;
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+
+
+class AllocationTest : public ::testing::Test
+{
+protected:
+    virtual void SetUp()
+    {
+    }
+
+    virtual void TearDown()
+    {
+    }
+};
+
+
+TEST_F(AllocationTest, PackDataSetsIntoFrame)
+{
+    size_t bytes = 0;
+    size_t before = allocation_count;
+
+    bytes += LanGetSerialNumber().frame().size;
+    bytes += LanGetCode().frame().size;
+    bytes += LanGetHWInfo().frame().size;
+    bytes += LanLogoff().frame().size;
+    bytes += LanSetBroadcastFlags(BroadcastFlags::DRIVING_AND_SWITCHING).frame().size;
+    bytes += LanGetBroadcastFlags().frame().size;
+    bytes += LanGetLocomode(3).frame().size;
+    bytes += LanSetLocomode(3, Locomode::DCC).frame().size;
+    bytes += LanGetTurnoutmode(3).frame().size;
+    bytes += LanSetTurnoutmode(3, Locomode::MM).frame().size;
+    bytes += LanSystemstateGetData().frame().size;
+
+    ASSERT_EQ(allocation_count - before, 0);
+    ASSERT_EQ(bytes, 4 * 11 + 4 + 2 + 3 + 2 + 3);
+}
+
+
+TEST_F(AllocationTest, PackLanXCommandsIntoFrame)
+{
+    LanX_GetVersion get_version;
+    LanX_GetStatus get_status;
+    LanX_SetTrackPowerOff track_power_off;
+    LanX_SetTrackPowerOn track_power_on;
+    LanX_DccReadRegister dcc_read_register(1);
+    LanX_CvRead cv_read(29);
+    LanX_DccWriteRegister dcc_write_register(1, 2);
+    LanX_CvWrite cv_write(29, 6);
+    LanX_MmWriteByte mm_write_byte(1, 2);
+    LanX_GetTurnoutInfo get_turnout_info(12);
+    LanX_GetExtAccessoryInfo get_ext_accessory_info(12);
+    LanX_SetTurnout set_turnout(12, 0x89);
+    LanX_SetExtAccessory set_ext_accessory(12, 3);
+    LanX_SetStop set_stop;
+    LanX_GetLocoInfo get_loco_info(3);
+    LanX_SetLocoDrive set_loco_drive(3, 40, true);
+    LanX_SetLocoFunction set_loco_function(3, 0x40);
+    LanX_SetLocoFunctionGroup set_loco_function_group(3, LanX_SetLocoFunctionGroup::GROUP_2, 0x05);
+    LanX_SetLocoBinaryState set_loco_binary_state(3, true, 40);
+    LanX_CvPomWriteByte cv_pom_write_byte(3, 29, 6);
+    LanX_CvPomWriteBit cv_pom_write_bit(3, 29, 1, 1);
+    LanX_CvPomReadByte cv_pom_read_byte(3, 29);
+    LanX_CvPomAccessoryWriteByte cv_pom_accessory_write_byte(12, PomAccessorySelection::WHOLE_DECODER, 0, 29, 6);
+    LanX_CvPomAccessoryWriteBit cv_pom_accessory_write_bit(12, PomAccessorySelection::SPECIFIC_OUTPUT, 1, 29, 1, 1);
+    LanX_CvPomAccessoryReadByte cv_pom_accessory_read_byte(12, PomAccessorySelection::WHOLE_DECODER, 0, 29);
+    LanX_GetFirmwareVersion get_firmware_version;
+
+    std::vector<LanX_Command*> commands = {
+            &get_version, &get_status, &track_power_off, &track_power_on, &dcc_read_register, &cv_read,
+            &dcc_write_register, &cv_write, &mm_write_byte, &get_turnout_info, &get_ext_accessory_info, &set_turnout,
+            &set_ext_accessory, &set_stop, &get_loco_info, &set_loco_drive, &set_loco_function,
+            &set_loco_function_group, &set_loco_binary_state, &cv_pom_write_byte, &cv_pom_write_bit,
+            &cv_pom_read_byte, &cv_pom_accessory_write_byte, &cv_pom_accessory_write_bit,
+            &cv_pom_accessory_read_byte, &get_firmware_version
+    };
+
+    size_t before = allocation_count;
+    for (LanX_Command* command: commands) {
+        Z21_Frame frame = LanX(command).frame();
+        ASSERT_GT(frame.size, header_size) << "command " << static_cast<int>(command->id);
+    }
+    ASSERT_EQ(allocation_count - before, 0);
+}
+
+
+TEST_F(AllocationTest, PatchLocoFrames)
+{
+    LocoFrameCache cache;
+    cache.frame(3, LocoFrameCache::drive_slot, 0);
+    cache.frame(3, LocoFrameCache::function_group_slot(LanX_SetLocoFunctionGroup::GROUP_1), 0);
+
+    size_t before = allocation_count;
+    size_t bytes = 0;
+    for (uint8_t value = 0; value < 128; value++) {
+        bytes += cache.frame(3, LocoFrameCache::drive_slot, value).size();
+        bytes += cache.frame(3, LocoFrameCache::function_group_slot(LanX_SetLocoFunctionGroup::GROUP_1), value).size();
+    }
+    ASSERT_EQ(allocation_count - before, 0);
+    ASSERT_EQ(bytes, 2 * 128 * LocoFrameCache::frame_size);
+}
+
+
+TEST_F(AllocationTest, DecodeWithoutAllocation)
+{
+    LanX lan_x;
+    LanGetSerialNumber serial_number;
+    LanSystemstateDatachanged system_state;
+
+    std::array<uint8_t, 10> loco_info = {0xef, 0x00, 0x03, 0x04, 0x80, 0x00, 0x00, 0x00, 0x00, 0x68};
+    std::array<uint8_t, 5> turnout_info = {0x43, 0x00, 0x05, 0x01, 0x47};
+    std::array<uint8_t, 4> serial = {0x01, 0x02, 0x00, 0x00};
+    std::array<uint8_t, 16> state = {0x10, 0x00, 0x00, 0x00, 0x10, 0x00, 0x20, 0x00, 0x00, 0x48, 0x00, 0x48, 0x02};
+
+    size_t before = allocation_count;
+    for (int i = 0; i < 100; i++) {
+        lan_x.unpack(loco_info);
+        lan_x.unpack(turnout_info);
+        serial_number.unpack(serial);
+        system_state.unpack(state);
+    }
+    ASSERT_EQ(allocation_count - before, 0);
+    ASSERT_EQ(std::get<message::TurnoutInfo>(lan_x.message()).address, 5);
+    ASSERT_EQ(serial_number.serial_number, 0x201);
+    ASSERT_EQ(system_state.temperature, 32);
+    ASSERT_TRUE(system_state.track_voltage_off);
+}
+
+
+TEST_F(AllocationTest, SendWithoutAllocation)
+{
+    boost::asio::io_context io_context;
+    udp::socket receiver(io_context, udp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+
+    Z21 z21("127.0.0.1", std::to_string(receiver.local_endpoint().port()));
+    ASSERT_TRUE(z21.connect());
+    z21.listen();
+
+    // LAN_GET_SERIAL_NUMBER sent by the listener.
+    std::array<uint8_t, 1500> buffer;
+    ASSERT_EQ(receiver.receive(boost::asio::buffer(buffer)), 4);
+
+    // The stop first, as it drops what is queued before it.
+    size_t before = allocation_count;
+    z21.xbus_set_stop();
+    z21.xbus_set_loco_drive(3, 40, true);
+    z21.xbus_set_loco_function_group(3, LanX_SetLocoFunctionGroup::GROUP_1, 0x10);
+    z21.xbus_set_turnout(12, 0x89);
+    z21.xbus_cv_pom_write_byte(3, 29, 6);
+    z21.set_broadcast_flags();
+    ASSERT_EQ(allocation_count - before, 0);
+
+    // Six DataSets, in either order.
+    std::vector<std::vector<uint8_t>> datasets;
+    while (datasets.size() < 6) {
+        size_t size = receiver.receive(boost::asio::buffer(buffer));
+        for (size_t pos = 0; pos < size; pos += buffer[pos]) {
+            datasets.emplace_back(buffer.begin() + pos, buffer.begin() + pos + buffer[pos]);
+        }
+    }
+
+    std::vector<uint8_t> expected = {0x0a, 0x00, 0x40, 0x00, 0xe4, 0x12, 0x00, 0x03, 0xa8, 0x5d};
+    ASSERT_THAT(datasets, Contains(expected));
+}
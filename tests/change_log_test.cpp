@@ -0,0 +1,114 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include "../z21/change_log.h"
+
+
+using namespace testing;
+
+
+class ChangeLogTest : public ::testing::Test
+{
+protected:
+    virtual void SetUp()
+    {
+    }
+
+    virtual void TearDown()
+    {
+    }
+
+    static std::vector<StateChange> changes(const ChangeLog& log, uint64_t& version)
+    {
+        std::vector<StateChange> result;
+        version = log.changes_since(version, [&result](const StateChange& change) { result.push_back(change); });
+        return result;
+    }
+};
+
+
+TEST_F(ChangeLogTest, StampsChangesWithIncreasingVersions)
+{
+    ChangeLog log;
+    ASSERT_EQ(log.version(), 0);
+    ASSERT_EQ(log.record(StateChange::LOCO, 3), 1);
+    ASSERT_EQ(log.record(StateChange::TURNOUT, 300), 2);
+    ASSERT_EQ(log.record(StateChange::SYSTEM_STATE, 0), 3);
+    ASSERT_EQ(log.version(), 3);
+
+    // Out of range keys are not a change.
+    ASSERT_EQ(log.record(StateChange::EXT_ACCESSORY, 5000), 3);
+    ASSERT_EQ(log.record(StateChange::SYSTEM_STATE, 1), 3);
+}
+
+TEST_F(ChangeLogTest, ReportsEachKeyOnceAtItsLatestChange)
+{
+    ChangeLog log;
+    log.record(StateChange::LOCO, 3);
+    log.record(StateChange::TURNOUT, 300);
+    log.record(StateChange::LOCO, 3);
+    log.record(StateChange::EXT_ACCESSORY, 20);
+
+    uint64_t version = 0;
+    std::vector<StateChange> result = changes(log, version);
+    ASSERT_EQ(version, 4);
+    ASSERT_EQ(result.size(), 3);
+    ASSERT_EQ(result[0].kind, StateChange::TURNOUT);
+    ASSERT_EQ(result[0].key, 300);
+    ASSERT_EQ(result[0].version, 2);
+    ASSERT_EQ(result[1].kind, StateChange::LOCO);
+    ASSERT_EQ(result[1].key, 3);
+    ASSERT_EQ(result[1].version, 3);
+    ASSERT_EQ(result[2].kind, StateChange::EXT_ACCESSORY);
+    ASSERT_EQ(result[2].key, 20);
+
+    // Nothing new, then only what changed since.
+    ASSERT_TRUE(changes(log, version).empty());
+    log.record(StateChange::TURNOUT, 301);
+    result = changes(log, version);
+    ASSERT_EQ(result.size(), 1);
+    ASSERT_EQ(result[0].key, 301);
+    ASSERT_EQ(version, 5);
+}
+
+TEST_F(ChangeLogTest, ScansWhenFallenBehindTheRing)
+{
+    ChangeLog log;
+    log.record(StateChange::TURNOUT, 1);
+    uint64_t version = log.version();
+
+    // More changes than the ring holds, to fewer keys, some changed again after.
+    for (size_t i = 0; i < ChangeLog::capacity + 100; i++) {
+        log.record(StateChange::LOCO, static_cast<uint16_t>(i % 1000));
+    }
+    log.record(StateChange::LOCO, 7);
+
+    std::vector<StateChange> result = changes(log, version);
+    ASSERT_EQ(version, ChangeLog::capacity + 102);
+    ASSERT_EQ(result.size(), 1000);
+    for (const StateChange& change : result) {
+        ASSERT_EQ(change.kind, StateChange::LOCO);
+    }
+    ASSERT_EQ(result[7].key, 7);
+    ASSERT_EQ(result[7].version, version);
+}
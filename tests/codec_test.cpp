@@ -0,0 +1,146 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <array>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include "../z21/z21_protocol.h"
+
+
+using namespace testing;
+
+
+class CodecTest : public ::testing::Test
+{
+protected:
+    virtual void SetUp()
+    {
+    }
+
+    virtual void TearDown()
+    {
+    }
+
+    template<typename Message>
+    static std::vector<uint8_t> encoded(const typename Message::Fields& fields)
+    {
+        std::array<uint8_t, 16> buffer{};
+        size_t size = codec::encode<Message>(fields, buffer);
+        return std::vector<uint8_t>(buffer.begin(), buffer.begin() + size);
+    }
+};
+
+
+// Encoding is usable in constant expressions.
+static_assert([] {
+    std::array<uint8_t, 6> buffer{};
+    codec::encode<protocol::SetLocoDrive>({3, 0x28, true}, buffer);
+    return buffer == std::array<uint8_t, 6>{0xe4, 0x12, 0x00, 0x03, 0xa8, 0x5d};
+}());
+
+static_assert(protocol::LanXDecoders::identify(std::array<uint8_t, 3>{0x61, 0x82, 0xe3}) ==
+              LanXCommands::LAN_X_UNKNOWN_COMMAND);
+
+
+TEST_F(CodecTest, EncodesFieldsIntoPattern)
+{
+    ASSERT_THAT(encoded<protocol::SetStop>({}), ElementsAre(0x80, 0x80));
+    ASSERT_THAT(encoded<protocol::SetLocoDrive>({0x1234, 0x7f, false}), ElementsAre(0xe4, 0x12, 0x12, 0x34, 0x7f, 0xaf));
+    ASSERT_THAT(encoded<protocol::CvRead>({1}), ElementsAre(0x23, 0x11, 0x00, 0x00, 0x32));
+    ASSERT_THAT(encoded<protocol::CvPomWriteBit>({.address = 3, .selection = 0, .output = 0, .cv = 0x301, .value = 0, .bit_value = true, .bit_position = 5}),
+                ElementsAre(0xe6, 0x30, 0x00, 0x03, 0xeb, 0x00, 0x0d, 0x33));
+    ASSERT_THAT(encoded<protocol::CvPomAccessoryReadByte>({.address = 0x1ab, .selection = 0x08, .output = 3, .cv = 2, .value = 0, .bit_value = false, .bit_position = 0}),
+                ElementsAre(0xe6, 0x31, 0x1a, 0xbb, 0xe4, 0x01, 0x00, 0x93));
+    ASSERT_THAT(encoded<protocol::BroadcastFlags>({0x01020304}), ElementsAre(0x04, 0x03, 0x02, 0x01));
+}
+
+TEST_F(CodecTest, RejectsTooSmallBuffer)
+{
+    std::array<uint8_t, 5> buffer{};
+    ASSERT_EQ(codec::encode<protocol::SetLocoDrive>({3, 0, true}, buffer), 0);
+    ASSERT_EQ(codec::encode<protocol::GetLocoInfo>({3}, buffer), 5);
+}
+
+TEST_F(CodecTest, DecodesWhatItEncodes)
+{
+    protocol::CvResult::Fields cv{0x3ff, 0x42};
+    std::vector<uint8_t> data = encoded<protocol::CvResult>(cv);
+    auto decoded = codec::decode<protocol::CvResult>(data);
+    ASSERT_TRUE(decoded);
+    ASSERT_EQ(decoded->cv, 0x3ff);
+    ASSERT_EQ(decoded->value, 0x42);
+
+    protocol::SystemState::Fields state{};
+    state.main_current = -2;
+    state.temperature = 35;
+    state.vcc_voltage = 0xabcd;
+    state.central_state = 0x21;
+    data = encoded<protocol::SystemState>(state);
+    auto system = codec::decode<protocol::SystemState>(data);
+    ASSERT_TRUE(system);
+    ASSERT_EQ(system->main_current, -2);
+    ASSERT_EQ(system->temperature, 35);
+    ASSERT_EQ(system->vcc_voltage, 0xabcd);
+    ASSERT_TRUE(system->emergency_stop);
+    ASSERT_TRUE(system->programming_mode);
+    ASSERT_FALSE(system->short_circuit);
+}
+
+TEST_F(CodecTest, DecodesOptionalTrailingBytes)
+{
+    std::vector<uint8_t> data = {0xef, 0xc0 | 0x12, 0x34, 0x0c, 0x85, 0x31, 0x01, 0x00, 0x80, 0x00};
+    auto info = codec::decode<protocol::LocoInfo>(data);
+    ASSERT_TRUE(info);
+    ASSERT_EQ(info->address, 0x1234);
+    ASSERT_TRUE(info->busy);
+    ASSERT_EQ(info->speed_steps, 4);
+    ASSERT_TRUE(info->forward);
+    ASSERT_EQ(info->speed, 5);
+    ASSERT_TRUE(info->smart_search);
+    ASSERT_EQ(info->functions, 0x1u | 0x2u | (1u << 5) | (1u << 28));
+
+    // DB8 with F29-F31 before the checksum.
+    data = {0xef, 0x00, 0x03, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x05, 0x00};
+    ASSERT_EQ(codec::decode<protocol::LocoInfo>(data)->functions, (1u << 29) | (1u << 31));
+
+    // DB9-DB13 with F32-F68, from newer firmware.
+    data = {0xef, 0x00, 0x03, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x80, 0x10, 0x00};
+    info = codec::decode<protocol::LocoInfo>(data);
+    ASSERT_EQ(info->functions, (uint64_t{1} << 32) | (uint64_t{1} << 63));
+    ASSERT_EQ(info->functions_high, 0x10);
+
+    data.resize(8);
+    ASSERT_FALSE(codec::decode<protocol::LocoInfo>(data));
+}
+
+TEST_F(CodecTest, IdentifiesReceivedMessages)
+{
+    auto identify = [](std::vector<uint8_t> data) { return protocol::LanXDecoders::identify(data); };
+
+    ASSERT_EQ(identify({0x43, 0x00, 0x01, 0x01, 0x43}), LanXCommands::LAN_X_TURNOUT_INFO);
+    ASSERT_EQ(identify({0x61, 0x01, 0x60}), LanXCommands::LAN_X_BC_TRACK_POWER_ON);
+    ASSERT_EQ(identify({0x61, 0x82, 0xe3}), LanXCommands::LAN_X_UNKNOWN_COMMAND);
+    ASSERT_EQ(identify({0xef, 0x00}), LanXCommands::LAN_X_LOCO_INFO);
+    ASSERT_FALSE(identify({0x61, 0x55, 0x34}));
+    ASSERT_FALSE(identify({0x61}));
+    ASSERT_FALSE(identify({0xe4, 0x12}));
+    ASSERT_FALSE(identify({}));
+}
@@ -16,6 +16,7 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#include <array>
 #include <vector>
 #include <memory>
 
@@ -50,3 +51,25 @@ TEST_F(LanX_CommandTest, LanGetHWInfo)
     response.unpack(response_data);
     ASSERT_EQ(response.fw_version, "1.33");
 }
+
+
+TEST_F(LanX_CommandTest, LanX_SetLocoDrive)
+{
+    LanX_SetLocoDrive command(3, 40, true);
+
+    std::vector<uint8_t> expected = {0xe4, 0x12, 0x00, 0x03, 0xa8, 0x5d};
+    ASSERT_EQ(command.pack(), expected);
+
+    std::array<uint8_t, 6> buffer;
+    ASSERT_EQ(command.pack_into(buffer), 6);
+    ASSERT_EQ(std::vector<uint8_t>(buffer.begin(), buffer.end()), expected);
+
+    std::array<uint8_t, 5> too_small;
+    ASSERT_EQ(command.pack_into(too_small), 0);
+}
+
+TEST_F(LanX_CommandTest, LanX_SetLocoFunctionGroupInvalid)
+{
+    LanX_SetLocoFunctionGroup command(3, static_cast<LanX_SetLocoFunctionGroup::FunctionGroup>(0x30), 0x01);
+    ASSERT_TRUE(command.pack().empty());
+}
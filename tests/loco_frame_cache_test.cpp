@@ -0,0 +1,86 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include "../z21/loco_frame_cache.h"
+
+
+using namespace testing;
+
+
+class LocoFrameCacheTest : public ::testing::Test
+{
+protected:
+    virtual void SetUp()
+    {
+    }
+
+    virtual void TearDown()
+    {
+    }
+
+    static std::vector<uint8_t> packed(LanX_Command& command)
+    {
+        return LanX(&command).pack();
+    }
+
+    static std::vector<uint8_t> to_vector(std::span<const uint8_t> frame)
+    {
+        return std::vector<uint8_t>(frame.begin(), frame.end());
+    }
+
+    LocoFrameCache cache;
+};
+
+
+TEST_F(LocoFrameCacheTest, PatchesDriveFrame)
+{
+    for (uint16_t address: {1, 3, 127, 128, 9999, 10239}) {
+        for (uint8_t value: {0x00, 0xa8, 0x28, 0xff, 0x80, 0x01}) {
+            LanX_SetLocoDrive expected(address, value & 0x7f, value & 0x80);
+            ASSERT_EQ(to_vector(cache.frame(address, LocoFrameCache::drive_slot, value)), packed(expected))
+                << "address " << address << ", value " << static_cast<int>(value);
+        }
+    }
+}
+
+
+TEST_F(LocoFrameCacheTest, PatchesFunctionGroupFrames)
+{
+    for (auto group: LocoFrameCache::function_groups) {
+        uint8_t slot = LocoFrameCache::function_group_slot(group);
+        for (uint8_t value: {0x00, 0x1f, 0x10, 0xff, 0x55}) {
+            LanX_SetLocoFunctionGroup expected(3, group, value);
+            ASSERT_EQ(to_vector(cache.frame(3, slot, value)), packed(expected))
+                << "group " << static_cast<int>(group) << ", value " << static_cast<int>(value);
+        }
+    }
+}
+
+
+TEST_F(LocoFrameCacheTest, MapsFunctionGroupsToSlots)
+{
+    ASSERT_EQ(LocoFrameCache::function_group_slot(LanX_SetLocoFunctionGroup::GROUP_1), 1);
+    ASSERT_EQ(LocoFrameCache::function_group_slot(LanX_SetLocoFunctionGroup::GROUP_10), 10);
+    ASSERT_EQ(LocoFrameCache::function_group_slot(static_cast<LanX_SetLocoFunctionGroup::FunctionGroup>(0x99)),
+              LocoFrameCache::slots);
+}
@@ -0,0 +1,166 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include "../z21/loco_slot_table.h"
+
+
+using namespace testing;
+
+using Taken = std::tuple<uint16_t, uint8_t, uint8_t>;
+
+
+class LocoSlotTableTest : public ::testing::Test
+{
+protected:
+    virtual void SetUp()
+    {
+    }
+
+    virtual void TearDown()
+    {
+    }
+
+    std::vector<Taken> take_all()
+    {
+        std::vector<Taken> taken;
+        table.take([&taken](uint16_t address, uint8_t slot, uint8_t value) {
+            taken.emplace_back(address, slot, value);
+            return true;
+        });
+        return taken;
+    }
+
+    LocoSlotTable table;
+};
+
+
+TEST_F(LocoSlotTableTest, LatestValueWins)
+{
+    ASSERT_TRUE(table.store(3, 0, 10));
+    ASSERT_FALSE(table.store(3, 0, 20));
+    ASSERT_TRUE(table.store(3, 1, 5));
+
+    ASSERT_THAT(take_all(), ElementsAre(Taken{3, 0, 20}, Taken{3, 1, 5}));
+    ASSERT_THAT(take_all(), IsEmpty());
+
+    ASSERT_TRUE(table.store(3, 0, 30));
+    ASSERT_THAT(take_all(), ElementsAre(Taken{3, 0, 30}));
+}
+
+
+TEST_F(LocoSlotTableTest, TakesInAddressOrder)
+{
+    table.store(LocoSlotTable::max_address, 15, 1);
+    table.store(1000, 0, 2);
+    table.store(1, 3, 3);
+
+    ASSERT_THAT(take_all(), ElementsAre(Taken{1, 3, 3}, Taken{1000, 0, 2}, Taken{LocoSlotTable::max_address, 15, 1}));
+}
+
+
+TEST_F(LocoSlotTableTest, StopKeepsRemainingPending)
+{
+    table.store(1, 0, 1);
+    table.store(2, 0, 2);
+    table.store(5000, 0, 3);
+
+    std::vector<Taken> taken;
+    table.take([&taken](uint16_t address, uint8_t slot, uint8_t value) {
+        if (address == 2) {
+            return false;
+        }
+        taken.emplace_back(address, slot, value);
+        return true;
+    });
+    ASSERT_THAT(taken, ElementsAre(Taken{1, 0, 1}));
+
+    ASSERT_THAT(take_all(), ElementsAre(Taken{2, 0, 2}, Taken{5000, 0, 3}));
+}
+
+
+TEST_F(LocoSlotTableTest, DiscardsUpToSequence)
+{
+    table.store(1, 0, 1);
+    table.store(5000, 0, 2);
+    table.store(2, 0, 3);
+    uint32_t sequence = table.sequence();
+    ASSERT_EQ(sequence, 3);
+
+    // Stored again after the sequence, so kept with its new value.
+    table.store(5000, 0, 4);
+    table.store(7, 1, 5);
+
+    ASSERT_EQ(table.discard(sequence), 2);
+    ASSERT_THAT(take_all(), ElementsAre(Taken{7, 1, 5}, Taken{5000, 0, 4}));
+}
+
+TEST_F(LocoSlotTableTest, KeepsTimeOfBecomingPending)
+{
+    table.store(3, 0, 1);
+    LocoSlotTable::clock::time_point first = table.pending_since(3, 0);
+    ASSERT_LE(first, LocoSlotTable::clock::now());
+
+    // Replacing a pending value keeps the slot's time, storing after it was taken starts a new one.
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    table.store(3, 0, 2);
+    ASSERT_EQ(table.pending_since(3, 0), first);
+
+    take_all();
+    table.store(3, 0, 3);
+    ASSERT_GE(table.pending_since(3, 0) - first, std::chrono::milliseconds(2));
+}
+
+
+TEST_F(LocoSlotTableTest, ManyProducers)
+{
+    std::vector<std::thread> producers;
+    for (uint16_t thread = 0; thread < 4; thread++) {
+        producers.emplace_back([this, thread]() {
+            for (uint8_t value = 0; value < 100; value++) {
+                for (uint16_t address = 1; address <= 100; address++) {
+                    table.store(thread * 100 + address, thread, value);
+                }
+            }
+        });
+    }
+
+    // Take concurrently, the last value taken for each slot must be the final one.
+    std::vector<int> last(4 * 100 + 1, -1);
+    auto consume = [&last](uint16_t address, uint8_t, uint8_t value) {
+        last[address] = value;
+        return true;
+    };
+    for (int i = 0; i < 100; i++) {
+        table.take(consume);
+    }
+    for (auto& producer: producers) {
+        producer.join();
+    }
+    table.take(consume);
+
+    for (uint16_t address = 1; address <= 400; address++) {
+        ASSERT_EQ(last[address], 99) << "address " << address;
+    }
+}
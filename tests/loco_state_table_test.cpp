@@ -0,0 +1,138 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include "../z21/loco_state_table.h"
+
+
+using namespace testing;
+
+
+class LocoStateTableTest : public ::testing::Test
+{
+protected:
+    virtual void SetUp()
+    {
+    }
+
+    virtual void TearDown()
+    {
+    }
+
+    static message::LocoInfo loco_info(uint16_t address, uint8_t speed, bool forward, uint64_t functions)
+    {
+        message::LocoInfo info;
+        info.address = address;
+        info.speed = speed;
+        info.direction_forward = forward;
+        info.speed_steps = LanX_LocoInfo::DCC_128;
+        info.functions.low = functions;
+        return info;
+    }
+
+    static ReceiveTimestamp at(int64_t ns)
+    {
+        return ReceiveTimestamp(std::chrono::duration_cast<ReceiveTimestamp::duration>(std::chrono::nanoseconds(ns)));
+    }
+
+    LocoStateTable table;
+};
+
+
+TEST_F(LocoStateTableTest, UnknownUntilUpdated)
+{
+    ASSERT_FALSE(table.known(3));
+    ASSERT_FALSE(table.get(3).has_value());
+
+    table.update(loco_info(3, 40, true, 0x05), at(1000));
+    ASSERT_TRUE(table.known(3));
+    ASSERT_FALSE(table.known(4));
+    ASSERT_FALSE(table.get(4).has_value());
+}
+
+TEST_F(LocoStateTableTest, KeepsLatestUpdate)
+{
+    message::LocoInfo info = loco_info(10239, 40, true, 0x80000001);
+    info.busy = true;
+    table.update(info, at(1000));
+    table.update(loco_info(10239, 12, false, 0x02), at(2000));
+
+    std::optional<LocoState> state = table.get(10239);
+    ASSERT_TRUE(state.has_value());
+    ASSERT_EQ(state->speed, 12);
+    ASSERT_FALSE(state->direction_forward);
+    ASSERT_FALSE(state->busy);
+    ASSERT_EQ(state->speed_steps, LanX_LocoInfo::DCC_128);
+    ASSERT_EQ(state->functions, LocoFunctions{0x02});
+    ASSERT_EQ(state->updated, at(2000));
+}
+
+TEST_F(LocoStateTableTest, ReturnsChangedFunctions)
+{
+    message::LocoInfo info = loco_info(3, 0, true, 0x03);
+    info.functions.high = 0x10;
+    ASSERT_EQ(table.update(info, at(1000)), (LocoFunctions{0x03, 0x10}));
+
+    info.functions = LocoFunctions{0x06, 0x10};
+    LocoFunctions changed = table.update(info, at(2000));
+    ASSERT_EQ(changed, LocoFunctions{0x05});
+    ASSERT_TRUE(table.get(3)->functions[68]);
+
+    ASSERT_FALSE(table.update(info, at(3000)).any());
+}
+
+TEST_F(LocoStateTableTest, IgnoresAddressesOutOfRange)
+{
+    table.update(loco_info(10240, 40, true, 0), at(1000));
+    ASSERT_FALSE(table.known(10240));
+    ASSERT_FALSE(table.get(10240).has_value());
+    ASSERT_FALSE(table.get(0xffff).has_value());
+}
+
+TEST_F(LocoStateTableTest, ReadersNeverSeeHalfAnUpdate)
+{
+    // Every update has all fields derived from the same counter, so a mix of two updates shows.
+    std::atomic<bool> done{false};
+    std::thread writer([&]() {
+        for (uint32_t i = 1; i <= 100000; i++) {
+            uint8_t speed = i & 0x7f;
+            table.update(loco_info(3, speed, i & 1, i), at(i));
+        }
+        done = true;
+    });
+
+    size_t reads = 0;
+    while (!done || reads == 0) {
+        std::optional<LocoState> state = table.get(3);
+        if (!state) {
+            std::this_thread::yield();
+            continue;
+        }
+        ASSERT_EQ(state->speed, state->functions.low & 0x7f);
+        ASSERT_EQ(state->direction_forward, state->functions.low & 1);
+        ASSERT_EQ(state->updated, at(state->functions.low));
+        reads++;
+    }
+    writer.join();
+}
@@ -0,0 +1,111 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include "../z21/mpsc_queue.h"
+
+
+using namespace testing;
+
+
+class MpscQueueTest : public ::testing::Test
+{
+protected:
+    virtual void SetUp()
+    {
+    }
+
+    virtual void TearDown()
+    {
+    }
+};
+
+
+TEST_F(MpscQueueTest, PopsInOrder)
+{
+    MpscQueue<int, 4> queue;
+    int value;
+
+    ASSERT_FALSE(queue.pop(value));
+    ASSERT_TRUE(queue.push(1));
+    ASSERT_TRUE(queue.push(2));
+    ASSERT_EQ(queue.size(), 2);
+
+    ASSERT_TRUE(queue.pop(value));
+    ASSERT_EQ(value, 1);
+    ASSERT_TRUE(queue.pop(value));
+    ASSERT_EQ(value, 2);
+    ASSERT_FALSE(queue.pop(value));
+    ASSERT_EQ(queue.size(), 0);
+}
+
+
+TEST_F(MpscQueueTest, RejectsPushWhenFull)
+{
+    MpscQueue<int, 4> queue;
+    int value;
+
+    for (int i = 0; i < 4; i++) {
+        ASSERT_TRUE(queue.push(i));
+    }
+    ASSERT_FALSE(queue.push(4));
+
+    ASSERT_TRUE(queue.pop(value));
+    ASSERT_TRUE(queue.push(4));
+}
+
+
+TEST_F(MpscQueueTest, ManyProducers)
+{
+    constexpr int producers = 4;
+    constexpr int per_producer = 100000;
+    MpscQueue<int, 1024> queue;
+
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; p++) {
+        threads.emplace_back([&queue, p]() {
+            for (int i = 0; i < per_producer; i++) {
+                while (!queue.push(p * per_producer + i)) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+
+    // Values from each producer must arrive in the order they were pushed.
+    std::vector<int> next(producers, 0);
+    int value;
+    for (int received = 0; received < producers * per_producer; ) {
+        if (queue.pop(value)) {
+            int p = value / per_producer;
+            ASSERT_EQ(value % per_producer, next[p]);
+            next[p]++;
+            received++;
+        }
+    }
+
+    for (auto& thread: threads) {
+        thread.join();
+    }
+    ASSERT_FALSE(queue.pop(value));
+}
@@ -0,0 +1,105 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include "../z21/receive_buffer_pool.h"
+
+
+using namespace testing;
+
+
+class ReceiveBufferPoolTest : public ::testing::Test
+{
+protected:
+    virtual void SetUp()
+    {
+    }
+
+    virtual void TearDown()
+    {
+    }
+
+    ReceiveBufferPool pool;
+};
+
+
+TEST_F(ReceiveBufferPoolTest, AcquiresUntilExhausted)
+{
+    std::vector<ReceiveBufferPool::Buffer> buffers;
+    for (size_t i = 0; i < ReceiveBufferPool::pool_size; i++) {
+        buffers.push_back(pool.acquire());
+        ASSERT_TRUE(buffers.back());
+        ASSERT_EQ(buffers.back().storage().size(), ReceiveBufferPool::buffer_size);
+        ASSERT_TRUE(buffers.back().bytes().empty());
+    }
+    ASSERT_EQ(pool.available(), 0);
+    ASSERT_FALSE(pool.acquire());
+
+    buffers.pop_back();
+    ASSERT_EQ(pool.available(), 1);
+    ASSERT_TRUE(pool.acquire());
+}
+
+TEST_F(ReceiveBufferPoolTest, ReturnsBufferWhenLastCopyReleased)
+{
+    ReceiveBufferPool::Buffer buffer = pool.acquire();
+    buffer.storage()[0] = 0x42;
+    buffer.set_size(1);
+
+    ReceiveBufferPool::Buffer copy = buffer;
+    ASSERT_EQ(copy.bytes().data(), buffer.bytes().data());
+    ASSERT_THAT(copy.bytes(), ElementsAre(0x42));
+
+    buffer.reset();
+    ASSERT_FALSE(buffer);
+    ASSERT_EQ(pool.available(), ReceiveBufferPool::pool_size - 1);
+
+    ReceiveBufferPool::Buffer moved = std::move(copy);
+    ASSERT_FALSE(copy);
+    ASSERT_EQ(pool.available(), ReceiveBufferPool::pool_size - 1);
+
+    moved = ReceiveBufferPool::Buffer();
+    ASSERT_EQ(pool.available(), ReceiveBufferPool::pool_size);
+}
+
+TEST_F(ReceiveBufferPoolTest, ReleasesFromOtherThreads)
+{
+    // Buffers taken here and dropped by several consumers, as when handed downstream.
+    for (int round = 0; round < 100; round++) {
+        std::vector<ReceiveBufferPool::Buffer> buffers;
+        while (ReceiveBufferPool::Buffer buffer = pool.acquire()) {
+            buffers.push_back(buffer);
+        }
+        ASSERT_EQ(buffers.size(), ReceiveBufferPool::pool_size);
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; t++) {
+            threads.emplace_back([copies = buffers]() mutable { copies.clear(); });
+        }
+        buffers.clear();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        ASSERT_EQ(pool.available(), ReceiveBufferPool::pool_size);
+    }
+}
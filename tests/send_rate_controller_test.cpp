@@ -0,0 +1,172 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include "../z21/send_rate_controller.h"
+
+
+using namespace testing;
+using namespace std::chrono_literals;
+
+
+class SendRateControllerTest : public ::testing::Test
+{
+protected:
+    virtual void SetUp()
+    {
+        config.enabled = true;
+        config.initial_rate = 100;
+        config.min_rate = 10;
+        config.max_rate = 120;
+        config.increase = 5;
+        config.decrease = 0.5;
+        config.burst = 2;
+        config.echo_threshold = 50ms;
+        config.echo_timeout = 500ms;
+    }
+
+    virtual void TearDown()
+    {
+    }
+
+    SendRateConfig config;
+    SendRateController::clock::time_point start = SendRateController::clock::now();
+};
+
+
+TEST_F(SendRateControllerTest, IncreasesOnFastEcho)
+{
+    SendRateController controller(config);
+
+    controller.on_loco_command(3, start);
+    controller.on_loco_info(3, start + 10ms);
+    ASSERT_EQ(controller.rate(), 105);
+
+    // Echoes without a probe in flight do not count.
+    controller.on_loco_info(3, start + 20ms);
+    ASSERT_EQ(controller.rate(), 105);
+
+    for (int i = 0; i < 10; i++) {
+        controller.on_loco_command(3, start);
+        controller.on_loco_info(3, start + 10ms);
+    }
+    ASSERT_EQ(controller.rate(), 120);
+    ASSERT_EQ(controller.stats().echoes, 11);
+}
+
+
+TEST_F(SendRateControllerTest, BacksOffOnSlowEcho)
+{
+    SendRateController controller(config);
+
+    controller.on_loco_command(3, start);
+    controller.on_loco_info(3, start + 100ms);
+    ASSERT_EQ(controller.rate(), 50);
+    ASSERT_EQ(controller.stats().slow_echoes, 1);
+    ASSERT_EQ(controller.stats().backoffs, 1);
+}
+
+
+TEST_F(SendRateControllerTest, BacksOffNoLowerThanLowestRate)
+{
+    config.initial_rate = 0;
+    config.min_rate = 0;
+    config.decrease = 1e-6;
+    SendRateController controller(config);
+    ASSERT_EQ(controller.rate(), SendRateController::lowest_rate);
+
+    controller.on_unknown_command(start);
+    controller.on_unknown_command(start + 1s);
+    ASSERT_EQ(controller.rate(), SendRateController::lowest_rate);
+    ASSERT_EQ(controller.stats().backoffs, 2);
+
+    // One DataSet now, the next after the interval at the lowest rate.
+    ASSERT_TRUE(controller.can_send(start));
+    controller.on_sent();
+    controller.on_sent();
+    ASSERT_FALSE(controller.can_send(start + 1s));
+    ASSERT_GT(controller.next_send(), start + 500s);
+}
+
+
+TEST_F(SendRateControllerTest, BacksOffOnLostEcho)
+{
+    SendRateController controller(config);
+
+    controller.on_loco_command(3, start);
+    controller.on_loco_command(4, start + 100ms);
+    controller.expire(start + 400ms);
+    ASSERT_EQ(controller.rate(), 100);
+
+    controller.expire(start + 501ms);
+    ASSERT_EQ(controller.rate(), 50);
+    ASSERT_EQ(controller.stats().lost_echoes, 1);
+
+    // Lost within the hold-off after the last backoff, the rate is kept.
+    controller.expire(start + 601ms);
+    ASSERT_EQ(controller.rate(), 50);
+    ASSERT_EQ(controller.stats().lost_echoes, 2);
+    ASSERT_EQ(controller.stats().backoffs, 1);
+}
+
+
+TEST_F(SendRateControllerTest, BacksOffOnUnknownCommand)
+{
+    SendRateController controller(config);
+
+    for (int i = 0; i < 5; i++) {
+        controller.on_unknown_command(start + i * 1s);
+    }
+    ASSERT_EQ(controller.rate(), 10);
+    ASSERT_EQ(controller.stats().unknown_commands, 5);
+    ASSERT_EQ(controller.stats().backoffs, 5);
+}
+
+
+TEST_F(SendRateControllerTest, PacesSending)
+{
+    SendRateController controller(config);
+
+    // The burst is sent back to back, then one DataSet per 10 ms.
+    for (int i = 0; i < 2; i++) {
+        ASSERT_TRUE(controller.can_send(start));
+        controller.on_sent();
+    }
+    ASSERT_FALSE(controller.can_send(start));
+    ASSERT_EQ(controller.next_send(), start + 10ms);
+
+    ASSERT_FALSE(controller.can_send(start + 9ms));
+    ASSERT_TRUE(controller.can_send(start + 10ms));
+}
+
+
+TEST_F(SendRateControllerTest, DisabledNeverHoldsBack)
+{
+    config.enabled = false;
+    SendRateController controller(config);
+
+    for (int i = 0; i < 100; i++) {
+        ASSERT_TRUE(controller.can_send(start));
+        controller.on_sent();
+    }
+    controller.on_unknown_command(start);
+    ASSERT_EQ(controller.stats().rate, 0);
+    ASSERT_EQ(controller.stats().backoffs, 0);
+}
@@ -0,0 +1,120 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include "../z21/seqlock.h"
+
+
+using namespace testing;
+
+
+class SeqLockTest : public ::testing::Test
+{
+protected:
+    virtual void SetUp()
+    {
+    }
+
+    virtual void TearDown()
+    {
+    }
+
+    // Odd size, so the last word is only partly used.
+    struct Value
+    {
+        uint32_t counter{0};
+        int16_t current{0};
+        bool flag{false};
+        std::array<uint8_t, 21> bytes{};
+    };
+
+    // Every field derived from the same counter, so a mix of two stores shows.
+    static Value make(uint32_t counter)
+    {
+        Value value;
+        value.counter = counter;
+        value.current = static_cast<int16_t>(-static_cast<int32_t>(counter % 30000));
+        value.flag = counter & 1;
+        value.bytes.fill(static_cast<uint8_t>(counter));
+        return value;
+    }
+
+    static bool consistent(const Value& value)
+    {
+        Value expected = make(value.counter);
+        return value.current == expected.current && value.flag == expected.flag && value.bytes == expected.bytes;
+    }
+};
+
+
+TEST_F(SeqLockTest, LoadsLatestStore)
+{
+    SeqLock<Value> lock(make(7));
+    ASSERT_EQ(lock.load().counter, 7);
+    ASSERT_EQ(lock.version(), 0);
+
+    lock.store(make(8));
+    lock.store(make(9));
+    Value value = lock.load();
+    ASSERT_EQ(value.counter, 9);
+    ASSERT_TRUE(consistent(value));
+    ASSERT_EQ(lock.version(), 2);
+}
+
+TEST_F(SeqLockTest, ReadersNeverSeeHalfAStore)
+{
+    SeqLock<Value> lock(make(0));
+    std::atomic<bool> done{false};
+    std::atomic<size_t> torn{0};
+    std::atomic<size_t> backwards{0};
+
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 3; r++) {
+        readers.emplace_back([&]() {
+            uint32_t last = 0;
+            while (!done.load(std::memory_order_relaxed)) {
+                Value value = lock.load();
+                if (!consistent(value)) {
+                    torn++;
+                }
+                if (value.counter < last) {
+                    backwards++;
+                }
+                last = value.counter;
+            }
+        });
+    }
+
+    for (uint32_t i = 1; i <= 200000; i++) {
+        lock.store(make(i));
+    }
+    done = true;
+    for (auto& reader : readers) {
+        reader.join();
+    }
+
+    ASSERT_EQ(torn, 0);
+    ASSERT_EQ(backwards, 0);
+    ASSERT_EQ(lock.load().counter, 200000);
+}
@@ -0,0 +1,122 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <memory>
+#include <thread>
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include "../z21/spsc_ring.h"
+
+
+using namespace testing;
+
+
+class SpscRingTest : public ::testing::Test
+{
+protected:
+    virtual void SetUp()
+    {
+    }
+
+    virtual void TearDown()
+    {
+    }
+};
+
+
+TEST_F(SpscRingTest, PopsInOrder)
+{
+    SpscRing<int, 4> ring;
+    int value;
+
+    ASSERT_FALSE(ring.pop(value));
+    ASSERT_TRUE(ring.push(1));
+    ASSERT_TRUE(ring.push(2));
+    ASSERT_EQ(ring.size(), 2);
+
+    ASSERT_TRUE(ring.pop(value));
+    ASSERT_EQ(value, 1);
+    ASSERT_TRUE(ring.pop(value));
+    ASSERT_EQ(value, 2);
+    ASSERT_FALSE(ring.pop(value));
+    ASSERT_EQ(ring.size(), 0);
+}
+
+
+TEST_F(SpscRingTest, RejectsPushWhenFull)
+{
+    SpscRing<int, 4> ring;
+    int value;
+
+    for (int i = 0; i < 4; i++) {
+        ASSERT_TRUE(ring.push(i));
+    }
+    ASSERT_FALSE(ring.push(4));
+
+    ASSERT_TRUE(ring.pop(value));
+    ASSERT_TRUE(ring.push(4));
+}
+
+
+TEST_F(SpscRingTest, MovesValuesThrough)
+{
+    SpscRing<std::shared_ptr<int>, 4> ring;
+    auto shared = std::make_shared<int>(42);
+
+    ASSERT_TRUE(ring.push(std::shared_ptr<int>(shared)));
+    ASSERT_EQ(shared.use_count(), 2);
+
+    std::shared_ptr<int> popped;
+    ASSERT_TRUE(ring.pop(popped));
+    ASSERT_EQ(*popped, 42);
+
+    // The slot no longer holds a reference.
+    popped.reset();
+    ASSERT_EQ(shared.use_count(), 1);
+}
+
+
+TEST_F(SpscRingTest, ProducerAndConsumerThreads)
+{
+    constexpr int count = 100000;
+    SpscRing<int, 256> ring;
+
+    std::thread producer([&ring]() {
+        for (int i = 0; i < count; i++) {
+            while (!ring.push(i)) {
+                std::this_thread::yield();
+            }
+        }
+    });
+
+    int value;
+    for (int expected = 0; expected < count; ) {
+        if (ring.pop(value)) {
+            ASSERT_EQ(value, expected);
+            expected++;
+        }
+        else {
+            std::this_thread::yield();
+        }
+    }
+
+    producer.join();
+    ASSERT_FALSE(ring.pop(value));
+}
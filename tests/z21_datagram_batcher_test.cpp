@@ -0,0 +1,81 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include "../z21/z21_datagram_batcher.h"
+
+
+using namespace testing;
+
+
+class Z21DatagramBatcherTest : public ::testing::Test
+{
+protected:
+    virtual void SetUp()
+    {
+    }
+
+    virtual void TearDown()
+    {
+    }
+};
+
+
+TEST_F(Z21DatagramBatcherTest, AppendsDataSetsBackToBack)
+{
+    Z21_DatagramBatcher batcher;
+    auto now = Z21_DatagramBatcher::clock::now();
+
+    std::vector<uint8_t> first = {0x04, 0x00, 0x10, 0x00};
+    std::vector<uint8_t> second = {0x06, 0x00, 0x40, 0x00, 0x80, 0x80};
+    ASSERT_TRUE(batcher.empty());
+    ASSERT_TRUE(batcher.append(first, now));
+    ASSERT_TRUE(batcher.append(second, now + std::chrono::milliseconds(1)));
+
+    std::vector<uint8_t> expected = {0x04, 0x00, 0x10, 0x00, 0x06, 0x00, 0x40, 0x00, 0x80, 0x80};
+    ASSERT_EQ(std::vector<uint8_t>(batcher.datagram().begin(), batcher.datagram().end()), expected);
+    ASSERT_EQ(batcher.datasets(), 2);
+    ASSERT_EQ(batcher.first_append(), now);
+
+    batcher.clear();
+    ASSERT_TRUE(batcher.empty());
+    ASSERT_EQ(batcher.datagram().size(), 0);
+}
+
+
+TEST_F(Z21DatagramBatcherTest, RejectsDataSetBeyondDatagramSize)
+{
+    Z21_DatagramBatcher batcher(10);
+    auto now = Z21_DatagramBatcher::clock::now();
+
+    std::vector<uint8_t> dataset = {0x06, 0x00, 0x40, 0x00, 0x80, 0x80};
+    ASSERT_TRUE(batcher.append(dataset, now));
+    ASSERT_FALSE(batcher.append(dataset, now));
+    ASSERT_EQ(batcher.datasets(), 1);
+}
+
+
+TEST_F(Z21DatagramBatcherTest, DatagramSizeIsCapped)
+{
+    Z21_DatagramBatcher batcher(100000);
+    ASSERT_EQ(batcher.datagram_size(), Z21_DatagramBatcher::max_datagram_size);
+}
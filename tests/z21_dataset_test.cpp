@@ -23,6 +23,7 @@
 #include <gmock/gmock.h>
 
 #include "../z21/z21_dataset.h"
+#include "../z21/lan_x_command.h"
 
 
 using namespace testing;
@@ -90,3 +91,15 @@ TEST_F(Z21DataSetTest, LanLogoff)
     std::vector<uint8_t> request = packet.pack();
     ASSERT_EQ(request, request_expected);
 }
+
+TEST_F(Z21DataSetTest, LanXFrame)
+{
+    LanX_SetStop command;
+    LanX packet(&command);
+
+    std::vector<uint8_t> request_expected = {0x06, 0x00, 0x40, 0x00, 0x80, 0x80};
+    ASSERT_EQ(packet.pack(), request_expected);
+
+    Z21_Frame frame = packet.frame();
+    ASSERT_EQ(std::vector<uint8_t>(frame.bytes().begin(), frame.bytes().end()), request_expected);
+}
@@ -0,0 +1,149 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include "../z21/z21_events.h"
+
+
+using namespace testing;
+
+
+class EventDispatcherTest : public ::testing::Test
+{
+protected:
+    virtual void SetUp()
+    {
+    }
+
+    virtual void TearDown()
+    {
+    }
+
+    template<typename Condition>
+    static bool wait_for(Condition condition)
+    {
+        for (int i = 0; i < 1000; i++) {
+            if (condition()) {
+                return true;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+        return false;
+    }
+};
+
+
+TEST_F(EventDispatcherTest, DispatchesInOrderOnThreadOfItsOwn)
+{
+    EventDispatcher events;
+    std::mutex mutex;
+    std::vector<uint16_t> cvs;
+    std::thread::id dispatch_thread;
+    events.subscribe<event::CvResult>([&](const event::CvResult& result) {
+        std::lock_guard lock(mutex);
+        cvs.push_back(result.cv);
+        dispatch_thread = std::this_thread::get_id();
+    });
+
+    for (uint16_t cv = 1; cv <= 100; cv++) {
+        ASSERT_TRUE(events.publish(event::CvResult{event::CvResult::OK, cv, 0, {}}));
+    }
+
+    ASSERT_TRUE(wait_for([&]() { std::lock_guard lock(mutex); return cvs.size() == 100; }));
+    std::lock_guard lock(mutex);
+    for (uint16_t i = 0; i < 100; i++) {
+        ASSERT_EQ(cvs[i], i + 1);
+    }
+    ASSERT_NE(dispatch_thread, std::this_thread::get_id());
+    ASSERT_EQ(events.published(), 100);
+}
+
+TEST_F(EventDispatcherTest, DispatchesOnGivenExecutorByType)
+{
+    boost::asio::io_context io_context;
+    auto work = boost::asio::make_work_guard(io_context);
+    std::thread executor_thread([&]() { io_context.run(); });
+
+    std::atomic<size_t> locos{0};
+    std::atomic<size_t> accessories{0};
+    std::atomic<bool> on_executor{true};
+    {
+        EventDispatcher events(io_context.get_executor());
+        events.subscribe<event::LocoChanged>([&](const event::LocoChanged&) {
+            on_executor = on_executor && std::this_thread::get_id() == executor_thread.get_id();
+            locos++;
+        });
+        events.subscribe<event::AccessoryChanged>([&](const event::AccessoryChanged&) { accessories++; });
+        ASSERT_TRUE(events.wanted<event::LocoChanged>());
+        ASSERT_FALSE(events.wanted<event::PowerChanged>());
+
+        events.publish(event::LocoChanged{.address = 3, .speed = 10});
+        events.publish(event::PowerChanged{.track_voltage_off = true});
+        events.publish(event::AccessoryChanged{.address = 5});
+        events.publish(event::LocoChanged{.address = 3, .speed = 11});
+
+        ASSERT_TRUE(wait_for([&]() { return locos == 2 && accessories == 1; }));
+    }
+
+    ASSERT_TRUE(on_executor);
+    work.reset();
+    executor_thread.join();
+}
+
+TEST_F(EventDispatcherTest, DropsWhenSubscribersFallBehind)
+{
+    // Not run until everything is published, as if the subscriber was stuck.
+    boost::asio::io_context io_context;
+    size_t received = 0;
+    {
+        EventDispatcher events(io_context.get_executor());
+        events.subscribe<event::PowerChanged>([&](const event::PowerChanged&) { received++; });
+
+        for (size_t i = 0; i < EventDispatcher::queue_size + 5; i++) {
+            events.publish(event::PowerChanged{.emergency_stop = true});
+        }
+        ASSERT_EQ(events.published(), EventDispatcher::queue_size);
+        ASSERT_EQ(events.dropped(), 5);
+
+        io_context.run();
+    }
+
+    ASSERT_EQ(received, EventDispatcher::queue_size);
+}
+
+TEST_F(EventDispatcherTest, DropsPendingDispatchWhenDestroyed)
+{
+    // Not run before the dispatcher is gone, as if the executor had been stopped.
+    boost::asio::io_context io_context;
+    size_t received = 0;
+    {
+        EventDispatcher events(io_context.get_executor());
+        events.subscribe<event::PowerChanged>([&](const event::PowerChanged&) { received++; });
+        events.publish(event::PowerChanged{.emergency_stop = true});
+    }
+
+    io_context.run();
+    ASSERT_EQ(received, 0);
+}
@@ -0,0 +1,163 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include "../z21/z21_dataset.h"
+#include "../z21/z21_message.h"
+
+
+using namespace testing;
+
+
+class Z21MessageTest : public ::testing::Test
+{
+protected:
+    virtual void SetUp()
+    {
+    }
+
+    virtual void TearDown()
+    {
+    }
+
+    static std::vector<uint8_t> loco_info(uint16_t address, uint8_t speed)
+    {
+        std::vector<uint8_t> data = {0xef, static_cast<uint8_t>(address >> 8), static_cast<uint8_t>(address), 0x04,
+                                     static_cast<uint8_t>(0x80 | speed), 0x11, 0x00, 0x00, 0x00, 0x04};
+        uint8_t checksum = 0;
+        for (uint8_t byte: data) {
+            checksum ^= byte;
+        }
+        data.push_back(checksum);
+        return data;
+    }
+};
+
+
+TEST_F(Z21MessageTest, DecodesLocoInfo)
+{
+    Z21Message decoded = decode_dataset(Z21_DataSet::LAN_X, loco_info(1234, 40));
+    ASSERT_TRUE(std::holds_alternative<message::LocoInfo>(decoded));
+
+    const auto& info = std::get<message::LocoInfo>(decoded);
+    ASSERT_EQ(info.address, 1234);
+    ASSERT_EQ(info.speed_steps, LanX_LocoInfo::DCC_128);
+    ASSERT_TRUE(info.direction_forward);
+    ASSERT_EQ(info.speed, 40);
+    ASSERT_TRUE(info.function(0));
+    ASSERT_TRUE(info.function(1));
+    ASSERT_FALSE(info.function(2));
+    ASSERT_TRUE(info.function(31));
+    ASSERT_FALSE(info.function(32));
+}
+
+TEST_F(Z21MessageTest, DecodesExtendedFunctions)
+{
+    // DB4-DB13: F0, F29, F32, F63 and F68.
+    std::vector<uint8_t> data = {0xef, 0x00, 0x03, 0x04, 0x00, 0x10, 0x00, 0x00, 0x00, 0x01, 0x01, 0x00, 0x00, 0x80, 0x10};
+    uint8_t checksum = 0;
+    for (uint8_t byte : data) {
+        checksum ^= byte;
+    }
+    data.push_back(checksum);
+
+    Z21Message decoded = decode_dataset(Z21_DataSet::LAN_X, data);
+    ASSERT_TRUE(std::holds_alternative<message::LocoInfo>(decoded));
+    const LocoFunctions& functions = std::get<message::LocoInfo>(decoded).functions;
+
+    std::vector<size_t> set;
+    functions.for_each([&set](size_t index) { set.push_back(index); });
+    ASSERT_THAT(set, ElementsAre(0, 29, 32, 63, 68));
+    ASSERT_EQ(functions.size(), 5);
+    ASSERT_EQ(functions.f0_f31(), 0x1u | (1u << 29));
+    ASSERT_FALSE(functions[69]);
+
+    // Only F0 switched off and F1 on.
+    LocoFunctions next = functions;
+    next.low ^= 0x3;
+    std::vector<size_t> changed;
+    functions.changed(next).for_each([&changed](size_t index) { changed.push_back(index); });
+    ASSERT_THAT(changed, ElementsAre(0, 1));
+}
+
+TEST_F(Z21MessageTest, DecodesDataSets)
+{
+    std::vector<uint8_t> hw_info = {0x01, 0x02, 0x00, 0x00, 0x33, 0x01, 0x00, 0x00};
+    auto decoded = decode_dataset(Z21_DataSet::LAN_GET_HWINFO, hw_info);
+    ASSERT_TRUE(std::holds_alternative<message::HWInfo>(decoded));
+    ASSERT_EQ(std::get<message::HWInfo>(decoded).hw_type, 0x201);
+    ASSERT_EQ(std::get<message::HWInfo>(decoded).fw_version(), "1.33");
+
+    std::vector<uint8_t> track_power_on = {0x61, 0x01, 0x60};
+    ASSERT_TRUE(std::holds_alternative<message::TrackPowerOn>(decode_dataset(Z21_DataSet::LAN_X, track_power_on)));
+
+    std::vector<uint8_t> locomode = {0x00, 0x03, 0x01};
+    decoded = decode_dataset(Z21_DataSet::LAN_GET_TURNOUTMODE, locomode);
+    ASSERT_TRUE(std::holds_alternative<message::TurnoutMode>(decoded));
+    ASSERT_EQ(std::get<message::TurnoutMode>(decoded).mode, Locomode::MM);
+}
+
+TEST_F(Z21MessageTest, RejectsMalformed)
+{
+    std::vector<uint8_t> bad_checksum = loco_info(3, 0);
+    bad_checksum.back() ^= 0xff;
+    ASSERT_TRUE(std::holds_alternative<std::monostate>(decode_dataset(Z21_DataSet::LAN_X, bad_checksum)));
+
+    std::vector<uint8_t> unknown_command = {0x61, 0x55, 0x34};
+    ASSERT_TRUE(std::holds_alternative<std::monostate>(decode_dataset(Z21_DataSet::LAN_X, unknown_command)));
+
+    std::vector<uint8_t> short_serial = {0x01, 0x02};
+    ASSERT_TRUE(std::holds_alternative<std::monostate>(decode_dataset(Z21_DataSet::LAN_GET_SERIAL_NUMBER, short_serial)));
+    ASSERT_TRUE(std::holds_alternative<std::monostate>(decode_dataset(0x99, short_serial)));
+    ASSERT_TRUE(std::holds_alternative<std::monostate>(decode_dataset(Z21_DataSet::LAN_X, {})));
+}
+
+TEST_F(Z21MessageTest, DecodesInParallel)
+{
+    // Captured traffic, decoded by several threads at once with no shared decoder state.
+    std::vector<std::vector<uint8_t>> capture;
+    for (uint16_t address = 1; address <= 1000; address++) {
+        capture.push_back(loco_info(address, address % 128));
+    }
+
+    std::vector<std::thread> threads;
+    std::vector<size_t> mismatches(4);
+    for (size_t t = 0; t < mismatches.size(); t++) {
+        threads.emplace_back([&, t]() {
+            for (int round = 0; round < 20; round++) {
+                for (size_t i = 0; i < capture.size(); i++) {
+                    auto decoded = decode_dataset(Z21_DataSet::LAN_X, capture[i]);
+                    const auto* info = std::get_if<message::LocoInfo>(&decoded);
+                    if (!info || info->address != i + 1 || info->speed != (i + 1) % 128) {
+                        mismatches[t]++;
+                    }
+                }
+            }
+        });
+    }
+    for (auto& thread: threads) {
+        thread.join();
+    }
+
+    ASSERT_THAT(mismatches, Each(0));
+}
@@ -0,0 +1,1007 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <array>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include "../z21/z21.h"
+
+
+using namespace testing;
+using boost::asio::ip::udp;
+
+
+/**
+ * Runs a Z21 against a local UDP socket standing in for the command station.
+ */
+class Z21Test : public ::testing::Test
+{
+protected:
+    virtual void SetUp()
+    {
+        station.open(udp::v4());
+        station.bind(udp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+    }
+
+    virtual void TearDown()
+    {
+    }
+
+    std::string station_port() { return std::to_string(station.local_endpoint().port()); }
+
+    /**
+     * Receive one datagram sent by the Z21 instance.
+     */
+    std::vector<uint8_t> receive()
+    {
+        std::array<uint8_t, 1500> buffer;
+        size_t size = station.receive_from(boost::asio::buffer(buffer), client);
+        return std::vector<uint8_t>(buffer.begin(), buffer.begin() + size);
+    }
+
+    /**
+     * Receive datagrams until `count` DataSets have arrived.
+     * @return number of datagrams received
+     */
+    size_t receive_datasets(size_t count)
+    {
+        size_t datagrams = 0;
+        size_t datasets = 0;
+        while (datasets < count) {
+            datasets += count_datasets(receive());
+            datagrams++;
+        }
+        return datagrams;
+    }
+
+    /**
+     * Count DataSets in a datagram.
+     */
+    static size_t count_datasets(const std::vector<uint8_t>& datagram)
+    {
+        size_t count = 0;
+        for (size_t pos = 0; pos + header_size <= datagram.size(); pos += datagram[pos] | (datagram[pos + 1] << 8)) {
+            count++;
+        }
+        return count;
+    }
+
+    /**
+     * Wait up to a second for a condition updated by the listener thread.
+     */
+    template<typename Condition>
+    static bool wait_for(Condition condition)
+    {
+        for (int i = 0; i < 1000 && !condition(); i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return condition();
+    }
+
+    boost::asio::io_context io_context;
+    udp::socket station{io_context};
+    udp::endpoint client;
+};
+
+
+// The listener sends LAN_GET_SERIAL_NUMBER when it starts, so every test below sees one DataSet extra.
+
+TEST_F(Z21Test, SendsWithoutWindow)
+{
+    Z21 z21("127.0.0.1", station_port());
+    ASSERT_TRUE(z21.connect());
+    z21.listen();
+
+    z21.xbus_set_loco_drive(3, 40, true);
+    z21.xbus_set_loco_drive(4, 40, true);
+
+    size_t datagrams = receive_datasets(3);
+    ASSERT_TRUE(wait_for([&]() { return z21.send_stats().datasets_sent == 3; }));
+    ASSERT_EQ(z21.send_stats().datagrams_sent, datagrams);
+}
+
+
+TEST_F(Z21Test, CoalescesDataSetsWithinWindow)
+{
+    Z21Config config;
+    config.send_window = std::chrono::milliseconds(50);
+    Z21 z21("127.0.0.1", station_port(), config);
+    ASSERT_TRUE(z21.connect());
+    z21.listen();
+
+    for (uint16_t address = 1; address <= 30; address++) {
+        z21.xbus_set_loco_drive(address, 40, true);
+    }
+
+    size_t datagrams = receive_datasets(31);
+    ASSERT_LE(datagrams, 3);
+
+    ASSERT_TRUE(wait_for([&]() { return z21.send_stats().datasets_sent == 31; }));
+    Z21SendStats stats = z21.send_stats();
+    ASSERT_EQ(stats.datagrams_sent, datagrams);
+    ASSERT_GE(stats.max_datasets_per_datagram, 15);
+    ASSERT_GT(stats.max_send_latency.count(), 0);
+}
+
+
+TEST_F(Z21Test, SendsWhenDatagramIsFull)
+{
+    Z21Config config;
+    config.send_window = std::chrono::seconds(10);
+    config.max_datagram_size = 20;
+    Z21 z21("127.0.0.1", station_port(), config);
+    ASSERT_TRUE(z21.connect());
+    z21.listen();
+
+    // LAN_GET_SERIAL_NUMBER is 4 bytes and drive DataSets are 10, so only two DataSets fit per datagram.
+    z21.xbus_set_loco_drive(3, 40, true);
+    z21.xbus_set_loco_drive(4, 40, true);
+    z21.xbus_set_loco_drive(5, 40, true);
+
+    ASSERT_EQ(count_datasets(receive()), 2);
+    ASSERT_TRUE(wait_for([&]() { return z21.send_stats().datagrams_sent == 1; }));
+}
+
+TEST_F(Z21Test, RaisesDatagramSizeToFitDataSets)
+{
+    Z21Config config;
+    config.max_datagram_size = 1;
+    Z21 z21("127.0.0.1", station_port(), config);
+    ASSERT_TRUE(z21.connect());
+    z21.listen();
+
+    z21.xbus_set_turnout(12, 0x89);
+    z21.xbus_cv_read(29);
+
+    receive_datasets(3);
+    ASSERT_TRUE(wait_for([&]() { return z21.send_stats().datasets_sent == 3; }));
+    ASSERT_EQ(z21.send_stats().send_queue_drops, 0);
+}
+
+
+TEST_F(Z21Test, SendQueueDepthIsObservable)
+{
+    Z21 z21("127.0.0.1", station_port());
+    ASSERT_TRUE(z21.connect());
+
+    for (uint16_t address = 1; address <= 5; address++) {
+        z21.xbus_set_turnout(address, 0x89);
+    }
+    ASSERT_EQ(z21.send_stats().send_queue_depth, 5);
+    ASSERT_EQ(z21.send_stats().max_send_queue_depth, 5);
+
+    z21.listen();
+    receive_datasets(6);
+    ASSERT_TRUE(wait_for([&]() { return z21.send_stats().send_queue_depth == 0; }));
+}
+
+
+TEST_F(Z21Test, DropsWhenSendQueueIsFull)
+{
+    Z21 z21("127.0.0.1", station_port());
+    ASSERT_TRUE(z21.connect());
+
+    for (int i = 0; i < 1100; i++) {
+        z21.xbus_set_turnout(12, 0x89);
+    }
+    ASSERT_EQ(z21.send_stats().send_queue_drops, 1100 - 1024);
+}
+
+
+TEST_F(Z21Test, SendsFromManyThreads)
+{
+    Z21 z21("127.0.0.1", station_port());
+    ASSERT_TRUE(z21.connect());
+    z21.listen();
+
+    std::vector<std::thread> producers;
+    for (uint16_t thread = 0; thread < 4; thread++) {
+        producers.emplace_back([&z21, thread]() {
+            for (uint16_t i = 0; i < 200; i++) {
+                z21.xbus_set_loco_drive(thread * 200 + i + 1, 40, true);
+            }
+        });
+    }
+    for (auto& producer: producers) {
+        producer.join();
+    }
+
+    receive_datasets(801);
+    ASSERT_TRUE(wait_for([&]() { return z21.send_stats().datasets_sent == 801; }));
+    ASSERT_EQ(z21.send_stats().send_queue_drops, 0);
+}
+
+
+TEST_F(Z21Test, SendsLatestLocoCommands)
+{
+    Z21 z21("127.0.0.1", station_port());
+    ASSERT_TRUE(z21.connect());
+
+    for (uint8_t speed = 1; speed <= 100; speed++) {
+        z21.xbus_set_loco_drive(3, speed, true);
+        z21.xbus_set_loco_drive(4, speed, false);
+    }
+    z21.xbus_set_loco_function_group(3, LanX_SetLocoFunctionGroup::GROUP_1, 0x01);
+    z21.xbus_set_loco_function_group(3, LanX_SetLocoFunctionGroup::GROUP_1, 0x10);
+    ASSERT_EQ(z21.send_stats().loco_commands_superseded, 2 * 99 + 1);
+
+    z21.listen();
+
+    // Only the last command per loco and slot is sent, plus LAN_GET_SERIAL_NUMBER.
+    std::vector<std::vector<uint8_t>> datasets;
+    while (datasets.size() < 4) {
+        std::vector<uint8_t> datagram = receive();
+        for (size_t pos = 0; pos < datagram.size(); pos += datagram[pos]) {
+            datasets.emplace_back(datagram.begin() + pos, datagram.begin() + pos + datagram[pos]);
+        }
+    }
+    ASSERT_THAT(datasets, Contains(std::vector<uint8_t>{0x0a, 0x00, 0x40, 0x00, 0xe4, 0x12, 0x00, 0x03, 0xe4, 0x11}));
+    ASSERT_THAT(datasets, Contains(std::vector<uint8_t>{0x0a, 0x00, 0x40, 0x00, 0xe4, 0x12, 0x00, 0x04, 0x64, 0x96}));
+    ASSERT_THAT(datasets, Contains(std::vector<uint8_t>{0x0a, 0x00, 0x40, 0x00, 0xe4, 0x20, 0x00, 0x03, 0x10, 0xd7}));
+    ASSERT_TRUE(wait_for([&]() { return z21.send_stats().datasets_sent == 4; }));
+}
+
+
+TEST_F(Z21Test, SendsEmergencyBeforeQueuedTraffic)
+{
+    Z21 z21("127.0.0.1", station_port());
+    ASSERT_TRUE(z21.connect());
+
+    for (uint16_t i = 0; i < 100; i++) {
+        z21.xbus_cv_read(i + 1);
+        z21.xbus_set_turnout(i, 0x89);
+    }
+    z21.xbus_set_track_power_on();
+    z21.xbus_set_loco_drive(3, 50, true);
+    z21.xbus_set_stop();
+    z21.xbus_set_turnout(200, 0x89);
+    z21.listen();
+
+    // The stop goes out alone, ahead of everything queued before it.
+    std::vector<uint8_t> stop = {0x06, 0x00, 0x40, 0x00, 0x80, 0x80};
+    ASSERT_EQ(receive(), stop);
+
+    // The power on and loco command queued before the stop would undo it, so are dropped. Everything else
+    // still goes out, the bulk DataSets last.
+    std::vector<uint8_t> headers;
+    while (headers.size() < 202) {
+        std::vector<uint8_t> datagram = receive();
+        for (size_t pos = 0; pos < datagram.size(); pos += datagram[pos]) {
+            headers.push_back(datagram[pos + 2] == 0x40 ? datagram[pos + 4] : datagram[pos + 2]);
+        }
+    }
+    ASSERT_EQ(std::count(headers.begin(), headers.end(), 0x53), 101);
+    ASSERT_EQ(std::count(headers.begin(), headers.end(), 0x23), 100);
+    ASSERT_EQ(std::count(headers.begin(), headers.end(), 0x10), 1);
+    ASSERT_EQ(std::count(headers.begin(), headers.end(), 0x21), 0);
+    ASSERT_EQ(std::count(headers.begin(), headers.end(), 0xe4), 0);
+    ASSERT_EQ(headers.back(), 0x23);
+
+    ASSERT_TRUE(wait_for([&]() { return z21.send_stats().datasets_sent == 203; }));
+    ASSERT_EQ(z21.send_stats().emergency_datasets_sent, 1);
+    ASSERT_EQ(z21.send_stats().emergency_superseded, 2);
+}
+
+TEST_F(Z21Test, DropsPackedDataSetsOnEmergency)
+{
+    Z21Config config;
+    config.send_window = std::chrono::milliseconds(200);
+    Z21 z21("127.0.0.1", station_port(), config);
+    ASSERT_TRUE(z21.connect());
+    z21.listen();
+    receive();
+
+    // These wait for more DataSets in the send window, so are still unsent when the stop comes.
+    z21.xbus_set_track_power_on();
+    z21.xbus_set_turnout(12, 0x89);
+    z21.xbus_cv_pom_write_byte(3, 29, 6);
+    ASSERT_TRUE(wait_for([&]() {
+        return z21.send_stats().send_queue_depth == 0 && z21.send_stats().bulk_queue_depth == 0;
+    }));
+    z21.xbus_set_stop();
+
+    // Only the power on is dropped, the turnout and the POM write follow the stop.
+    std::vector<uint8_t> stop = {0x06, 0x00, 0x40, 0x00, 0x80, 0x80};
+    ASSERT_EQ(receive(), stop);
+    std::vector<uint8_t> datagram = receive();
+    std::vector<uint8_t> headers;
+    for (size_t pos = 0; pos < datagram.size(); pos += datagram[pos]) {
+        headers.push_back(datagram[pos + 4]);
+    }
+    ASSERT_EQ(headers, (std::vector<uint8_t>{0x53, 0xe6}));
+    ASSERT_TRUE(wait_for([&]() { return z21.send_stats().datasets_sent == 4; }));
+    ASSERT_EQ(z21.send_stats().emergency_superseded, 1);
+}
+
+
+TEST_F(Z21Test, LimitsBulkRate)
+{
+    Z21Config config;
+    config.bulk_rate = 100;
+    Z21 z21("127.0.0.1", station_port(), config);
+    ASSERT_TRUE(z21.connect());
+
+    // Queued before listening, so none is taken before all are queued.
+    auto start = std::chrono::steady_clock::now();
+    for (uint16_t cv = 1; cv <= 20; cv++) {
+        z21.xbus_cv_read(cv);
+    }
+    z21.xbus_set_turnout(12, 0x89);
+    z21.listen();
+
+    receive_datasets(22);
+    ASSERT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(190));
+    ASSERT_TRUE(wait_for([&]() { return z21.send_stats().bulk_queue_depth == 0; }));
+    ASSERT_EQ(z21.send_stats().max_bulk_queue_depth, 20);
+}
+
+
+TEST_F(Z21Test, AdaptsSendRateToEchoes)
+{
+    Z21Config config;
+    config.rate_control.enabled = true;
+    config.rate_control.initial_rate = 100;
+    Z21 z21("127.0.0.1", station_port(), config);
+    ASSERT_TRUE(z21.connect());
+    z21.listen();
+
+    z21.xbus_set_loco_drive(3, 40, true);
+    receive_datasets(2);
+
+    // LAN_X_LOCO_INFO for loco 3 echoes the drive command.
+    std::vector<uint8_t> loco_info = {0x0e, 0x00, 0x40, 0x00, 0xef, 0x00, 0x03, 0x04, 0xa8, 0x00, 0x00, 0x00, 0x00, 0x40};
+    station.send_to(boost::asio::buffer(loco_info), client);
+    ASSERT_TRUE(wait_for([&]() { return z21.send_stats().rate_control.echoes == 1; }));
+    ASSERT_GT(z21.send_stats().rate_control.rate, 100);
+
+    std::vector<uint8_t> unknown_command = {0x07, 0x00, 0x40, 0x00, 0x61, 0x82, 0xe3};
+    station.send_to(boost::asio::buffer(unknown_command), client);
+    ASSERT_TRUE(wait_for([&]() { return z21.send_stats().rate_control.backoffs == 1; }));
+    ASSERT_LT(z21.send_stats().rate_control.rate, 100);
+}
+
+
+TEST_F(Z21Test, SubmitsBatchInOneSyscall)
+{
+    Z21 z21("127.0.0.1", station_port());
+    ASSERT_TRUE(z21.connect());
+
+    std::vector<LanX_SetTurnout> turnouts;
+    for (uint16_t address = 0; address < 200; address++) {
+        turnouts.emplace_back(address, 0x89);
+    }
+    std::vector<const LanX_Command*> commands;
+    for (auto& turnout: turnouts) {
+        commands.push_back(&turnout);
+    }
+
+    std::vector<SubmitStatus> status(commands.size());
+    ASSERT_EQ(z21.submit(commands, status), 200);
+    ASSERT_THAT(status, Each(SubmitStatus::QUEUED));
+
+    // 200 turnout DataSets of 9 bytes and LAN_GET_SERIAL_NUMBER need two datagrams, sent together.
+    z21.listen();
+    ASSERT_EQ(receive_datasets(201), 2);
+    ASSERT_TRUE(wait_for([&]() { return z21.send_stats().datasets_sent == 201; }));
+    ASSERT_EQ(z21.send_stats().datagrams_sent, 2);
+    ASSERT_EQ(z21.send_stats().send_syscalls, 1);
+}
+
+
+TEST_F(Z21Test, SubmitReportsStatusPerCommand)
+{
+    Z21 z21("127.0.0.1", station_port());
+    ASSERT_TRUE(z21.connect());
+
+    LanX_SetStop stop;
+    LanX_MmWriteByte invalid(100, 1);
+    LanX_CvRead cv_read(29);
+    std::array<const LanX_Command*, 3> commands = {&cv_read, &invalid, &stop};
+    std::array<SubmitStatus, 3> status;
+    ASSERT_EQ(z21.submit(commands, status), 2);
+    ASSERT_THAT(status, ElementsAre(SubmitStatus::QUEUED, SubmitStatus::INVALID, SubmitStatus::QUEUED));
+
+    // Each command is queued in the lane of its priority.
+    ASSERT_EQ(z21.send_stats().bulk_queue_depth, 1);
+    z21.listen();
+    ASSERT_EQ(receive(), (std::vector<uint8_t>{0x06, 0x00, 0x40, 0x00, 0x80, 0x80}));
+    receive_datasets(2);
+}
+
+
+TEST_F(Z21Test, ReceivesInBatches)
+{
+    Z21Config config;
+    config.receive_batch = 16;
+    Z21 z21("127.0.0.1", station_port(), config);
+    ASSERT_TRUE(z21.connect());
+    z21.listen();
+    receive();
+
+    // A burst of 64 datagrams with LAN_X_LOCO_INFO, the first one holding two DataSets.
+    std::vector<uint8_t> loco_info = {0x0e, 0x00, 0x40, 0x00, 0xef, 0x00, 0x03, 0x04, 0x80, 0x00, 0x00, 0x00, 0x00, 0x68};
+    std::vector<uint8_t> two_loco_infos = loco_info;
+    two_loco_infos.insert(two_loco_infos.end(), loco_info.begin(), loco_info.end());
+    station.send_to(boost::asio::buffer(two_loco_infos), client);
+    for (int i = 1; i < 64; i++) {
+        station.send_to(boost::asio::buffer(loco_info), client);
+    }
+
+    ASSERT_TRUE(wait_for([&]() { return z21.receive_stats().datagrams_received == 64; }));
+    Z21ReceiveStats stats = z21.receive_stats();
+    ASSERT_EQ(stats.datasets_received, 65);
+    ASSERT_LE(stats.max_datagrams_per_syscall, 16);
+    ASSERT_LT(stats.receive_syscalls, stats.datagrams_received);
+    ASSERT_GT(stats.receive_cpu_time.count(), 0);
+}
+
+TEST_F(Z21Test, ReceivesFullSizeDatagrams)
+{
+    for (size_t receive_batch : {1, 16}) {
+        Z21Config config;
+        config.receive_batch = receive_batch;
+        Z21 z21("127.0.0.1", station_port(), config);
+        ASSERT_TRUE(z21.connect());
+        z21.listen();
+        receive();
+
+        // 40 LAN_X_LOCO_INFO DataSets, far more than the 128 bytes once received.
+        std::vector<uint8_t> loco_info = {0x0e, 0x00, 0x40, 0x00, 0xef, 0x00, 0x03, 0x04, 0x80, 0x00, 0x00, 0x00, 0x00, 0x68};
+        std::vector<uint8_t> loco_infos;
+        for (int i = 0; i < 40; i++) {
+            loco_infos.insert(loco_infos.end(), loco_info.begin(), loco_info.end());
+        }
+        station.send_to(boost::asio::buffer(loco_infos), client);
+
+        // Too large for a receive buffer, so dropped rather than handled cut short.
+        std::vector<uint8_t> oversized(ReceiveBufferPool::buffer_size + 100);
+        station.send_to(boost::asio::buffer(oversized), client);
+
+        ASSERT_TRUE(wait_for([&]() { return z21.receive_stats().datagrams_truncated == 1; }));
+        Z21ReceiveStats stats = z21.receive_stats();
+        ASSERT_EQ(stats.datagrams_received, 1);
+        ASSERT_EQ(stats.datasets_received, 40);
+    }
+}
+
+TEST_F(Z21Test, HandsOffReceivedBuffers)
+{
+    Z21 z21("127.0.0.1", station_port());
+    std::mutex kept_mutex;
+    std::vector<ReceiveBufferPool::Buffer> kept;
+    z21.set_datagram_handler([&](const ReceiveBufferPool::Buffer& buffer) {
+        std::lock_guard<std::mutex> lock(kept_mutex);
+        kept.push_back(buffer);
+    });
+    ASSERT_TRUE(z21.connect());
+    z21.listen();
+    receive();
+
+    // Keeping every buffer exhausts the pool, later datagrams are still handled but not handed off.
+    std::vector<uint8_t> loco_info = {0x0e, 0x00, 0x40, 0x00, 0xef, 0x00, 0x03, 0x04, 0x80, 0x00, 0x00, 0x00, 0x00, 0x68};
+    const size_t count = ReceiveBufferPool::pool_size + 8;
+    for (size_t i = 0; i < count; i++) {
+        loco_info[7] = i;
+        loco_info[13] = 0xef ^ 0x00 ^ 0x03 ^ loco_info[7] ^ 0x80;
+        station.send_to(boost::asio::buffer(loco_info), client);
+        if (i % 32 == 31) {
+            ASSERT_TRUE(wait_for([&]() { return z21.receive_stats().datagrams_received == i + 1; }));
+        }
+    }
+
+    ASSERT_TRUE(wait_for([&]() { return z21.receive_stats().datasets_received == count; }));
+    Z21ReceiveStats stats = z21.receive_stats();
+    ASSERT_GE(stats.receive_pool_exhausted, 8);
+    ASSERT_EQ(stats.receive_buffers_in_use, ReceiveBufferPool::pool_size);
+
+    {
+        std::lock_guard<std::mutex> lock(kept_mutex);
+        ASSERT_EQ(kept.size(), ReceiveBufferPool::pool_size);
+        for (size_t i = 0; i < kept.size(); i++) {
+            ASSERT_EQ(kept[i].bytes().size(), loco_info.size());
+            ASSERT_EQ(kept[i].bytes()[7], static_cast<uint8_t>(i));
+        }
+        kept.clear();
+    }
+
+    // Released from this thread, the buffers are back in the pool.
+    ASSERT_LE(z21.receive_stats().receive_buffers_in_use, 1);
+}
+
+TEST_F(Z21Test, PipelinesDecode)
+{
+    Z21Config config;
+    config.pipelined = true;
+    config.receive_batch = 16;
+    config.rate_control.enabled = true;
+    config.rate_control.initial_rate = 100;
+    Z21 z21("127.0.0.1", station_port(), config);
+    std::atomic<size_t> handed_off{0};
+    z21.set_datagram_handler([&](const ReceiveBufferPool::Buffer&) { handed_off++; });
+    ASSERT_TRUE(z21.connect());
+    z21.listen();
+
+    z21.xbus_set_loco_drive(3, 40, true);
+    receive_datasets(2);
+
+    // LAN_X_LOCO_INFO for loco 3 echoes the drive command, fed back to the rate controller.
+    std::vector<uint8_t> loco_info = {0x0e, 0x00, 0x40, 0x00, 0xef, 0x00, 0x03, 0x04, 0xa8, 0x00, 0x00, 0x00, 0x00, 0x40};
+    for (int i = 0; i < 64; i++) {
+        station.send_to(boost::asio::buffer(loco_info), client);
+    }
+    std::vector<uint8_t> track_power_off = {0x07, 0x00, 0x40, 0x00, 0x61, 0x00, 0x61};
+    station.send_to(boost::asio::buffer(track_power_off), client);
+
+    ASSERT_TRUE(wait_for([&]() { return z21.receive_stats().datasets_received == 65; }));
+    ASSERT_TRUE(wait_for([&]() { return z21.send_stats().rate_control.echoes >= 1; }));
+    // DataSets are counted before they are handled.
+    ASSERT_TRUE(wait_for([&]() { return z21.z21_status().mode.track_voltage_off; }));
+    ASSERT_EQ(handed_off, 65);
+
+    Z21ReceiveStats stats = z21.receive_stats();
+    ASSERT_EQ(stats.pipeline_depth, 0);
+    ASSERT_GE(stats.max_pipeline_depth, 1);
+    ASSERT_EQ(stats.pipeline_drops, 0);
+    ASSERT_GT(stats.total_pipeline_latency.count(), 0);
+    ASSERT_GE(stats.total_pipeline_latency, stats.max_pipeline_latency);
+    ASSERT_GT(stats.decode_time.count(), 0);
+}
+
+TEST_F(Z21Test, ReceivesWithIoUring)
+{
+    Z21Config config;
+    config.receive_backend = ReceiveBackend::IO_URING;
+    Z21 z21("127.0.0.1", station_port(), config);
+    ASSERT_TRUE(z21.connect());
+    z21.listen();
+    receive();
+    if (z21.receive_stats().receive_backend != ReceiveBackend::IO_URING) {
+        GTEST_SKIP() << "io_uring not available";
+    }
+
+    std::vector<uint8_t> loco_info = {0x0e, 0x00, 0x40, 0x00, 0xef, 0x00, 0x03, 0x04, 0x80, 0x00, 0x00, 0x00, 0x00, 0x68};
+    std::vector<uint8_t> two_loco_infos = loco_info;
+    two_loco_infos.insert(two_loco_infos.end(), loco_info.begin(), loco_info.end());
+    station.send_to(boost::asio::buffer(two_loco_infos), client);
+    for (int i = 1; i < 64; i++) {
+        station.send_to(boost::asio::buffer(loco_info), client);
+    }
+    std::vector<uint8_t> oversized(ReceiveBufferPool::buffer_size + 100);
+    station.send_to(boost::asio::buffer(oversized), client);
+
+    ASSERT_TRUE(wait_for([&]() { return z21.receive_stats().datagrams_truncated == 1; }));
+    Z21ReceiveStats stats = z21.receive_stats();
+    ASSERT_EQ(stats.datagrams_received, 64);
+    ASSERT_EQ(stats.datasets_received, 65);
+    ASSERT_LT(stats.receive_wakeups, stats.datagrams_received);
+    ASSERT_LT(stats.receive_syscalls, stats.datagrams_received);
+}
+
+TEST_F(Z21Test, IoUringOutlastsPoolExhaustion)
+{
+    Z21Config config;
+    config.receive_backend = ReceiveBackend::IO_URING;
+    Z21 z21("127.0.0.1", station_port(), config);
+    std::mutex kept_mutex;
+    std::vector<ReceiveBufferPool::Buffer> kept;
+    z21.set_datagram_handler([&](const ReceiveBufferPool::Buffer& buffer) {
+        std::lock_guard<std::mutex> lock(kept_mutex);
+        kept.push_back(buffer);
+    });
+    ASSERT_TRUE(z21.connect());
+    z21.listen();
+    receive();
+    if (z21.receive_stats().receive_backend != ReceiveBackend::IO_URING) {
+        GTEST_SKIP() << "io_uring not available";
+    }
+
+    // Once every buffer is kept, the kernel has none left and the socket is read into the scratch buffer.
+    std::vector<uint8_t> loco_info = {0x0e, 0x00, 0x40, 0x00, 0xef, 0x00, 0x03, 0x04, 0x80, 0x00, 0x00, 0x00, 0x00, 0x68};
+    const size_t count = ReceiveBufferPool::pool_size + 32;
+    for (size_t i = 0; i < count; i++) {
+        station.send_to(boost::asio::buffer(loco_info), client);
+        if (i % 32 == 31) {
+            ASSERT_TRUE(wait_for([&]() { return z21.receive_stats().datagrams_received == i + 1; }));
+        }
+    }
+    ASSERT_TRUE(wait_for([&]() { return z21.receive_stats().datasets_received == count; }));
+    ASSERT_GE(z21.receive_stats().receive_pool_exhausted, 1);
+
+    {
+        std::lock_guard<std::mutex> lock(kept_mutex);
+        ASSERT_EQ(kept.size(), ReceiveBufferPool::pool_size);
+        kept.clear();
+    }
+
+    // With buffers back in the pool, datagrams are handed off again.
+    station.send_to(boost::asio::buffer(loco_info), client);
+    // Counted before the handler runs, so wait for the handler itself.
+    ASSERT_TRUE(wait_for([&]() {
+        std::lock_guard<std::mutex> lock(kept_mutex);
+        return kept.size() == 1;
+    }));
+}
+
+TEST_F(Z21Test, ReceivesWithBusyPoll)
+{
+    Z21Config config;
+    config.receive_backend = ReceiveBackend::BUSY_POLL;
+    config.receive_batch = 16;
+    config.busy_poll_spin = std::chrono::milliseconds(1);
+    config.rate_control.enabled = true;
+    config.rate_control.initial_rate = 100;
+    Z21 z21("127.0.0.1", station_port(), config);
+    ASSERT_TRUE(z21.connect());
+    z21.listen();
+
+    z21.xbus_set_loco_drive(3, 40, true);
+    receive_datasets(2);
+
+    // LAN_X_LOCO_INFO for loco 3, echoing the drive command.
+    std::vector<uint8_t> loco_info = {0x0e, 0x00, 0x40, 0x00, 0xef, 0x00, 0x03, 0x04, 0xa8, 0x00, 0x00, 0x00, 0x00, 0x40};
+    for (int i = 0; i < 64; i++) {
+        station.send_to(boost::asio::buffer(loco_info), client);
+    }
+    ASSERT_TRUE(wait_for([&]() { return z21.receive_stats().datasets_received == 64; }));
+    ASSERT_TRUE(wait_for([&]() { return z21.send_stats().rate_control.echoes >= 1; }));
+    ASSERT_EQ(z21.receive_stats().receive_backend, ReceiveBackend::BUSY_POLL);
+
+    // Parked once the socket stayed empty for the spin time, and woken by the next datagram.
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    uint64_t wakeups = z21.receive_stats().receive_wakeups;
+    station.send_to(boost::asio::buffer(loco_info), client);
+    ASSERT_TRUE(wait_for([&]() { return z21.receive_stats().datasets_received == 65; }));
+    ASSERT_EQ(z21.receive_stats().receive_wakeups, wakeups + 1);
+}
+
+TEST_F(Z21Test, TimestampsDataSetsOnArrival)
+{
+    std::array<Z21Config, 3> configs;
+    configs[1].receive_batch = 16;
+    configs[2].receive_backend = ReceiveBackend::IO_URING;
+    for (const Z21Config& config : configs) {
+        Z21 z21("127.0.0.1", station_port(), config);
+
+        // The first datagram holds up the receiving thread, so the second one waits in the socket.
+        std::atomic<bool> first{true};
+        z21.set_datagram_handler([&](const ReceiveBufferPool::Buffer&) {
+            if (first.exchange(false)) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            }
+        });
+        std::mutex handled_mutex;
+        std::vector<std::pair<ReceiveTimestamp, ReceiveTimestamp>> handled;
+        z21.set_message_handler([&](const Z21Message&, ReceiveTimestamp timestamp) {
+            std::lock_guard<std::mutex> lock(handled_mutex);
+            handled.emplace_back(timestamp, std::chrono::system_clock::now());
+        });
+        ASSERT_TRUE(z21.connect());
+        z21.listen();
+        receive();
+        if (config.receive_backend == ReceiveBackend::IO_URING &&
+            z21.receive_stats().receive_backend != ReceiveBackend::IO_URING) {
+            continue;
+        }
+
+        auto sent = std::chrono::system_clock::now();
+        std::vector<uint8_t> loco_info = {0x0e, 0x00, 0x40, 0x00, 0xef, 0x00, 0x03, 0x04, 0x80, 0x00, 0x00, 0x00, 0x00, 0x68};
+        std::vector<uint8_t> track_power_off = {0x07, 0x00, 0x40, 0x00, 0x61, 0x00, 0x61};
+        station.send_to(boost::asio::buffer(loco_info), client);
+        station.send_to(boost::asio::buffer(track_power_off), client);
+
+        ASSERT_TRUE(wait_for([&]() { return z21.z21_status().updated != ReceiveTimestamp{}; }));
+        std::lock_guard<std::mutex> lock(handled_mutex);
+        ASSERT_EQ(handled.size(), 2);
+        for (auto [timestamp, handled_at] : handled) {
+            ASSERT_GE(timestamp, sent);
+            ASSERT_LE(timestamp, handled_at);
+        }
+        ASSERT_LT(handled[1].first + std::chrono::milliseconds(15), handled[1].second);
+        ASSERT_EQ(z21.z21_status().updated, handled[1].first);
+    }
+}
+
+TEST_F(Z21Test, CountsKernelDrops)
+{
+    Z21Config config;
+    config.receive_buffer_size = 4096;
+    Z21 z21("127.0.0.1", station_port(), config);
+
+    // The first datagram holds up the listener while a burst overflows the small receive buffer.
+    std::atomic<bool> first{true};
+    z21.set_datagram_handler([&](const ReceiveBufferPool::Buffer&) {
+        if (first.exchange(false)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+    });
+    ASSERT_TRUE(z21.connect());
+    z21.listen();
+    receive();
+    ASSERT_GE(z21.receive_stats().socket_receive_buffer, 4096);
+    ASSERT_GT(z21.send_stats().socket_send_buffer, 0);
+
+    std::vector<uint8_t> loco_info = {0x0e, 0x00, 0x40, 0x00, 0xef, 0x00, 0x03, 0x04, 0x80, 0x00, 0x00, 0x00, 0x00, 0x68};
+    const size_t burst = 200;
+    for (size_t i = 0; i < burst; i++) {
+        station.send_to(boost::asio::buffer(loco_info), client);
+    }
+
+    // Drops are reported with the next datagram that makes it.
+    ASSERT_TRUE(wait_for([&]() { return !first && z21.receive_stats().receive_wakeups > 1; }));
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    station.send_to(boost::asio::buffer(loco_info), client);
+    ASSERT_TRUE(wait_for([&]() {
+        Z21ReceiveStats stats = z21.receive_stats();
+        return stats.datagrams_received + stats.kernel_drops == burst + 1;
+    }));
+
+    Z21ReceiveStats stats = z21.receive_stats();
+    ASSERT_GT(stats.kernel_drops, 0);
+    ASSERT_EQ(stats.bytes_received, stats.datagrams_received * loco_info.size());
+}
+
+TEST_F(Z21Test, KeepsLocoStateFromLocoInfo)
+{
+    Z21 z21("127.0.0.1", station_port());
+    ASSERT_TRUE(z21.connect());
+    z21.listen();
+    receive();
+
+    // LAN_X_LOCO_INFO for loco 3: 128 speed steps, forward at speed 40, with F0 and F1 on.
+    auto sent = std::chrono::system_clock::now();
+    std::vector<uint8_t> loco_info = {0x0e, 0x00, 0x40, 0x00, 0xef, 0x00, 0x03, 0x04, 0xa8, 0x11, 0x00, 0x00, 0x00, 0x51};
+    station.send_to(boost::asio::buffer(loco_info), client);
+
+    ASSERT_TRUE(wait_for([&]() { return z21.loco_states().known(3); }));
+    std::optional<LocoState> state = z21.loco_states().get(3);
+    ASSERT_TRUE(state.has_value());
+    ASSERT_EQ(state->speed_steps, LanX_LocoInfo::DCC_128);
+    ASSERT_TRUE(state->direction_forward);
+    ASSERT_EQ(state->speed, 40);
+    ASSERT_EQ(state->functions, LocoFunctions{0x03});
+    ASSERT_GE(state->updated, sent);
+    ASSERT_FALSE(z21.loco_states().known(4));
+}
+
+TEST_F(Z21Test, KeepsAccessoryStateFromBroadcasts)
+{
+    Z21 z21("127.0.0.1", station_port());
+    ASSERT_TRUE(z21.connect());
+    z21.listen();
+    receive();
+
+    // LAN_X_TURNOUT_INFO for turnout 300 in position P1, and LAN_X_EXT_ACCESSORY_INFO for accessory 20.
+    std::vector<uint8_t> turnout_info = {0x09, 0x00, 0x40, 0x00, 0x43, 0x01, 0x2c, 0x02, 0x6c};
+    std::vector<uint8_t> ext_accessory_info = {0x0a, 0x00, 0x40, 0x00, 0x44, 0x00, 0x14, 0x05, 0x00, 0x55};
+    station.send_to(boost::asio::buffer(turnout_info), client);
+    station.send_to(boost::asio::buffer(ext_accessory_info), client);
+
+    ASSERT_TRUE(wait_for([&]() { return z21.state_version() == 2; }));
+    ASSERT_EQ(z21.accessory_states().turnout(300), LanX_TurnoutInfo::SWITCHED_P1);
+    ASSERT_EQ(z21.accessory_states().ext_accessory(20), 0x05);
+}
+
+TEST_F(Z21Test, PublishesConsistentStatusSnapshots)
+{
+    Z21 z21("127.0.0.1", station_port());
+    ASSERT_TRUE(z21.connect());
+    z21.listen();
+    receive();
+
+    // LAN_SYSTEMSTATE_DATACHANGED with main, prog and filtered current all equal and the temperature their
+    // negation, so a status read between field updates shows.
+    auto system_state = [](int16_t current) {
+        std::vector<uint8_t> data = {0x14, 0x00, 0x84, 0x00};
+        auto le16 = [&data](int16_t value) {
+            data.push_back(static_cast<uint8_t>(value));
+            data.push_back(static_cast<uint8_t>(static_cast<uint16_t>(value) >> 8));
+        };
+        le16(current);
+        le16(current);
+        le16(current);
+        le16(static_cast<int16_t>(-current));
+        le16(0);
+        le16(0);
+        data.insert(data.end(), {0x00, 0x00, 0x00, 0x00});
+        return data;
+    };
+
+    std::atomic<bool> done{false};
+    std::atomic<size_t> torn{0};
+    std::atomic<size_t> reads{0};
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 2; r++) {
+        readers.emplace_back([&]() {
+            while (!done.load(std::memory_order_relaxed)) {
+                Z21Status status = z21.z21_status();
+                if (status.track.prog_current != status.track.main_current ||
+                    status.track.filtered_main_current != status.track.main_current ||
+                    status.temperature != -status.track.main_current) {
+                    torn++;
+                }
+                reads++;
+            }
+        });
+    }
+
+    const int16_t count = 2000;
+    for (int16_t i = 1; i <= count; i++) {
+        station.send_to(boost::asio::buffer(system_state(i)), client);
+        if (i % 100 == 0) {
+            ASSERT_TRUE(wait_for([&]() { return z21.receive_stats().datasets_received == static_cast<uint64_t>(i); }));
+        }
+    }
+    ASSERT_TRUE(wait_for([&]() { return z21.z21_status().track.main_current == count; }));
+    done = true;
+    for (auto& reader : readers) {
+        reader.join();
+    }
+
+    ASSERT_EQ(torn, 0);
+    ASSERT_GT(reads, 0);
+    ASSERT_NE(z21.z21_status().updated, ReceiveTimestamp{});
+}
+
+TEST_F(Z21Test, NotifiesSubscribersOfChangedFields)
+{
+    Z21 z21("127.0.0.1", station_port());
+    std::mutex mutex;
+    std::vector<event::LocoChanged> locos;
+    std::vector<event::PowerChanged> power;
+    std::vector<event::CvResult> cv_results;
+    std::thread::id handling_thread;
+    bool on_handling_thread = false;
+    z21.set_message_handler([&](const Z21Message&, ReceiveTimestamp) {
+        std::lock_guard lock(mutex);
+        handling_thread = std::this_thread::get_id();
+    });
+    z21.on_loco_changed([&](const event::LocoChanged& change) {
+        std::lock_guard lock(mutex);
+        on_handling_thread = on_handling_thread || std::this_thread::get_id() == handling_thread;
+        locos.push_back(change);
+    });
+    z21.on_power_changed([&](const event::PowerChanged& change) {
+        std::lock_guard lock(mutex);
+        power.push_back(change);
+    });
+    z21.on_cv_result([&](const event::CvResult& result) {
+        std::lock_guard lock(mutex);
+        cv_results.push_back(result);
+    });
+    ASSERT_TRUE(z21.connect());
+    z21.listen();
+    receive();
+
+    // LAN_X_LOCO_INFO for loco 3, forward at speed 40 with F0 and F1 on, then the same at speed 41 and
+    // again unchanged.
+    std::vector<uint8_t> loco_info = {0x0e, 0x00, 0x40, 0x00, 0xef, 0x00, 0x03, 0x04, 0xa8, 0x11, 0x00, 0x00, 0x00, 0x51};
+    std::vector<uint8_t> faster = {0x0e, 0x00, 0x40, 0x00, 0xef, 0x00, 0x03, 0x04, 0xa9, 0x11, 0x00, 0x00, 0x00, 0x50};
+    station.send_to(boost::asio::buffer(loco_info), client);
+    station.send_to(boost::asio::buffer(faster), client);
+    station.send_to(boost::asio::buffer(faster), client);
+
+    // LAN_X_BC_TRACK_POWER_OFF twice, and LAN_X_CV_RESULT with CV 29 (sent as 28) = 5.
+    std::vector<uint8_t> track_power_off = {0x07, 0x00, 0x40, 0x00, 0x61, 0x00, 0x61};
+    std::vector<uint8_t> cv_result = {0x0a, 0x00, 0x40, 0x00, 0x64, 0x14, 0x00, 0x1c, 0x05, 0x69};
+    station.send_to(boost::asio::buffer(track_power_off), client);
+    station.send_to(boost::asio::buffer(track_power_off), client);
+    station.send_to(boost::asio::buffer(cv_result), client);
+
+    ASSERT_TRUE(wait_for([&]() { std::lock_guard lock(mutex); return cv_results.size() == 1; }));
+    std::lock_guard lock(mutex);
+    ASSERT_FALSE(on_handling_thread);
+
+    // New loco, everything set; then only the speed.
+    ASSERT_EQ(locos.size(), 2);
+    ASSERT_EQ(locos[0].address, 3);
+    ASSERT_EQ(locos[0].speed, 40);
+    ASSERT_EQ(locos[0].direction_forward, true);
+    ASSERT_EQ(locos[0].speed_steps, LanX_LocoInfo::DCC_128);
+    ASSERT_EQ(locos[0].changed_functions, LocoFunctions{0x03});
+    ASSERT_EQ(locos[0].functions, LocoFunctions{0x03});
+    ASSERT_EQ(locos[1].speed, 41);
+    ASSERT_FALSE(locos[1].direction_forward.has_value());
+    ASSERT_FALSE(locos[1].speed_steps.has_value());
+    ASSERT_FALSE(locos[1].busy.has_value());
+    ASSERT_FALSE(locos[1].changed_functions.any());
+
+    ASSERT_EQ(power.size(), 1);
+    ASSERT_EQ(power[0].track_voltage_off, true);
+    ASSERT_FALSE(power[0].emergency_stop.has_value());
+
+    ASSERT_EQ(cv_results[0].result, event::CvResult::OK);
+    ASSERT_EQ(cv_results[0].cv, 29);
+    ASSERT_EQ(cv_results[0].value, 5);
+    ASSERT_EQ(z21.receive_stats().events_published, 4);
+}
+
+TEST_F(Z21Test, PublishesAccessoryStateAsStored)
+{
+    Z21 z21("127.0.0.1", station_port());
+    std::mutex mutex;
+    std::vector<event::AccessoryChanged> accessories;
+    z21.on_accessory_changed([&](const event::AccessoryChanged& change) {
+        std::lock_guard lock(mutex);
+        accessories.push_back(change);
+    });
+    ASSERT_TRUE(z21.connect());
+    z21.listen();
+    receive();
+
+    // LAN_X_TURNOUT_INFO for turnout 300 in position P1, then with a status that is no position.
+    std::vector<uint8_t> turnout_info = {0x09, 0x00, 0x40, 0x00, 0x43, 0x01, 0x2c, 0x02, 0x6c};
+    std::vector<uint8_t> turnout_unknown = {0x09, 0x00, 0x40, 0x00, 0x43, 0x01, 0x2c, 0x03, 0x6d};
+    station.send_to(boost::asio::buffer(turnout_info), client);
+    station.send_to(boost::asio::buffer(turnout_unknown), client);
+
+    ASSERT_TRUE(wait_for([&]() { std::lock_guard lock(mutex); return accessories.size() == 2; }));
+    std::lock_guard lock(mutex);
+    ASSERT_EQ(accessories[0].state, LanX_TurnoutInfo::SWITCHED_P1);
+    ASSERT_EQ(accessories[1].address, 300);
+    ASSERT_EQ(accessories[1].state, z21.accessory_states().turnout(300));
+    ASSERT_EQ(accessories[1].state, LanX_TurnoutInfo::NOT_SWITCHED);
+}
+
+TEST_F(Z21Test, ServesChangesSinceVersion)
+{
+    Z21 z21("127.0.0.1", station_port());
+    ASSERT_TRUE(z21.connect());
+    z21.listen();
+    receive();
+
+    auto changes = [&z21](uint64_t& version) {
+        std::vector<StateChange> result;
+        version = z21.changes_since(version, [&result](const StateChange& change) { result.push_back(change); });
+        return result;
+    };
+
+    // LAN_X_LOCO_INFO for loco 3, LAN_X_TURNOUT_INFO for turnout 300 and LAN_X_BC_TRACK_POWER_OFF.
+    std::vector<uint8_t> loco_info = {0x0e, 0x00, 0x40, 0x00, 0xef, 0x00, 0x03, 0x04, 0xa8, 0x11, 0x00, 0x00, 0x00, 0x51};
+    std::vector<uint8_t> turnout_info = {0x09, 0x00, 0x40, 0x00, 0x43, 0x01, 0x2c, 0x02, 0x6c};
+    std::vector<uint8_t> track_power_off = {0x07, 0x00, 0x40, 0x00, 0x61, 0x00, 0x61};
+    station.send_to(boost::asio::buffer(loco_info), client);
+    station.send_to(boost::asio::buffer(turnout_info), client);
+    station.send_to(boost::asio::buffer(track_power_off), client);
+    ASSERT_TRUE(wait_for([&]() { return z21.state_version() == 3; }));
+
+    uint64_t version = 0;
+    std::vector<StateChange> result = changes(version);
+    ASSERT_EQ(version, 3);
+    ASSERT_EQ(result.size(), 3);
+    ASSERT_EQ(result[0].kind, StateChange::LOCO);
+    ASSERT_EQ(result[0].key, 3);
+    ASSERT_EQ(result[1].kind, StateChange::TURNOUT);
+    ASSERT_EQ(result[1].key, 300);
+    ASSERT_EQ(result[2].kind, StateChange::SYSTEM_STATE);
+    ASSERT_TRUE(z21.z21_status().mode.track_voltage_off);
+
+    // Repeated, unchanged broadcasts are no change.
+    station.send_to(boost::asio::buffer(loco_info), client);
+    station.send_to(boost::asio::buffer(turnout_info), client);
+    station.send_to(boost::asio::buffer(track_power_off), client);
+    ASSERT_TRUE(wait_for([&]() { return z21.receive_stats().datasets_received == 6; }));
+    ASSERT_TRUE(changes(version).empty());
+    ASSERT_EQ(z21.state_version(), 3);
+}
@@ -0,0 +1,85 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "accessory_state_table.h"
+
+
+AccessoryStateTable::AccessoryStateTable() :
+    m_turnouts((max_turnout + 1) / turnouts_per_word),
+    m_ext_accessories(max_ext_accessory + 1),
+    m_ext_accessories_known((max_ext_accessory + 1) / 64)
+{
+}
+
+bool AccessoryStateTable::update(const message::TurnoutInfo& info)
+{
+    if (info.address > max_turnout) {
+        return false;
+    }
+
+    // Not decodable is stored as NOT_SWITCHED, both mean the position is not known.
+    uint64_t status = info.status <= TurnoutStatus::SWITCHED_P1 ? info.status : TurnoutStatus::NOT_SWITCHED;
+    unsigned shift = info.address % turnouts_per_word * 2;
+    std::atomic<uint64_t>& word = m_turnouts[info.address / turnouts_per_word];
+
+    // Only this thread writes, so a load and a store are enough.
+    uint64_t current = word.load(std::memory_order_relaxed);
+    uint64_t updated = (current & ~(uint64_t{0x03} << shift)) | (status << shift);
+    if (updated == current) {
+        return false;
+    }
+
+    word.store(updated, std::memory_order_release);
+    return true;
+}
+
+bool AccessoryStateTable::update(const message::ExtAccessoryInfo& info)
+{
+    if (info.address > max_ext_accessory) {
+        return false;
+    }
+
+    uint64_t bit = uint64_t{1} << (info.address % 64);
+    std::atomic<uint64_t>& known = m_ext_accessories_known[info.address / 64];
+    uint64_t known_now = known.load(std::memory_order_relaxed);
+    bool was_known = known_now & bit;
+    if (!info.data_valid) {
+        if (!was_known) {
+            return false;
+        }
+        known.store(known_now & ~bit, std::memory_order_release);
+    }
+    else {
+        if (was_known && m_ext_accessories[info.address].load(std::memory_order_relaxed) == info.state) {
+            return false;
+        }
+        // The state must be visible before the known bit, readers check the bit first.
+        m_ext_accessories[info.address].store(info.state, std::memory_order_relaxed);
+        known.store(known_now | bit, std::memory_order_release);
+    }
+    return true;
+}
+
+std::optional<uint8_t> AccessoryStateTable::ext_accessory(uint16_t address) const
+{
+    if (address > max_ext_accessory ||
+        !(m_ext_accessories_known[address / 64].load(std::memory_order_acquire) & (uint64_t{1} << (address % 64)))) {
+        return std::nullopt;
+    }
+    return m_ext_accessories[address].load(std::memory_order_relaxed);
+}
@@ -0,0 +1,163 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef TRAINPP_ACCESSORY_STATE_TABLE_H
+#define TRAINPP_ACCESSORY_STATE_TABLE_H
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "z21_message.h"
+
+
+/**
+ * Last known state of every turnout and extended accessory, as broadcast in LAN_X_TURNOUT_INFO and
+ * LAN_X_EXT_ACCESSORY_INFO.
+ *
+ * Turnouts take 2 bits each, their TurnoutStatus, 32 to a word, so range queries go a word at a time and
+ * "unknown" (NOT_SWITCHED, never reported or not decodable) is found with a mask instead of a loop per
+ * turnout. Extended accessories take a byte each, plus a bit telling whether it is known.
+ *
+ * Updates report whether anything changed, so the caller can stamp the change with a version of the whole
+ * Z21 state (see ChangeLog) for pollers.
+ *
+ * One thread updates, any number of threads read without locks. Each entry is read atomically; a range
+ * query is not a snapshot of the whole range while it is being updated.
+ */
+class AccessoryStateTable
+{
+public:
+    using TurnoutStatus = LanX_TurnoutInfo::TurnoutStatus;
+
+    static constexpr uint16_t max_turnout = 4095;
+    static constexpr uint16_t max_ext_accessory = 2047;
+
+    AccessoryStateTable();
+
+    /**
+     * Update a turnout (writer thread only).
+     * @param info decoded LAN_X_TURNOUT_INFO, ignored if its address is above max_turnout
+     * @return true if the status changed
+     */
+    bool update(const message::TurnoutInfo& info);
+
+    /**
+     * Update an extended accessory (writer thread only).
+     * @param info decoded LAN_X_EXT_ACCESSORY_INFO, ignored if its address is above max_ext_accessory. If
+     *             its data is not valid, the accessory becomes unknown.
+     * @return true if the state changed
+     */
+    bool update(const message::ExtAccessoryInfo& info);
+
+    /**
+     * Status of a turnout (any thread).
+     * @return status, NOT_SWITCHED if unknown or out of range
+     */
+    TurnoutStatus turnout(uint16_t address) const
+    {
+        if (address > max_turnout) {
+            return TurnoutStatus::NOT_SWITCHED;
+        }
+        uint64_t word = m_turnouts[address / turnouts_per_word].load(std::memory_order_acquire);
+        return static_cast<TurnoutStatus>((word >> (address % turnouts_per_word * 2)) & 0x03);
+    }
+
+    /**
+     * State of an extended accessory (any thread).
+     * @return state, empty if unknown or out of range
+     */
+    std::optional<uint8_t> ext_accessory(uint16_t address) const;
+
+    /**
+     * Visit the turnouts first to last, with their status (any thread).
+     * @param fn called as fn(address, status)
+     */
+    template<typename Fn>
+    void turnouts(uint16_t first, uint16_t last, Fn fn) const
+    {
+        last = std::min(last, max_turnout);
+        for (size_t address = first; address <= last; address++) {
+            fn(static_cast<uint16_t>(address), turnout(address));
+        }
+    }
+
+    /**
+     * Visit the turnouts first to last with an unknown position (any thread).
+     * @param fn called as fn(address)
+     */
+    template<typename Fn>
+    void unknown_turnouts(uint16_t first, uint16_t last, Fn fn) const
+    {
+        for_each_turnout_word(first, last, [&](size_t w, uint64_t word, uint64_t range) {
+            // Low bit of each pair set where both bits are clear.
+            uint64_t unknown = ~(word | word >> 1) & even_bits & range;
+            for (; unknown; unknown &= unknown - 1) {
+                fn(static_cast<uint16_t>(w * turnouts_per_word + std::countr_zero(unknown) / 2));
+            }
+        });
+    }
+
+    /**
+     * Number of turnouts first to last with an unknown position (any thread).
+     */
+    size_t count_unknown_turnouts(uint16_t first, uint16_t last) const
+    {
+        size_t count = 0;
+        for_each_turnout_word(first, last, [&](size_t, uint64_t word, uint64_t range) {
+            count += std::popcount(~(word | word >> 1) & even_bits & range);
+        });
+        return count;
+    }
+
+private:
+    static constexpr size_t turnouts_per_word = 32;
+    static constexpr uint64_t even_bits = 0x5555555555555555;
+
+    /**
+     * Call fn(word index, word, mask of the bits in range) for each word holding turnouts first to last.
+     */
+    template<typename Fn>
+    void for_each_turnout_word(uint16_t first, uint16_t last, Fn fn) const
+    {
+        last = std::min(last, max_turnout);
+        if (first > last) {
+            return;
+        }
+        for (size_t w = first / turnouts_per_word; w <= last / turnouts_per_word; w++) {
+            uint64_t range = ~uint64_t{0};
+            if (w == first / turnouts_per_word) {
+                range &= ~uint64_t{0} << (first % turnouts_per_word * 2);
+            }
+            if (w == last / turnouts_per_word && last % turnouts_per_word != turnouts_per_word - 1) {
+                range &= (uint64_t{1} << ((last % turnouts_per_word + 1) * 2)) - 1;
+            }
+            fn(w, m_turnouts[w].load(std::memory_order_acquire), range);
+        }
+    }
+
+    std::vector<std::atomic<uint64_t>> m_turnouts;             // 2 bits per turnout
+    std::vector<std::atomic<uint8_t>> m_ext_accessories;
+    std::vector<std::atomic<uint64_t>> m_ext_accessories_known;  // 1 bit per extended accessory
+};
+
+
+#endif // TRAINPP_ACCESSORY_STATE_TABLE_H
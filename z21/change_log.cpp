@@ -0,0 +1,47 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "change_log.h"
+
+#include "loco_state_table.h"
+#include "accessory_state_table.h"
+
+
+ChangeLog::ChangeLog()
+{
+    m_latest[StateChange::SYSTEM_STATE] = std::vector<std::atomic<uint64_t>>(1);
+    m_latest[StateChange::LOCO] = std::vector<std::atomic<uint64_t>>(LocoStateTable::max_address + 1);
+    m_latest[StateChange::TURNOUT] = std::vector<std::atomic<uint64_t>>(AccessoryStateTable::max_turnout + 1);
+    m_latest[StateChange::EXT_ACCESSORY] = std::vector<std::atomic<uint64_t>>(AccessoryStateTable::max_ext_accessory + 1);
+}
+
+uint64_t ChangeLog::record(StateChange::Kind kind, uint16_t key)
+{
+    uint64_t version = m_version.load(std::memory_order_relaxed);
+    if (key >= m_latest[kind].size()) {
+        return version;
+    }
+    version++;
+
+    // Both stored before the version is published, so a reader finds them for every version it sees.
+    m_latest[kind][key].store(version, std::memory_order_relaxed);
+    m_entries[version & (capacity - 1)].store((version & version_mask) << version_shift | uint64_t(kind) << key_bits | key,
+                                              std::memory_order_release);
+    m_version.store(version, std::memory_order_release);
+    return version;
+}
@@ -0,0 +1,146 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef TRAINPP_CHANGE_LOG_H
+#define TRAINPP_CHANGE_LOG_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+/**
+ * A changed part of the Z21 state, with the version of its latest change.
+ */
+struct StateChange
+{
+    enum Kind : uint8_t
+    {
+        SYSTEM_STATE,   // Z21Status, key 0
+        LOCO,           // key is the loco address
+        TURNOUT,        // key is the turnout address
+        EXT_ACCESSORY,  // key is the extended accessory address
+    };
+
+    Kind kind{SYSTEM_STATE};
+    uint16_t key{0};
+    uint64_t version{0};
+};
+
+
+/**
+ * Versions of the Z21 state, for pollers asking what changed since the version they last saw.
+ *
+ * Every change gets the next version, and is logged in a ring indexed by version, so a poller walks only the
+ * changes it has not seen rather than the whole state. The latest version of every key is kept as well,
+ * so a key that changed several times is reported once, and a poller that fell more than a ring behind is
+ * answered with a scan of those instead.
+ *
+ * One thread records changes, any number of threads ask without locks.
+ */
+class ChangeLog
+{
+public:
+    static constexpr size_t capacity = 4096;
+
+    ChangeLog();
+
+    /**
+     * Stamp a change with the next version (writer thread only).
+     * @param kind kind of state changed
+     * @param key address, ignored if out of range for kind
+     * @return version of the change, the current version if ignored
+     */
+    uint64_t record(StateChange::Kind kind, uint16_t key);
+
+    /**
+     * Version of the latest change, zero before the first (any thread).
+     */
+    uint64_t version() const { return m_version.load(std::memory_order_acquire); }
+
+    /**
+     * Visit what changed after version, each key once with the version of its latest change, oldest first
+     * (any thread). Changes recorded while visiting are left for the next call. In the rare case the ring
+     * wraps past the visitor meanwhile, the rest is found by a scan, in which a key may be visited again.
+     * @param version version last seen, zero for everything ever changed
+     * @param fn called as fn(const StateChange&)
+     * @return current version, to pass next time
+     */
+    template<typename Fn>
+    uint64_t changes_since(uint64_t version, Fn fn) const
+    {
+        uint64_t current = m_version.load(std::memory_order_acquire);
+        uint64_t next = version + 1;
+        if (current - version <= capacity) {
+            for (; next <= current; next++) {
+                uint64_t entry = m_entries[next & (capacity - 1)].load(std::memory_order_acquire);
+                if ((entry >> version_shift) != (next & version_mask)) {
+                    break;
+                }
+                auto kind = static_cast<StateChange::Kind>((entry >> key_bits) & kind_mask);
+                auto key = static_cast<uint16_t>(entry);
+                if (m_latest[kind][key].load(std::memory_order_relaxed) == next) {
+                    fn(StateChange{kind, key, next});
+                }
+            }
+        }
+
+        if (next <= current) {
+            scan(next, current, fn);
+        }
+        return current;
+    }
+
+private:
+    static constexpr unsigned key_bits = 16;
+    static constexpr unsigned version_shift = 20;
+    static constexpr uint64_t kind_mask = 0xf;
+    static constexpr uint64_t version_mask = (uint64_t(1) << (64 - version_shift)) - 1;
+    static constexpr size_t kinds = 4;
+
+    static_assert((capacity & (capacity - 1)) == 0, "ChangeLog capacity must be a power of two");
+
+    /**
+     * Visit every key with its latest version from first to last, in key order.
+     */
+    template<typename Fn>
+    void scan(uint64_t first, uint64_t last, Fn& fn) const
+    {
+        for (size_t kind = 0; kind < kinds; kind++) {
+            for (size_t key = 0; key < m_latest[kind].size(); key++) {
+                uint64_t latest = m_latest[kind][key].load(std::memory_order_relaxed);
+                if (latest >= first && latest <= last) {
+                    fn(StateChange{static_cast<StateChange::Kind>(kind), static_cast<uint16_t>(key), latest});
+                }
+            }
+        }
+    }
+
+    // Ring of changes by version: version (low 44 bits) << 20 | kind << 16 | key.
+    std::array<std::atomic<uint64_t>, capacity> m_entries{};
+
+    // Version of the latest change of every key, by kind.
+    std::array<std::vector<std::atomic<uint64_t>>, kinds> m_latest;
+
+    std::atomic<uint64_t> m_version{0};
+};
+
+
+#endif // TRAINPP_CHANGE_LOG_H
@@ -0,0 +1,339 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef TRAINPP_CODEC_H
+#define TRAINPP_CODEC_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <type_traits>
+
+
+/**
+ * Compile time codec for Z21 messages.
+ *
+ * A message is described once, as a struct with:
+ * - `Fields`: plain struct with the values carried by the message.
+ * - `pattern`: the message bytes with all fields zero (X-Bus header, DB0 and constant bytes).
+ * - `key_size`: number of leading pattern bytes identifying the message when decoding.
+ * - `checksum`: true if an XOR checksum byte follows the pattern (X-Bus messages).
+ * - `layout`: Layout of Bits placing each field in the pattern.
+ *
+ * encode() and decode() are generated from that description and fully inline, with no virtual calls or
+ * allocations. See z21_protocol.h for the descriptions.
+ */
+namespace codec
+{
+    template<typename T>
+    struct member_traits;
+
+    template<typename Owner, typename T>
+    struct member_traits<T Owner::*>
+    {
+        using owner = Owner;
+        using type = T;
+    };
+
+    // Fields are up to 64 bits wide, e.g. the LAN_X_LOCO_INFO functions.
+    using Raw = uint64_t;
+
+    template<typename T>
+    constexpr Raw to_raw(T value)
+    {
+        if constexpr (std::is_enum_v<T>) {
+            return static_cast<Raw>(static_cast<std::underlying_type_t<T>>(value));
+        }
+        else {
+            return static_cast<Raw>(static_cast<std::make_unsigned_t<std::conditional_t<std::is_same_v<T, bool>, uint8_t, T>>>(value));
+        }
+    }
+
+    template<typename T>
+    constexpr T from_raw(Raw raw)
+    {
+        if constexpr (std::is_enum_v<T>) {
+            return static_cast<T>(static_cast<std::underlying_type_t<T>>(raw));
+        }
+        else {
+            return static_cast<T>(raw);
+        }
+    }
+
+
+    /**
+     * Bits [shift, shift + width) of byte `Index` carry bits [from, from + width) of field `Member`. A field
+     * wider than a byte is made of several Bits. On the wire the field is offset by `Bias` (e.g. -1 for CV
+     * numbers, sent zero based); the Bits with `From` zero removes the bias again when decoding.
+     */
+    template<auto Member, size_t Index, unsigned Shift, unsigned Width, unsigned From = 0, int Bias = 0>
+    struct Bits
+    {
+        using Fields = typename member_traits<decltype(Member)>::owner;
+        using Type = typename member_traits<decltype(Member)>::type;
+
+        static_assert(Shift + Width <= 8);
+        static constexpr uint8_t mask = ((1u << Width) - 1) << Shift;
+        static constexpr size_t max_index = Index;
+
+        static constexpr void encode(const Fields& fields, std::span<uint8_t> buffer)
+        {
+            Raw value = to_raw(fields.*Member) + Bias;
+            buffer[Index] |= ((value >> From) << Shift) & mask;
+        }
+
+        static constexpr void decode(std::span<const uint8_t> data, Fields& fields)
+        {
+            if (Index < data.size()) {
+                Raw bits = static_cast<Raw>((data[Index] & mask) >> Shift) << From;
+                fields.*Member = from_raw<Type>(to_raw(fields.*Member) | bits);
+            }
+        }
+
+        static constexpr void finish(Fields& fields)
+        {
+            if constexpr (Bias != 0 && From == 0) {
+                fields.*Member = from_raw<Type>(to_raw(fields.*Member) - Bias);
+            }
+        }
+    };
+
+    /**
+     * Sequence of Bits (or nested layouts) making up a message.
+     */
+    template<typename... Parts>
+    struct Layout
+    {
+        static constexpr size_t max_index = std::max({size_t{0}, Parts::max_index...});
+
+        // Parameters are unused by an empty layout.
+        template<typename Fields>
+        static constexpr void encode([[maybe_unused]] const Fields& fields, [[maybe_unused]] std::span<uint8_t> buffer)
+        {
+            (Parts::encode(fields, buffer), ...);
+        }
+
+        template<typename Fields>
+        static constexpr void decode([[maybe_unused]] std::span<const uint8_t> data, [[maybe_unused]] Fields& fields)
+        {
+            (Parts::decode(data, fields), ...);
+        }
+
+        template<typename Fields>
+        static constexpr void finish(Fields& fields)
+        {
+            (Parts::finish(fields), ...);
+        }
+    };
+
+    // Common multi byte fields.
+    template<auto Member, size_t Index, int Bias = 0>
+    using Be16 = Layout<Bits<Member, Index, 0, 8, 8, Bias>, Bits<Member, Index + 1, 0, 8, 0, Bias>>;
+
+    template<auto Member, size_t Index>
+    using Le16 = Layout<Bits<Member, Index, 0, 8, 0>, Bits<Member, Index + 1, 0, 8, 8>>;
+
+    template<auto Member, size_t Index>
+    using Le32 = Layout<Bits<Member, Index, 0, 8, 0>, Bits<Member, Index + 1, 0, 8, 8>,
+                        Bits<Member, Index + 2, 0, 8, 16>, Bits<Member, Index + 3, 0, 8, 24>>;
+
+    template<auto Member, size_t Index>
+    using Byte = Bits<Member, Index, 0, 8>;
+
+    // Loco address, big endian with the two top bits of the high byte reserved.
+    template<auto Member, size_t Index>
+    using LocoAddress = Layout<Bits<Member, Index, 0, 6, 8>, Bits<Member, Index + 1, 0, 8>>;
+
+
+    /**
+     * Size of an encoded message, including checksum.
+     */
+    template<typename Message>
+    constexpr size_t size = Message::pattern.size() + (Message::checksum ? 1 : 0);
+
+    /**
+     * Encode message into buffer.
+     * @param fields field values
+     * @param buffer buffer to encode into
+     * @return number of bytes written, 0 if buffer is too small
+     */
+    template<typename Message>
+    constexpr size_t encode(const typename Message::Fields& fields, std::span<uint8_t> buffer)
+    {
+        static_assert(Message::layout::max_index < Message::pattern.size());
+
+        if (buffer.size() < size<Message>) {
+            return 0;
+        }
+
+        std::copy(Message::pattern.begin(), Message::pattern.end(), buffer.begin());
+        Message::layout::encode(fields, buffer);
+
+        if constexpr (Message::checksum) {
+            uint8_t checksum = 0;
+            for (size_t i = 0; i < Message::pattern.size(); i++) {
+                checksum ^= buffer[i];
+            }
+            buffer[Message::pattern.size()] = checksum;
+        }
+        return size<Message>;
+    }
+
+    /**
+     * Check if data holds message, by its key bytes.
+     */
+    template<typename Message>
+    constexpr bool matches(std::span<const uint8_t> data)
+    {
+        return data.size() >= Message::key_size &&
+               std::equal(Message::pattern.begin(), Message::pattern.begin() + Message::key_size, data.begin());
+    }
+
+    /**
+     * Decode message from data, which starts with the pattern and may end with the checksum (it is not
+     * verified here). Fields in optional trailing bytes beyond the pattern (like LAN_X_LOCO_INFO DB8) decode
+     * as zero when missing.
+     * @param data received message
+     * @return decoded fields, nothing if data is shorter than the pattern
+     */
+    template<typename Message>
+    constexpr std::optional<typename Message::Fields> decode(std::span<const uint8_t> data)
+    {
+        constexpr size_t pattern_size = Message::pattern.size();
+        if (data.size() < pattern_size) {
+            return std::nullopt;
+        }
+
+        typename Message::Fields fields{};
+        size_t trailing = data.size() - pattern_size;
+        auto payload = data.first(pattern_size + (Message::checksum && trailing > 0 ? trailing - 1 : trailing));
+        Message::layout::decode(payload, fields);
+        Message::layout::finish(fields);
+        return fields;
+    }
+
+
+    /**
+     * Constant time lookup of which of `Messages` data holds, from their one or two byte keys.
+     */
+    template<typename... Messages>
+    class Dispatcher
+    {
+    public:
+        using Id = std::common_type_t<decltype(Messages::id)...>;
+
+        static constexpr size_t count = sizeof...(Messages);
+        static constexpr std::array<Id, count> ids = {Messages::id...};
+
+        /**
+         * Identify message.
+         * @param data received message
+         * @return index into `Messages` (and `ids`), or `count` if unknown
+         */
+        static constexpr size_t find(std::span<const uint8_t> data)
+        {
+            if (data.empty()) {
+                return count;
+            }
+
+            Entry entry = tables.first[data[0]];
+            if (entry.second_level == none || data.size() < 2) {
+                return entry.index;
+            }
+            return tables.second[entry.second_level][data[1]];
+        }
+
+        /**
+         * Index of a message in `Messages`.
+         * @param id message ID
+         * @return index, or `count` if not one of `Messages`
+         */
+        static constexpr size_t index_of(Id id)
+        {
+            return std::find(ids.begin(), ids.end(), id) - ids.begin();
+        }
+
+        /**
+         * Identify message.
+         * @param data received message
+         * @return message ID, nothing if unknown
+         */
+        static constexpr std::optional<Id> identify(std::span<const uint8_t> data)
+        {
+            size_t index = find(data);
+            if (index == count) {
+                return std::nullopt;
+            }
+            return ids[index];
+        }
+
+    private:
+        static_assert(((Messages::key_size >= 1 && Messages::key_size <= 2) && ...));
+        static_assert(count < 0xff);
+
+        static constexpr uint8_t none = 0xff;
+
+        struct Entry
+        {
+            uint8_t index{static_cast<uint8_t>(count)};
+            uint8_t second_level{none};
+        };
+
+        static constexpr size_t second_levels = [] {
+            std::array<bool, 256> two_byte{};
+            ((two_byte[Messages::pattern[0]] |= Messages::key_size == 2), ...);
+            return std::count(two_byte.begin(), two_byte.end(), true);
+        }();
+
+        struct Tables
+        {
+            std::array<Entry, 256> first{};
+            std::array<std::array<uint8_t, 256>, second_levels> second{};
+        };
+
+        static constexpr Tables tables = [] {
+            Tables result;
+            for (auto& table: result.second) {
+                table.fill(static_cast<uint8_t>(count));
+            }
+
+            uint8_t index = 0;
+            uint8_t next_level = 0;
+            auto add = [&](const auto& pattern, size_t key_size) {
+                Entry& entry = result.first[pattern[0]];
+                if (key_size == 1) {
+                    entry.index = index;
+                }
+                else {
+                    if (entry.second_level == none) {
+                        entry.second_level = next_level++;
+                    }
+                    result.second[entry.second_level][pattern[1]] = index;
+                }
+                index++;
+            };
+            (add(Messages::pattern, Messages::key_size), ...);
+            return result;
+        }();
+    };
+}
+
+
+#endif // TRAINPP_CODEC_H
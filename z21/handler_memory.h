@@ -0,0 +1,120 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef TRAINPP_HANDLER_MEMORY_H
+#define TRAINPP_HANDLER_MEMORY_H
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <utility>
+
+
+/**
+ * Memory for one outstanding asio handler, so posting or starting an operation does not allocate.
+ *
+ * Meant for operations of which only one is outstanding at a time. If the slot is taken or too small the
+ * allocation falls back to the heap. The slot can be handed out on one thread and released on another.
+ */
+class HandlerMemory
+{
+public:
+    HandlerMemory() = default;
+    HandlerMemory(const HandlerMemory&) = delete;
+    HandlerMemory& operator=(const HandlerMemory&) = delete;
+
+    void* allocate(std::size_t size)
+    {
+        if (size <= sizeof(m_storage) && !m_in_use.exchange(true, std::memory_order_acquire)) {
+            return &m_storage;
+        }
+        return ::operator new(size);
+    }
+
+    void deallocate(void* pointer)
+    {
+        if (pointer == &m_storage) {
+            m_in_use.store(false, std::memory_order_release);
+        }
+        else {
+            ::operator delete(pointer);
+        }
+    }
+
+private:
+    alignas(std::max_align_t) unsigned char m_storage[512];
+    std::atomic<bool> m_in_use{false};
+};
+
+
+/**
+ * Allocator handing out HandlerMemory, associated with handlers through AllocatingHandler.
+ */
+template<typename T>
+class HandlerAllocator
+{
+public:
+    using value_type = T;
+
+    explicit HandlerAllocator(HandlerMemory& memory) : m_memory(memory) {}
+
+    template<typename U>
+    HandlerAllocator(const HandlerAllocator<U>& other) noexcept : m_memory(other.m_memory) {}
+
+    T* allocate(std::size_t n) { return static_cast<T*>(m_memory.allocate(sizeof(T) * n)); }
+    void deallocate(T* pointer, std::size_t) { m_memory.deallocate(pointer); }
+
+    bool operator==(const HandlerAllocator& other) const noexcept { return &m_memory == &other.m_memory; }
+    bool operator!=(const HandlerAllocator& other) const noexcept { return &m_memory != &other.m_memory; }
+
+private:
+    template<typename> friend class HandlerAllocator;
+
+    HandlerMemory& m_memory;
+};
+
+
+/**
+ * Wraps a handler so asio allocates its operation from a HandlerMemory.
+ */
+template<typename Handler>
+class AllocatingHandler
+{
+public:
+    using allocator_type = HandlerAllocator<Handler>;
+
+    AllocatingHandler(HandlerMemory& memory, Handler handler) : m_memory(memory), m_handler(std::move(handler)) {}
+
+    allocator_type get_allocator() const noexcept { return allocator_type(m_memory); }
+
+    template<typename... Args>
+    void operator()(Args&&... args) { m_handler(std::forward<Args>(args)...); }
+
+private:
+    HandlerMemory& m_memory;
+    Handler m_handler;
+};
+
+template<typename Handler>
+inline AllocatingHandler<Handler> make_allocating_handler(HandlerMemory& memory, Handler handler)
+{
+    return AllocatingHandler<Handler>(memory, std::move(handler));
+}
+
+
+#endif // TRAINPP_HANDLER_MEMORY_H
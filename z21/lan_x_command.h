@@ -21,9 +21,9 @@
 
 #include <iostream>
 #include <vector>
-#include <map>
 
 #include "lan_x_command_base.h"
+#include "loco_functions.h"
 
 // ==========================================================================
 //      Client to Z21
@@ -34,7 +34,7 @@ class LanX_GetVersion: public LanX_Command
 {
 public:
     LanX_GetVersion() : LanX_Command(LanXCommands::LAN_X_GET_VERSION) {}
-    virtual std::vector<uint8_t> pack();
+    virtual size_t pack_into(std::span<uint8_t> buffer) const;
 };
 
 // LAN_X_GET_STATUS
@@ -42,7 +42,7 @@ class LanX_GetStatus: public LanX_Command
 {
 public:
     LanX_GetStatus() : LanX_Command(LanXCommands::LAN_X_GET_STATUS) {}
-    virtual std::vector<uint8_t> pack();
+    virtual size_t pack_into(std::span<uint8_t> buffer) const;
 };
 
 // LAN_X_SET_TRACK_POWER_OFF
@@ -50,7 +50,7 @@ class LanX_SetTrackPowerOff: public LanX_Command
 {
 public:
     LanX_SetTrackPowerOff() : LanX_Command(LanXCommands::LAN_X_SET_TRACK_POWER_OFF) {}
-    virtual std::vector<uint8_t> pack();
+    virtual size_t pack_into(std::span<uint8_t> buffer) const;
 };
 
 // LAN_X_SET_TRACK_POWER_ON
@@ -58,7 +58,7 @@ class LanX_SetTrackPowerOn: public LanX_Command
 {
 public:
     LanX_SetTrackPowerOn() : LanX_Command(LanXCommands::LAN_X_SET_TRACK_POWER_ON) {}
-    virtual std::vector<uint8_t> pack();
+    virtual size_t pack_into(std::span<uint8_t> buffer) const;
 };
 
 // LAN_X_DCC_READ_REGISTER
@@ -69,7 +69,7 @@ public:
             LanX_Command(LanXCommands::LAN_X_DCC_READ_REGISTER),
             m_register(reg)
     {}
-    virtual std::vector<uint8_t> pack();
+    virtual size_t pack_into(std::span<uint8_t> buffer) const;
 protected:
     uint8_t m_register;
 };
@@ -82,7 +82,7 @@ public:
             LanX_Command(LanXCommands::LAN_X_CV_READ),
             m_cv(cv)
     {}
-    virtual std::vector<uint8_t> pack();
+    virtual size_t pack_into(std::span<uint8_t> buffer) const;
 protected:
     uint16_t m_cv;
 };
@@ -95,7 +95,7 @@ public:
             LanX_Command(LanXCommands::LAN_X_DCC_WRITE_REGISTER),
             m_register(reg), m_value(value)
     {}
-    virtual std::vector<uint8_t> pack();
+    virtual size_t pack_into(std::span<uint8_t> buffer) const;
 protected:
     uint8_t m_register;
     uint8_t m_value;
@@ -109,7 +109,7 @@ public:
             LanX_Command(LanXCommands::LAN_X_CV_WRITE),
             m_cv(cv), m_value(value)
     {}
-    virtual std::vector<uint8_t> pack();
+    virtual size_t pack_into(std::span<uint8_t> buffer) const;
 protected:
     uint16_t m_cv;
     uint8_t m_value;
@@ -123,7 +123,7 @@ public:
             LanX_Command(LanXCommands::LAN_X_MM_WRITE_BYTE),
             m_register(reg), m_value(value)
     {}
-    virtual std::vector<uint8_t> pack();
+    virtual size_t pack_into(std::span<uint8_t> buffer) const;
 protected:
     uint8_t m_register;
     uint8_t m_value;
@@ -137,7 +137,7 @@ public:
             LanX_Command(LanXCommands::LAN_X_GET_TURNOUT_INFO),
             m_address(address)
     {}
-    virtual std::vector<uint8_t> pack();
+    virtual size_t pack_into(std::span<uint8_t> buffer) const;
 protected:
     uint16_t m_address;
 };
@@ -150,7 +150,7 @@ public:
             LanX_Command(LanXCommands::LAN_X_GET_EXT_ACCESSORY_INFO),
             m_address(address)
     {}
-    virtual std::vector<uint8_t> pack();
+    virtual size_t pack_into(std::span<uint8_t> buffer) const;
 protected:
     uint16_t m_address;
 };
@@ -163,7 +163,7 @@ public:
             LanX_Command(LanXCommands::LAN_X_SET_TURNOUT),
             m_address(address), m_value(value)
     {}
-    virtual std::vector<uint8_t> pack();
+    virtual size_t pack_into(std::span<uint8_t> buffer) const;
 protected:
     uint16_t m_address;
     uint8_t m_value;
@@ -177,7 +177,7 @@ public:
             LanX_Command(LanXCommands::LAN_X_SET_EXT_ACCESSORY),
             m_address(address), m_state(state)
     {}
-    virtual std::vector<uint8_t> pack();
+    virtual size_t pack_into(std::span<uint8_t> buffer) const;
 protected:
     uint16_t m_address;
     uint8_t m_state;
@@ -188,7 +188,7 @@ class LanX_SetStop: public LanX_Command
 {
 public:
     LanX_SetStop() : LanX_Command(LanXCommands::LAN_X_SET_STOP) {}
-    virtual std::vector<uint8_t> pack();
+    virtual size_t pack_into(std::span<uint8_t> buffer) const;
 };
 
 // LAN_X_GET_LOCO_INFO
@@ -199,7 +199,7 @@ public:
             LanX_Command(LanXCommands::LAN_X_GET_LOCO_INFO),
             m_address(address)
     {}
-    virtual std::vector<uint8_t> pack();
+    virtual size_t pack_into(std::span<uint8_t> buffer) const;
 protected:
     uint16_t m_address;
 };
@@ -212,7 +212,7 @@ public:
             LanX_Command(LanXCommands::LAN_X_SET_LOCO_DRIVE),
             m_address(address), m_speed(speed), m_forward(forward)
     {}
-    virtual std::vector<uint8_t> pack();
+    virtual size_t pack_into(std::span<uint8_t> buffer) const;
 protected:
     uint16_t m_address;
     uint8_t m_speed;
@@ -227,7 +227,7 @@ public:
             LanX_Command(LanXCommands::LAN_X_SET_LOCO_FUNCTION),
             m_address(address), m_function(function)
     {}
-    virtual std::vector<uint8_t> pack();
+    virtual size_t pack_into(std::span<uint8_t> buffer) const;
 protected:
     uint16_t m_address;
     uint8_t m_function;
@@ -254,7 +254,7 @@ public:
             LanX_Command(LanXCommands::LAN_X_SET_LOCO_FUNCTION_GROUP),
             m_address(address), m_group(group), m_functions(functions)
     {}
-    virtual std::vector<uint8_t> pack();
+    virtual size_t pack_into(std::span<uint8_t> buffer) const;
 protected:
     uint16_t m_address;
     uint16_t m_group;
@@ -269,7 +269,7 @@ public:
             LanX_Command(LanXCommands::LAN_X_SET_LOCO_BINARY_STATE),
             m_address(address), m_on(on), m_binary_address(binary_address)
     {}
-    virtual std::vector<uint8_t> pack();
+    virtual size_t pack_into(std::span<uint8_t> buffer) const;
 protected:
     uint16_t m_address;
     bool m_on;
@@ -284,7 +284,7 @@ public:
             LanX_Command(LanXCommands::LAN_X_CV_POM_WRITE_BYTE),
             m_address(address), m_cv(cv), m_value(value)
     {}
-    virtual std::vector<uint8_t> pack();
+    virtual size_t pack_into(std::span<uint8_t> buffer) const;
 protected:
     uint16_t m_address;
     uint16_t m_cv;
@@ -299,7 +299,7 @@ public:
             LanX_Command(LanXCommands::LAN_X_CV_POM_WRITE_BIT),
             m_address(address), m_cv(cv), m_bit_position(bit_position), m_value(value)
     {}
-    virtual std::vector<uint8_t> pack();
+    virtual size_t pack_into(std::span<uint8_t> buffer) const;
 protected:
     uint16_t m_address;
     uint16_t m_cv;
@@ -315,7 +315,7 @@ public:
             LanX_Command(LanXCommands::LAN_X_CV_POM_READ_BYTE),
             m_address(address), m_cv(cv)
     {}
-    virtual std::vector<uint8_t> pack();
+    virtual size_t pack_into(std::span<uint8_t> buffer) const;
 protected:
     uint16_t m_address;
     uint16_t m_cv;
@@ -335,7 +335,7 @@ public:
             LanX_Command(LanXCommands::LAN_X_CV_POM_ACCESSORY_WRITE_BYTE),
             m_address(address), m_selection(selction), m_output(output), m_cv(cv), m_value(value)
     {}
-    virtual std::vector<uint8_t> pack();
+    virtual size_t pack_into(std::span<uint8_t> buffer) const;
 protected:
     uint16_t m_address;
     PomAccessorySelection m_selection;
@@ -352,7 +352,7 @@ public:
             LanX_Command(LanXCommands::LAN_X_CV_POM_ACCESSORY_WRITE_BIT),
             m_address(address), m_selection(selction), m_output(output), m_cv(cv), m_bit_position(bit_position), m_value(value)
     {}
-    virtual std::vector<uint8_t> pack();
+    virtual size_t pack_into(std::span<uint8_t> buffer) const;
 protected:
     uint16_t m_address;
     PomAccessorySelection m_selection;
@@ -370,7 +370,7 @@ public:
             LanX_Command(LanXCommands::LAN_X_CV_POM_ACCESSORY_READ_BYTE),
             m_address(address), m_selection(selction), m_output(output), m_cv(cv)
     {}
-    virtual std::vector<uint8_t> pack();
+    virtual size_t pack_into(std::span<uint8_t> buffer) const;
 protected:
     uint16_t m_address;
     PomAccessorySelection m_selection;
@@ -383,7 +383,7 @@ class LanX_GetFirmwareVersion: public LanX_Command
 {
 public:
     LanX_GetFirmwareVersion() : LanX_Command(LanXCommands::LAN_X_GET_FIRMWARE_VERSION) {}
-    virtual std::vector<uint8_t> pack();
+    virtual size_t pack_into(std::span<uint8_t> buffer) const;
 };
 
 
@@ -403,7 +403,7 @@ public:
     };
 
     LanX_TurnoutInfo() : LanX_Command(LanXCommands::LAN_X_TURNOUT_INFO) {}
-    virtual void unpack(std::vector<uint8_t>& data);
+    virtual void unpack(std::span<const uint8_t> data);
 
     uint16_t address{0};
     TurnoutStatus status;
@@ -414,7 +414,7 @@ class LanX_ExtAccessoryInfo : public LanX_Command
 {
 public:
     LanX_ExtAccessoryInfo() : LanX_Command(LanXCommands::LAN_X_EXT_ACCESSORY_INFO) {}
-    virtual void unpack(std::vector<uint8_t>& data);
+    virtual void unpack(std::span<const uint8_t> data);
 
     uint16_t address{0};
     uint8_t state{0};
@@ -479,7 +479,7 @@ class LanX_CvResult : public LanX_Command
 {
 public:
     LanX_CvResult() : LanX_Command(LanXCommands::LAN_X_CV_RESULT) {}
-    virtual void unpack(std::vector<uint8_t>& data);
+    virtual void unpack(std::span<const uint8_t> data);
 
     uint16_t cv{0};
     uint8_t value{0};
@@ -501,12 +501,9 @@ public:
         DCC_128 = 4,
     };
 
-    LanX_LocoInfo() : LanX_Command(LanXCommands::LAN_X_LOCO_INFO)
-    {
-        functions.resize(32);
-    }
+    LanX_LocoInfo() : LanX_Command(LanXCommands::LAN_X_LOCO_INFO) {}
 
-    virtual void unpack(std::vector<uint8_t>& data);
+    virtual void unpack(std::span<const uint8_t> data);
 
     uint16_t address{0};
     bool busy{false};
@@ -516,14 +513,14 @@ public:
 
     bool double_traction{false};
     bool smart_search{false};
-    std::vector<bool> functions;
+    LocoFunctions functions;
 };
 
 class LanX_GetFirmwareVersionResponse : public LanX_Command
 {
 public:
     LanX_GetFirmwareVersionResponse() : LanX_Command(LanXCommands::LAN_X_GET_FIRMWARE_VERSION_RESPONSE) {}
-    virtual void unpack(std::vector<uint8_t>& data);
+    virtual void unpack(std::span<const uint8_t> data);
 
     std::string fw_version;
 };
@@ -16,19 +16,19 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#include <array>
 #include <iostream>
 #include <sstream>
 #include <iterator>
-#include <numeric>
 
 #include <boost/log/trivial.hpp>
 
 #include "lan_x_command.h"
 
 
-std::string decode_bcd_version(std::vector<uint8_t> data, bool little_endian)
+std::string decode_bcd_version(std::span<const uint8_t> data, bool little_endian)
 {
-    std::vector<std::string> fragments;
+    std::string result;
 
     size_t size = data.size();
     for(size_t i = 0; i < size; i++) {
@@ -38,23 +38,18 @@ std::string decode_bcd_version(std::vector<uint8_t> data, bool little_endian)
         uint8_t value = 0;
         value += v & 0x0f;
         value += (v >> 4) * 10;
-        fragments.push_back(std::to_string(value));
+        if (!result.empty()) {
+            result += '.';
+        }
+        result += std::to_string(value);
     }
-
-    std::string result = std::accumulate(fragments.begin() + 1, fragments.end(), fragments[0],
-                                         [](const std::string& a, const std::string& b) { return a + '.' + b; });
     return result;
 }
 
 
-void LanX_Command::append_checksum(std::vector<uint8_t>& data)
+std::vector<uint8_t> LanX_Command::pack() const
 {
-    uint8_t result = 0;
-    for (auto c = data.begin(); c < data.end(); c++) {
-        result ^= *c;
-    }
-
-    data.insert(data.end(), result);
+    std::array<uint8_t, lan_x_max_size> buffer;
+    size_t size = pack_into(buffer);
+    return std::vector<uint8_t>(buffer.begin(), buffer.begin() + size);
 }
-
-
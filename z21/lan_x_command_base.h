@@ -19,7 +19,9 @@
 #ifndef TRAINPP_Z21_LAN_X_PACKET_H
 #define TRAINPP_Z21_LAN_X_PACKET_H
 
-#include <map>
+#include <span>
+#include <string>
+#include <vector>
 
 #include <boost/algorithm/string.hpp>
 #include <boost/range/adaptor/transformed.hpp>
@@ -77,7 +79,10 @@ enum class LanXCommands
     LAN_X_GET_FIRMWARE_VERSION_RESPONSE
 };
 
-std::string decode_bcd_version(std::vector<uint8_t> data, bool little_endian);
+std::string decode_bcd_version(std::span<const uint8_t> data, bool little_endian);
+
+// Max size of any packed LanX command sent from client to Z21 (including checksum).
+constexpr size_t lan_x_max_size = 16;
 
 
 /**
@@ -87,18 +92,24 @@ class LanX_Command
 {
 public:
     LanX_Command(LanXCommands id) : id(id) {}
+    virtual ~LanX_Command() = default;
 
-    virtual std::vector<uint8_t> pack() {
-        std::vector<uint8_t> result;
-        return result;
-    }
+    /**
+     * Pack command into a new vector.
+     * @return packed command, empty if command is invalid
+     */
+    std::vector<uint8_t> pack() const;
 
-    virtual void unpack(std::vector<uint8_t>& data) {}
+    /**
+     * Pack command into caller provided buffer, without allocating.
+     * @param buffer buffer to pack command into
+     * @return number of bytes written, 0 if command is invalid or does not fit in buffer
+     */
+    virtual size_t pack_into(std::span<uint8_t> buffer) const { return 0; }
 
-    const LanXCommands id;
+    virtual void unpack(std::span<const uint8_t> data) {}
 
-protected:
-    void append_checksum(std::vector<uint8_t>& data);
+    const LanXCommands id;
 };
 
 #endif // TRAINPP_Z21_LAN_X_PACKET_H
@@ -0,0 +1,62 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <algorithm>
+
+#include "loco_frame_cache.h"
+
+
+LocoFrameCache::LocoFrameCache() :
+    m_frames((LocoSlotTable::max_address + 1) * slots)
+{
+}
+
+uint8_t LocoFrameCache::function_group_slot(LanX_SetLocoFunctionGroup::FunctionGroup group)
+{
+    auto found = std::find(function_groups.begin(), function_groups.end(), group);
+    return drive_slot + 1 + (found - function_groups.begin());
+}
+
+std::span<const uint8_t> LocoFrameCache::frame(uint16_t address, uint8_t slot, uint8_t value)
+{
+    Frame& frame = m_frames[address * slots + slot];
+    if (frame[0] == 0) {
+        build(frame, address, slot, value);
+    }
+    else {
+        frame[checksum_index] ^= frame[value_index] ^ value;
+        frame[value_index] = value;
+    }
+
+    return frame;
+}
+
+void LocoFrameCache::build(Frame& frame, uint16_t address, uint8_t slot, uint8_t value)
+{
+    Z21_Frame packed;
+    if (slot == drive_slot) {
+        LanX_SetLocoDrive lanx_command(address, value & 0x7f, value & 0x80);
+        packed = LanX(&lanx_command).frame();
+    }
+    else {
+        LanX_SetLocoFunctionGroup lanx_command(address, function_groups[slot - 1], value);
+        packed = LanX(&lanx_command).frame();
+    }
+
+    std::copy_n(packed.data.begin(), frame.size(), frame.begin());
+}
@@ -0,0 +1,87 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef TRAINPP_LOCO_FRAME_CACHE_H
+#define TRAINPP_LOCO_FRAME_CACHE_H
+
+#include <array>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "z21_dataset.h"
+#include "lan_x_command.h"
+#include "loco_slot_table.h"
+
+
+/**
+ * Prebuilt LAN_X_SET_LOCO_DRIVE and LAN_X_SET_LOCO_FUNCTION_GROUP DataSets per loco address and slot, for
+ * the high rate drive path.
+ *
+ * A frame is packed the first time it is used. After that only the value byte is patched and the XOR
+ * checksum adjusted for it, instead of packing the whole command again. Used from one thread only.
+ */
+class LocoFrameCache
+{
+public:
+    // Slots per loco: drive, then one per function group.
+    static constexpr uint8_t drive_slot = 0;
+    static constexpr std::array<LanX_SetLocoFunctionGroup::FunctionGroup, 10> function_groups = {
+            LanX_SetLocoFunctionGroup::GROUP_1, LanX_SetLocoFunctionGroup::GROUP_2, LanX_SetLocoFunctionGroup::GROUP_3,
+            LanX_SetLocoFunctionGroup::GROUP_4, LanX_SetLocoFunctionGroup::GROUP_5, LanX_SetLocoFunctionGroup::GROUP_6,
+            LanX_SetLocoFunctionGroup::GROUP_7, LanX_SetLocoFunctionGroup::GROUP_8, LanX_SetLocoFunctionGroup::GROUP_9,
+            LanX_SetLocoFunctionGroup::GROUP_10
+    };
+    static constexpr size_t slots = 1 + function_groups.size();
+    static_assert(slots <= LocoSlotTable::slots_per_address);
+
+    // DataSet header, X-Bus header, DB0, address (2 bytes), value and checksum.
+    static constexpr size_t frame_size = header_size + 6;
+
+    LocoFrameCache();
+
+    /**
+     * Get slot of function group.
+     * @param group function group
+     * @return slot, or `slots` if the group is not cached
+     */
+    static uint8_t function_group_slot(LanX_SetLocoFunctionGroup::FunctionGroup group);
+
+    /**
+     * Get the packed DataSet for a loco command.
+     * @param address loco address, up to LocoSlotTable::max_address
+     * @param slot drive_slot or function group slot
+     * @param value speed byte (speed and direction) or function bits
+     * @return packed DataSet, valid until the next call for the same address and slot
+     */
+    std::span<const uint8_t> frame(uint16_t address, uint8_t slot, uint8_t value);
+
+private:
+    using Frame = std::array<uint8_t, frame_size>;
+
+    static constexpr size_t value_index = frame_size - 2;
+    static constexpr size_t checksum_index = frame_size - 1;
+
+    void build(Frame& frame, uint16_t address, uint8_t slot, uint8_t value);
+
+    // Zero filled until built, a built frame starts with its non-zero size.
+    std::vector<Frame> m_frames;
+};
+
+
+#endif // TRAINPP_LOCO_FRAME_CACHE_H
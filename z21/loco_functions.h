@@ -0,0 +1,90 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef TRAINPP_LOCO_FUNCTIONS_H
+#define TRAINPP_LOCO_FUNCTIONS_H
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+
+/**
+ * States of loco functions F0 to F68 as a bit mask, F0 in bit 0. F0 to F31 are the low 32 bits of `low`,
+ * the states older firmware reports.
+ *
+ * Testing a function is a shift and a mask, and the functions that changed between two states are their XOR.
+ */
+struct LocoFunctions
+{
+    static constexpr size_t count = 69;
+
+    uint64_t low{0};    // F0 - F63
+    uint8_t high{0};    // F64 - F68 in bits 0 - 4
+
+    /**
+     * State of function `index`, false for indexes above F68.
+     */
+    constexpr bool operator[](size_t index) const
+    {
+        return index < 64 ? (low >> index) & 0x01 : index < count && (high >> (index - 64)) & 0x01;
+    }
+
+    /**
+     * F0 to F31, as in LAN_X_LOCO_INFO DB4 to DB8.
+     */
+    constexpr uint32_t f0_f31() const { return static_cast<uint32_t>(low); }
+
+    /**
+     * Functions that differ between this and other.
+     */
+    constexpr LocoFunctions changed(const LocoFunctions& other) const { return *this ^ other; }
+
+    constexpr bool any() const { return low | high; }
+
+    constexpr size_t size() const { return std::popcount(low) + std::popcount(high); }
+
+    /**
+     * Call fn(index) for each function set, in index order.
+     */
+    template<typename Fn>
+    constexpr void for_each(Fn fn) const
+    {
+        for (uint64_t bits = low; bits; bits &= bits - 1) {
+            fn(static_cast<size_t>(std::countr_zero(bits)));
+        }
+        for (unsigned bits = high; bits; bits &= bits - 1) {
+            fn(static_cast<size_t>(64 + std::countr_zero(bits)));
+        }
+    }
+
+    constexpr LocoFunctions operator^(const LocoFunctions& other) const
+    {
+        return {low ^ other.low, static_cast<uint8_t>(high ^ other.high)};
+    }
+
+    constexpr LocoFunctions operator&(const LocoFunctions& other) const
+    {
+        return {low & other.low, static_cast<uint8_t>(high & other.high)};
+    }
+
+    constexpr bool operator==(const LocoFunctions& other) const = default;
+};
+
+
+#endif // TRAINPP_LOCO_FUNCTIONS_H
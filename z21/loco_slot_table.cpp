@@ -0,0 +1,83 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "loco_slot_table.h"
+
+
+LocoSlotTable::LocoSlotTable() :
+    m_values(slots),
+    m_stamps(slots),
+    m_pending_since(slots),
+    m_pending((slots + 63) / 64),
+    m_summary((m_pending.size() + 63) / 64)
+{
+}
+
+bool LocoSlotTable::store(uint16_t address, uint8_t slot, uint8_t value)
+{
+    size_t index = address * slots_per_address + slot;
+    size_t word = index / 64;
+    uint64_t bit = uint64_t{1} << (index % 64);
+
+    // The value must be visible before the pending bit, the consumer reads it after taking the bit. A slot
+    // taken between checking and setting its bit keeps the previous time, at worst a send tick early.
+    m_values[index].store(value, std::memory_order_relaxed);
+    m_stamps[index].store(m_sequence.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    if (!(m_pending[word].load(std::memory_order_relaxed) & bit)) {
+        m_pending_since[index].store(clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+    }
+    bool replaced = m_pending[word].fetch_or(bit, std::memory_order_release) & bit;
+    m_summary[word / 64].fetch_or(uint64_t{1} << (word % 64), std::memory_order_release);
+    return !replaced;
+}
+
+size_t LocoSlotTable::discard(uint32_t sequence)
+{
+    size_t discarded = 0;
+    for (size_t s = 0; s < m_summary.size(); s++) {
+        uint64_t summary = m_summary[s].exchange(0, std::memory_order_acquire);
+        while (summary) {
+            size_t word = s * 64 + std::countr_zero(summary);
+            summary &= summary - 1;
+
+            uint64_t pending = m_pending[word].exchange(0, std::memory_order_acquire);
+            uint64_t keep = 0;
+            while (pending) {
+                uint64_t bit = pending & -pending;
+                size_t index = word * 64 + std::countr_zero(pending);
+                pending &= pending - 1;
+
+                // Compared as a difference, so it holds across wrapping. A store racing with this one sets its
+                // bit again, and stays pending either way.
+                uint32_t stamp = m_stamps[index].load(std::memory_order_relaxed);
+                if (static_cast<int32_t>(stamp - sequence) > 0) {
+                    keep |= bit;
+                }
+                else {
+                    discarded++;
+                }
+            }
+
+            if (keep) {
+                m_pending[word].fetch_or(keep, std::memory_order_release);
+                m_summary[s].fetch_or(uint64_t{1} << (word % 64), std::memory_order_release);
+            }
+        }
+    }
+    return discarded;
+}
@@ -0,0 +1,125 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef TRAINPP_LOCO_SLOT_TABLE_H
+#define TRAINPP_LOCO_SLOT_TABLE_H
+
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+
+/**
+ * "Latest value wins" table of pending loco commands, one byte per slot and a fixed number of slots per
+ * loco address (e.g. one for drive and one per function group).
+ *
+ * Any thread can store a value, overwriting a value for the same slot that has not been taken yet. One
+ * consumer thread takes all pending values on each send tick. Pending slots are tracked in a two level
+ * bitmap, so taking only visits words with something pending and never takes a lock. Every store is stamped
+ * with the next sequence number, so the consumer can drop what was stored before a given point, and a slot
+ * keeps the time it became pending, so the consumer can tell how long it waited.
+ */
+class LocoSlotTable
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    static constexpr uint16_t max_address = 10239;
+    static constexpr size_t slots_per_address = 16;
+
+    LocoSlotTable();
+
+    /**
+     * Store value in slot (any thread).
+     * @param address loco address, 0 to max_address
+     * @param slot slot of address, below slots_per_address
+     * @param value value to store
+     * @return false if the value replaced a pending one in the same slot
+     */
+    bool store(uint16_t address, uint8_t slot, uint8_t value);
+
+    /**
+     * Time a slot became pending, kept while later stores replace its value (consumer thread only, for a
+     * slot being taken).
+     * @param address loco address, 0 to max_address
+     * @param slot slot of address, below slots_per_address
+     */
+    clock::time_point pending_since(uint16_t address, uint8_t slot) const
+    {
+        size_t index = address * slots_per_address + slot;
+        return clock::time_point(clock::duration(m_pending_since[index].load(std::memory_order_relaxed)));
+    }
+
+    /**
+     * Sequence number of the latest store (any thread).
+     */
+    uint32_t sequence() const { return m_sequence.load(std::memory_order_acquire); }
+
+    /**
+     * Drop pending values stored up to sequence, keeping later ones pending (consumer thread only).
+     * @param sequence sequence() at the point to drop up to
+     * @return number of values dropped
+     */
+    size_t discard(uint32_t sequence);
+
+    /**
+     * Take all pending values, in address order (consumer thread only).
+     * @param fn called as fn(address, slot, value) for each pending value. Returning false stops taking,
+     *           the value it was called for and all not yet visited stay pending.
+     */
+    template<typename Fn>
+    void take(Fn fn)
+    {
+        for (size_t s = 0; s < m_summary.size(); s++) {
+            uint64_t summary = m_summary[s].exchange(0, std::memory_order_acquire);
+            while (summary) {
+                size_t word = s * 64 + std::countr_zero(summary);
+                summary &= summary - 1;
+
+                uint64_t pending = m_pending[word].exchange(0, std::memory_order_acquire);
+                while (pending) {
+                    uint64_t bit = pending & -pending;
+                    size_t index = word * 64 + std::countr_zero(pending);
+                    pending &= pending - 1;
+
+                    uint8_t value = m_values[index].load(std::memory_order_relaxed);
+                    if (!fn(static_cast<uint16_t>(index / slots_per_address), static_cast<uint8_t>(index % slots_per_address), value)) {
+                        m_pending[word].fetch_or(pending | bit, std::memory_order_release);
+                        m_summary[s].fetch_or(summary | (uint64_t{1} << (word % 64)), std::memory_order_release);
+                        return;
+                    }
+                }
+            }
+        }
+    }
+
+private:
+    static constexpr size_t slots = (max_address + 1) * slots_per_address;
+
+    std::vector<std::atomic<uint8_t>> m_values;
+    std::vector<std::atomic<uint32_t>> m_stamps;       // sequence number of the latest store
+    std::vector<std::atomic<clock::rep>> m_pending_since;
+    std::atomic<uint32_t> m_sequence{0};
+    std::vector<std::atomic<uint64_t>> m_pending;     // one bit per slot
+    std::vector<std::atomic<uint64_t>> m_summary;     // one bit per word in m_pending
+};
+
+
+#endif // TRAINPP_LOCO_SLOT_TABLE_H
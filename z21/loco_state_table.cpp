@@ -0,0 +1,99 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "loco_state_table.h"
+
+
+LocoStateTable::LocoStateTable() :
+    m_sequence(addresses),
+    m_speed(addresses),
+    m_flags(addresses),
+    m_speed_steps(addresses),
+    m_functions(addresses),
+    m_functions_high(addresses),
+    m_updated(addresses)
+{
+}
+
+LocoFunctions LocoStateTable::update(const message::LocoInfo& info, ReceiveTimestamp timestamp)
+{
+    if (info.address > max_address) {
+        return {};
+    }
+    size_t a = info.address;
+
+    // Only this thread writes, so the previous functions can be read without the seqlock.
+    LocoFunctions previous{m_functions[a].load(std::memory_order_relaxed), m_functions_high[a].load(std::memory_order_relaxed)};
+
+    uint8_t flags = KNOWN;
+    flags |= info.direction_forward ? FORWARD : 0;
+    flags |= info.busy ? BUSY : 0;
+
+    // Odd while writing. The fence keeps the field stores from moving ahead of it.
+    uint32_t sequence = m_sequence[a].load(std::memory_order_relaxed);
+    m_sequence[a].store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    m_speed[a].store(info.speed, std::memory_order_relaxed);
+    m_speed_steps[a].store(info.speed_steps, std::memory_order_relaxed);
+    m_functions[a].store(info.functions.low, std::memory_order_relaxed);
+    m_functions_high[a].store(info.functions.high, std::memory_order_relaxed);
+    m_updated[a].store(std::chrono::duration_cast<std::chrono::nanoseconds>(timestamp.time_since_epoch()).count(),
+                       std::memory_order_relaxed);
+    m_flags[a].store(flags, std::memory_order_release);
+
+    m_sequence[a].store(sequence + 2, std::memory_order_release);
+    return previous.changed(info.functions);
+}
+
+std::optional<LocoState> LocoStateTable::get(uint16_t address) const
+{
+    if (address > max_address) {
+        return std::nullopt;
+    }
+
+    LocoState state;
+    uint8_t flags;
+    while (true) {
+        uint32_t sequence = m_sequence[address].load(std::memory_order_acquire);
+        if (sequence & 1) {
+            continue;
+        }
+
+        flags = m_flags[address].load(std::memory_order_relaxed);
+        state.speed = m_speed[address].load(std::memory_order_relaxed);
+        state.speed_steps = static_cast<LanX_LocoInfo::SpeedSteps>(m_speed_steps[address].load(std::memory_order_relaxed));
+        state.functions.low = m_functions[address].load(std::memory_order_relaxed);
+        state.functions.high = m_functions_high[address].load(std::memory_order_relaxed);
+        state.updated = ReceiveTimestamp(std::chrono::duration_cast<ReceiveTimestamp::duration>(
+                std::chrono::nanoseconds(m_updated[address].load(std::memory_order_relaxed))));
+
+        // Keeps the field loads from moving past the second sequence load.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (m_sequence[address].load(std::memory_order_relaxed) == sequence) {
+            break;
+        }
+    }
+
+    if (!(flags & KNOWN)) {
+        return std::nullopt;
+    }
+    state.direction_forward = flags & FORWARD;
+    state.busy = flags & BUSY;
+    return state;
+}
@@ -0,0 +1,106 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef TRAINPP_LOCO_STATE_TABLE_H
+#define TRAINPP_LOCO_STATE_TABLE_H
+
+#include <atomic>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "z21_message.h"
+#include "receive_control.h"
+
+
+/**
+ * Last known state of a loco, as broadcast in LAN_X_LOCO_INFO.
+ */
+struct LocoState
+{
+    uint8_t speed{0};
+    bool direction_forward{false};
+    LanX_LocoInfo::SpeedSteps speed_steps{LanX_LocoInfo::UNKNOWN};
+    bool busy{false};
+
+    LocoFunctions functions;
+
+    // Kernel receive time of the LAN_X_LOCO_INFO it was last updated from.
+    ReceiveTimestamp updated{};
+};
+
+
+/**
+ * State of every loco, indexed directly by address and stored as one array per field, so a scan over many
+ * locos only touches the fields it reads.
+ *
+ * One thread updates, any number of threads read without locks. Each address has a sequence number that is
+ * odd while it is being written (a seqlock), readers retry in the rare case they overlapped a write, so they
+ * always get all fields from the same LAN_X_LOCO_INFO and never hold up the writer.
+ */
+class LocoStateTable
+{
+public:
+    static constexpr uint16_t max_address = 10239;
+
+    LocoStateTable();
+
+    /**
+     * Update the state of a loco (writer thread only).
+     * @param info decoded LAN_X_LOCO_INFO, ignored if its address is above max_address
+     * @param timestamp receive time of info
+     * @return functions that changed, all functions set in info if the loco was not known before
+     */
+    LocoFunctions update(const message::LocoInfo& info, ReceiveTimestamp timestamp);
+
+    /**
+     * Get the state of a loco (any thread).
+     * @param address loco address
+     * @return state, empty if no LAN_X_LOCO_INFO has been received for address
+     */
+    std::optional<LocoState> get(uint16_t address) const;
+
+    /**
+     * Whether any LAN_X_LOCO_INFO has been received for address (any thread).
+     */
+    bool known(uint16_t address) const
+    {
+        return address <= max_address && m_flags[address].load(std::memory_order_acquire) & KNOWN;
+    }
+
+private:
+    static constexpr size_t addresses = max_address + 1;
+
+    enum Flags : uint8_t
+    {
+        KNOWN = 0x01,
+        FORWARD = 0x02,
+        BUSY = 0x04,
+    };
+
+    std::vector<std::atomic<uint32_t>> m_sequence;
+    std::vector<std::atomic<uint8_t>> m_speed;
+    std::vector<std::atomic<uint8_t>> m_flags;
+    std::vector<std::atomic<uint8_t>> m_speed_steps;
+    std::vector<std::atomic<uint64_t>> m_functions;
+    std::vector<std::atomic<uint8_t>> m_functions_high;
+    std::vector<std::atomic<int64_t>> m_updated;       // nanoseconds since the epoch
+};
+
+
+#endif // TRAINPP_LOCO_STATE_TABLE_H
@@ -0,0 +1,127 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef TRAINPP_MPSC_QUEUE_H
+#define TRAINPP_MPSC_QUEUE_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+
+/**
+ * Bounded lock-free queue for many producer threads and one consumer thread.
+ *
+ * Every cell carries a sequence number telling whether it is free for the producer at a given position or
+ * holds a value for the consumer (D. Vyukov's bounded queue). Producers only contend on a compare-and-swap
+ * of the enqueue position, never on a lock, and nothing is allocated after construction.
+ */
+template<typename T, size_t Capacity>
+class MpscQueue
+{
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "MpscQueue capacity must be a power of two");
+
+public:
+    MpscQueue()
+    {
+        for (size_t i = 0; i < Capacity; i++) {
+            m_cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    /**
+     * Push value (any thread).
+     * @param value value to push
+     * @return false if queue is full
+     */
+    bool push(const T& value)
+    {
+        Cell* cell;
+        size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &m_cells[pos & (Capacity - 1)];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            }
+            else if (diff < 0) {
+                return false;
+            }
+            else {
+                pos = m_enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->value = value;
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Pop oldest value (consumer thread only).
+     * @param value popped value
+     * @return false if queue is empty
+     */
+    bool pop(T& value)
+    {
+        size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+        Cell& cell = m_cells[pos & (Capacity - 1)];
+        size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        if (static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1) < 0) {
+            return false;
+        }
+
+        value = cell.value;
+        cell.sequence.store(pos + Capacity, std::memory_order_release);
+        m_dequeue_pos.store(pos + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    /**
+     * Number of values in queue (any thread). Only approximate while other threads push or pop.
+     */
+    size_t size() const
+    {
+        size_t dequeue_pos = m_dequeue_pos.load(std::memory_order_relaxed);
+        size_t enqueue_pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        return enqueue_pos > dequeue_pos ? enqueue_pos - dequeue_pos : 0;
+    }
+
+    static constexpr size_t capacity() { return Capacity; }
+
+private:
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    alignas(64) std::array<Cell, Capacity> m_cells;
+    alignas(64) std::atomic<size_t> m_enqueue_pos{0};
+    alignas(64) std::atomic<size_t> m_dequeue_pos{0};
+};
+
+
+#endif // TRAINPP_MPSC_QUEUE_H
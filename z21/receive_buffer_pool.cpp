@@ -0,0 +1,49 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "receive_buffer_pool.h"
+
+
+ReceiveBufferPool::ReceiveBufferPool() :
+    m_slots(std::make_unique<Slot[]>(pool_size))
+{
+    for (uint32_t i = 0; i < pool_size; i++) {
+        m_free.push(i);
+    }
+}
+
+ReceiveBufferPool::Buffer ReceiveBufferPool::acquire()
+{
+    uint32_t index;
+    if (!m_free.pop(index)) {
+        return Buffer();
+    }
+
+    Slot& slot = m_slots[index];
+    slot.references.store(1, std::memory_order_relaxed);
+    slot.offset = 0;
+    slot.size = 0;
+    slot.timestamp = {};
+    return Buffer(this, &slot);
+}
+
+void ReceiveBufferPool::release(Slot* slot)
+{
+    // Cannot fail, the free list has room for every buffer.
+    m_free.push(static_cast<uint32_t>(slot - m_slots.get()));
+}
@@ -0,0 +1,184 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef TRAINPP_RECEIVE_BUFFER_POOL_H
+#define TRAINPP_RECEIVE_BUFFER_POOL_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <span>
+
+#include "mpsc_queue.h"
+#include "receive_control.h"
+#include "z21_datagram_batcher.h"
+
+
+/**
+ * Fixed pool of reference counted buffers for received datagrams, each large enough for a full datagram.
+ *
+ * The listener thread acquires buffers to receive into and hands them downstream (decoder, capture,
+ * subscribers) by copying the Buffer handle, not the data. A buffer goes back to the pool when the last
+ * handle to it is released, from any thread. Nothing is allocated after construction. Handles must not
+ * outlive the pool.
+ *
+ * Every buffer has headroom before the datagram for what a receive call passes along with it, such as
+ * control messages or the header of an io_uring recvmsg completion, and carries the time the datagram was
+ * received.
+ */
+class ReceiveBufferPool
+{
+public:
+    static constexpr size_t buffer_size = Z21_DatagramBatcher::max_datagram_size;
+    static constexpr size_t headroom = 128;
+    static constexpr size_t pool_size = 256;
+    static_assert(receive_control_size <= headroom);
+
+private:
+    struct Slot
+    {
+        std::atomic<uint32_t> references{0};
+        size_t offset{0};
+        size_t size{0};
+        ReceiveTimestamp timestamp{};
+        std::array<uint8_t, headroom + buffer_size> data;
+    };
+
+public:
+
+    /**
+     * Shared handle to a pooled buffer, empty if no buffer was available.
+     */
+    class Buffer
+    {
+    public:
+        Buffer() = default;
+        Buffer(const Buffer& other) : m_pool(other.m_pool), m_slot(other.m_slot) { retain(); }
+        Buffer(Buffer&& other) noexcept : m_pool(other.m_pool), m_slot(other.m_slot) { other.m_slot = nullptr; }
+        ~Buffer() { reset(); }
+
+        Buffer& operator=(Buffer other) noexcept
+        {
+            std::swap(m_pool, other.m_pool);
+            std::swap(m_slot, other.m_slot);
+            return *this;
+        }
+
+        explicit operator bool() const { return m_slot != nullptr; }
+
+        /**
+         * Received bytes.
+         */
+        std::span<const uint8_t> bytes() const { return {m_slot->data.data() + m_slot->offset, m_slot->size}; }
+
+        /**
+         * Time the datagram was received.
+         */
+        ReceiveTimestamp timestamp() const { return m_slot->timestamp; }
+
+        /**
+         * Room for one datagram, after the headroom, to receive into (listener thread, before handing the
+         * buffer off).
+         */
+        std::span<uint8_t> storage() { return std::span<uint8_t>(m_slot->data).subspan(headroom, buffer_size); }
+
+        /**
+         * Headroom, to receive control messages into along with storage().
+         */
+        std::span<uint8_t> control() { return std::span<uint8_t>(m_slot->data).first(headroom); }
+
+        /**
+         * Whole buffer including headroom, for receive calls that put data in front of the datagram.
+         */
+        std::span<uint8_t> storage_with_headroom() { return m_slot->data; }
+
+        /**
+         * Set number of bytes received into storage() (listener thread, before handing the buffer off).
+         */
+        void set_size(size_t size) { set_range(headroom, size); }
+
+        /**
+         * Set where in storage_with_headroom() the datagram was received (listener thread, before handing
+         * the buffer off).
+         * @param offset start of datagram
+         * @param size size of datagram
+         */
+        void set_range(size_t offset, size_t size)
+        {
+            m_slot->offset = offset;
+            m_slot->size = size;
+        }
+
+        /**
+         * Set time the datagram was received (listener thread, before handing the buffer off).
+         */
+        void set_timestamp(ReceiveTimestamp timestamp) { m_slot->timestamp = timestamp; }
+
+        /**
+         * Drop this handle, returning the buffer to the pool if it was the last one.
+         */
+        void reset()
+        {
+            if (m_slot && m_slot->references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                m_pool->release(m_slot);
+            }
+            m_slot = nullptr;
+        }
+
+    private:
+        friend class ReceiveBufferPool;
+
+        Buffer(ReceiveBufferPool* pool, Slot* slot) : m_pool(pool), m_slot(slot) {}
+
+        void retain()
+        {
+            if (m_slot) {
+                m_slot->references.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        ReceiveBufferPool* m_pool{nullptr};
+        Slot* m_slot{nullptr};
+    };
+
+    ReceiveBufferPool();
+
+    ReceiveBufferPool(const ReceiveBufferPool&) = delete;
+    ReceiveBufferPool& operator=(const ReceiveBufferPool&) = delete;
+
+    /**
+     * Take a free buffer (one thread only, the listener thread).
+     * @return buffer holding one reference, empty if all buffers are in use
+     */
+    Buffer acquire();
+
+    /**
+     * Number of free buffers (any thread). Only approximate while buffers are taken or released.
+     */
+    size_t available() const { return m_free.size(); }
+
+private:
+    void release(Slot* slot);
+
+    std::unique_ptr<Slot[]> m_slots;
+    MpscQueue<uint32_t, pool_size> m_free;
+};
+
+
+#endif // TRAINPP_RECEIVE_BUFFER_POOL_H
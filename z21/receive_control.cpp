@@ -0,0 +1,57 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <cstring>
+
+#include "receive_control.h"
+
+
+bool enable_receive_control(int socket_fd)
+{
+    int on = 1;
+    bool timestamps = ::setsockopt(socket_fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == 0;
+    bool drops = ::setsockopt(socket_fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) == 0;
+    return timestamps && drops;
+}
+
+ReceiveControl receive_control(const msghdr& header)
+{
+    ReceiveControl control;
+    bool timestamped = false;
+    for (const cmsghdr* cmsg = CMSG_FIRSTHDR(&header); cmsg; cmsg = CMSG_NXTHDR(const_cast<msghdr*>(&header), const_cast<cmsghdr*>(cmsg))) {
+        if (cmsg->cmsg_level != SOL_SOCKET) {
+            continue;
+        }
+        if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            timespec time;
+            std::memcpy(&time, CMSG_DATA(cmsg), sizeof(time));
+            control.timestamp = ReceiveTimestamp(std::chrono::duration_cast<ReceiveTimestamp::duration>(
+                    std::chrono::seconds(time.tv_sec) + std::chrono::nanoseconds(time.tv_nsec)));
+            timestamped = true;
+        }
+        else if (cmsg->cmsg_type == SO_RXQ_OVFL) {
+            // Only passed once the socket has dropped anything.
+            std::memcpy(&control.drops, CMSG_DATA(cmsg), sizeof(control.drops));
+        }
+    }
+
+    if (!timestamped) {
+        control.timestamp = std::chrono::system_clock::now();
+    }
+    return control;
+}
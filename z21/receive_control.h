@@ -0,0 +1,67 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef TRAINPP_RECEIVE_CONTROL_H
+#define TRAINPP_RECEIVE_CONTROL_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <sys/socket.h>
+
+
+/**
+ * Time a datagram arrived, taken by the kernel (SO_TIMESTAMPNS, CLOCK_REALTIME).
+ */
+using ReceiveTimestamp = std::chrono::system_clock::time_point;
+
+/**
+ * What the kernel passes along with a received datagram.
+ */
+struct ReceiveControl
+{
+    ReceiveTimestamp timestamp;
+
+    // Datagrams the kernel dropped on the socket so far, for lack of receive buffer space, counted when this
+    // one was queued (SO_RXQ_OVFL). Wraps at 2^32.
+    uint32_t drops{0};
+};
+
+/**
+ * Room for the control messages asked for by enable_receive_control(), per received datagram.
+ */
+constexpr size_t receive_control_size = CMSG_SPACE(sizeof(timespec)) + CMSG_SPACE(sizeof(uint32_t));
+
+/**
+ * Ask the kernel to pass a receive timestamp and the drop count with every datagram received from socket.
+ * @param socket_fd UDP socket
+ * @return false if either is not supported (errno set), then receive_control() falls back to the time it is
+ *         called, or reports no drops
+ */
+bool enable_receive_control(int socket_fd);
+
+/**
+ * Get timestamp and drop count out of the control messages of a received datagram.
+ * @param header header the datagram was received with
+ * @return kernel receive time, or the current time if the kernel did not pass one, and drop count
+ */
+ReceiveControl receive_control(const msghdr& header);
+
+
+#endif // TRAINPP_RECEIVE_CONTROL_H
@@ -0,0 +1,157 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <algorithm>
+
+#include "send_rate_controller.h"
+
+
+namespace
+{
+    SendRateConfig with_valid_rates(SendRateConfig config)
+    {
+        config.min_rate = std::max(config.min_rate, SendRateController::lowest_rate);
+        config.max_rate = std::max(config.max_rate, config.min_rate);
+        return config;
+    }
+}
+
+
+SendRateController::SendRateController(const SendRateConfig& config) :
+    m_config(with_valid_rates(config)),
+    m_rate(std::clamp(config.initial_rate, m_config.min_rate, m_config.max_rate))
+{
+}
+
+bool SendRateController::can_send(clock::time_point now)
+{
+    if (!m_config.enabled) {
+        return true;
+    }
+
+    m_now = now;
+    return now >= next_send();
+}
+
+SendRateController::clock::time_point SendRateController::next_send() const
+{
+    // Up to `burst` DataSets may be sent ahead of the schedule.
+    return m_scheduled - std::chrono::duration_cast<clock::duration>(interval() * (std::max(m_config.burst, 1.0) - 1));
+}
+
+void SendRateController::on_sent()
+{
+    if (m_config.enabled) {
+        m_scheduled = std::max(m_scheduled, m_now) + interval();
+    }
+}
+
+void SendRateController::on_loco_command(uint16_t address, clock::time_point now)
+{
+    if (!m_config.enabled) {
+        return;
+    }
+
+    // One probe per loco at a time, an echo can not be matched to one of several commands.
+    Probe* free = nullptr;
+    for (Probe& probe: m_probes) {
+        if (probe.active && probe.address == address) {
+            return;
+        }
+        if (!probe.active && !free) {
+            free = &probe;
+        }
+    }
+
+    if (free) {
+        *free = Probe{address, true, now};
+    }
+}
+
+void SendRateController::on_loco_info(uint16_t address, clock::time_point now)
+{
+    for (Probe& probe: m_probes) {
+        if (probe.active && probe.address == address) {
+            probe.active = false;
+            m_echoes.fetch_add(1, std::memory_order_relaxed);
+
+            if (now - probe.sent <= m_config.echo_threshold) {
+                increase();
+            }
+            else {
+                m_slow_echoes.fetch_add(1, std::memory_order_relaxed);
+                back_off(now);
+            }
+            return;
+        }
+    }
+}
+
+void SendRateController::on_unknown_command(clock::time_point now)
+{
+    if (!m_config.enabled) {
+        return;
+    }
+
+    m_unknown_commands.fetch_add(1, std::memory_order_relaxed);
+    back_off(now);
+}
+
+void SendRateController::expire(clock::time_point now)
+{
+    for (Probe& probe: m_probes) {
+        if (probe.active && now - probe.sent > m_config.echo_timeout) {
+            probe.active = false;
+            m_lost_echoes.fetch_add(1, std::memory_order_relaxed);
+            back_off(now);
+        }
+    }
+}
+
+SendRateStats SendRateController::stats() const
+{
+    SendRateStats stats;
+    stats.rate = m_config.enabled ? rate() : 0;
+    stats.echoes = m_echoes.load(std::memory_order_relaxed);
+    stats.slow_echoes = m_slow_echoes.load(std::memory_order_relaxed);
+    stats.lost_echoes = m_lost_echoes.load(std::memory_order_relaxed);
+    stats.unknown_commands = m_unknown_commands.load(std::memory_order_relaxed);
+    stats.backoffs = m_backoffs.load(std::memory_order_relaxed);
+    return stats;
+}
+
+SendRateController::clock::duration SendRateController::interval() const
+{
+    return std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1 / rate()));
+}
+
+void SendRateController::increase()
+{
+    m_rate.store(std::min(m_config.max_rate, rate() + m_config.increase), std::memory_order_relaxed);
+}
+
+void SendRateController::back_off(clock::time_point now)
+{
+    if (m_backoffs.load(std::memory_order_relaxed) > 0 && now - m_last_backoff < m_config.echo_timeout) {
+        return;
+    }
+
+    m_last_backoff = now;
+    m_backoffs.fetch_add(1, std::memory_order_relaxed);
+    m_rate.store(std::max(m_config.min_rate, rate() * m_config.decrease), std::memory_order_relaxed);
+}
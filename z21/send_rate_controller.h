@@ -0,0 +1,175 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef TRAINPP_SEND_RATE_CONTROLLER_H
+#define TRAINPP_SEND_RATE_CONTROLLER_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+
+/**
+ * Tuning of the adaptive send rate. Rates are in DataSets per second, min_rate is raised to at least
+ * SendRateController::lowest_rate and max_rate to at least min_rate.
+ */
+struct SendRateConfig
+{
+    bool enabled{false};
+
+    double initial_rate{100};
+    double min_rate{10};
+    double max_rate{1000};
+
+    // Added to the rate for each echo arriving within echo_threshold.
+    double increase{5};
+
+    // The rate is multiplied by this when backing off.
+    double decrease{0.5};
+
+    // Max DataSets sent back to back after being idle.
+    double burst{10};
+
+    // An echo slower than this means the Z21 is falling behind.
+    std::chrono::milliseconds echo_threshold{50};
+
+    // An echo not seen within this is counted as lost. Also the least time between two backoffs, since
+    // signals right after a backoff stem from traffic sent before it.
+    std::chrono::milliseconds echo_timeout{500};
+};
+
+/**
+ * Counters for the adaptive send rate.
+ */
+struct SendRateStats
+{
+    // Allowed DataSets per second, zero when the rate is not adaptive.
+    double rate{0};
+
+    uint64_t echoes{0};
+    uint64_t slow_echoes{0};
+    uint64_t lost_echoes{0};
+    uint64_t unknown_commands{0};
+    uint64_t backoffs{0};
+};
+
+
+/**
+ * AIMD (additive increase, multiplicative decrease) control of the rate DataSets are sent to the Z21.
+ *
+ * Loco commands are used as probes: the Z21 echoes each one with LAN_X_LOCO_INFO. Echoes arriving quickly
+ * raise the rate a step, while slow or lost echoes and LAN_X_UNKNOWN_COMMAND replies cut it. Sending is
+ * paced to the current rate, allowing a burst after being idle.
+ *
+ * All calls but stats() are made from the listener thread. When disabled, sending is never held back.
+ */
+class SendRateController
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    static constexpr size_t max_probes = 32;
+
+    // Lowest rate backing off can reach, one DataSet in about 17 minutes, so the interval between two
+    // DataSets always fits in clock::duration.
+    static constexpr double lowest_rate = 0.001;
+
+    explicit SendRateController(const SendRateConfig& config = SendRateConfig());
+
+    /**
+     * Check if a DataSet may be sent now.
+     * @param now current time
+     * @return true if sending is allowed, then call on_sent()
+     */
+    bool can_send(clock::time_point now);
+
+    /**
+     * Get when the next DataSet may be sent, if can_send() returned false.
+     * @return time of the next send credit
+     */
+    clock::time_point next_send() const;
+
+    /**
+     * Account for a DataSet sent.
+     */
+    void on_sent();
+
+    /**
+     * Account for a loco command sent, which the Z21 is expected to echo.
+     * @param address loco address
+     * @param now current time
+     */
+    void on_loco_command(uint16_t address, clock::time_point now);
+
+    /**
+     * Handle LAN_X_LOCO_INFO received.
+     * @param address loco address
+     * @param now current time
+     */
+    void on_loco_info(uint16_t address, clock::time_point now);
+
+    /**
+     * Handle LAN_X_UNKNOWN_COMMAND received.
+     * @param now current time
+     */
+    void on_unknown_command(clock::time_point now);
+
+    /**
+     * Count echoes not seen within the echo timeout as lost.
+     * @param now current time
+     */
+    void expire(clock::time_point now);
+
+    /**
+     * Get counters (any thread).
+     * @return snapshot of counters
+     */
+    SendRateStats stats() const;
+
+    double rate() const { return m_rate.load(std::memory_order_relaxed); }
+
+private:
+    struct Probe
+    {
+        uint16_t address{0};
+        bool active{false};
+        clock::time_point sent;
+    };
+
+    clock::duration interval() const;
+    void increase();
+    void back_off(clock::time_point now);
+
+    const SendRateConfig m_config;
+
+    std::atomic<double> m_rate;
+    clock::time_point m_scheduled{};    // when the next DataSet is due at the current rate
+    clock::time_point m_now{};
+    clock::time_point m_last_backoff{};
+    std::array<Probe, max_probes> m_probes{};
+
+    std::atomic<uint64_t> m_echoes{0};
+    std::atomic<uint64_t> m_slow_echoes{0};
+    std::atomic<uint64_t> m_lost_echoes{0};
+    std::atomic<uint64_t> m_unknown_commands{0};
+    std::atomic<uint64_t> m_backoffs{0};
+};
+
+
+#endif // TRAINPP_SEND_RATE_CONTROLLER_H
@@ -0,0 +1,115 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef TRAINPP_SEQLOCK_H
+#define TRAINPP_SEQLOCK_H
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+
+/**
+ * Value published by one writer thread and read by any number of threads, without locks.
+ *
+ * The value is kept as atomic words next to a sequence number that is odd while a store is in progress.
+ * Readers copy the words and retry if the sequence number was odd or changed meanwhile, so they always get
+ * a value from a single store, and never make the writer wait.
+ */
+template<typename T>
+class SeqLock
+{
+    static_assert(std::is_trivially_copyable_v<T>, "SeqLock value must be trivially copyable");
+
+public:
+    explicit SeqLock(const T& value = T{})
+    {
+        write(value);
+    }
+
+    SeqLock(const SeqLock&) = delete;
+    SeqLock& operator=(const SeqLock&) = delete;
+
+    /**
+     * Publish value (writer thread only).
+     */
+    void store(const T& value)
+    {
+        // Odd while writing. The fence keeps the word stores from moving ahead of it.
+        uint64_t sequence = m_sequence.load(std::memory_order_relaxed);
+        m_sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        write(value);
+        m_sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    /**
+     * Get the latest published value (any thread).
+     */
+    T load() const
+    {
+        std::array<uint64_t, words> copy;
+        while (true) {
+            uint64_t sequence = m_sequence.load(std::memory_order_acquire);
+            if (sequence & 1) {
+                continue;
+            }
+            for (size_t i = 0; i < words; i++) {
+                copy[i] = m_words[i].load(std::memory_order_relaxed);
+            }
+
+            // Keeps the word loads from moving past the second sequence load.
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (m_sequence.load(std::memory_order_relaxed) == sequence) {
+                break;
+            }
+        }
+
+        // Through bytes, so T need not be default constructible (or trivially so, for memcpy() into it).
+        std::array<unsigned char, sizeof(T)> bytes;
+        std::memcpy(bytes.data(), copy.data(), sizeof(T));
+        return std::bit_cast<T>(bytes);
+    }
+
+    /**
+     * Number of stores so far (any thread).
+     */
+    uint64_t version() const { return m_sequence.load(std::memory_order_acquire) / 2; }
+
+private:
+    static constexpr size_t words = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+    void write(const T& value)
+    {
+        auto bytes = std::bit_cast<std::array<unsigned char, sizeof(T)>>(value);
+        std::array<uint64_t, words> copy{};
+        std::memcpy(copy.data(), bytes.data(), sizeof(T));
+        for (size_t i = 0; i < words; i++) {
+            m_words[i].store(copy[i], std::memory_order_relaxed);
+        }
+    }
+
+    alignas(64) std::atomic<uint64_t> m_sequence{0};
+    std::array<std::atomic<uint64_t>, words> m_words{};
+};
+
+
+#endif // TRAINPP_SEQLOCK_H
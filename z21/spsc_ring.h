@@ -0,0 +1,115 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef TRAINPP_SPSC_RING_H
+#define TRAINPP_SPSC_RING_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+
+/**
+ * Bounded lock-free ring for one producer thread and one consumer thread.
+ *
+ * Each side owns one position and keeps a cached copy of the other's, so the shared positions are only read
+ * when the cached one says the ring looks full (or empty). Values are moved in and out, so a popped slot
+ * holds no reference to what passed through it. Nothing is allocated after construction.
+ */
+template<typename T, size_t Capacity>
+class SpscRing
+{
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "SpscRing capacity must be a power of two");
+
+public:
+    SpscRing() = default;
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    /**
+     * Push value (producer thread only).
+     * @param value value to push
+     * @return false if ring is full, value is then left untouched
+     */
+    bool push(const T& value) { return push_value(value); }
+    bool push(T&& value) { return push_value(std::move(value)); }
+
+    /**
+     * Pop oldest value (consumer thread only).
+     * @param value popped value
+     * @return false if ring is empty
+     */
+    bool pop(T& value)
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_cached_tail) {
+            m_cached_tail = m_tail.load(std::memory_order_acquire);
+            if (head == m_cached_tail) {
+                return false;
+            }
+        }
+
+        value = std::move(m_slots[head & (Capacity - 1)]);
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Number of values in ring (any thread). Only approximate while the other threads push or pop.
+     */
+    size_t size() const
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+
+    static constexpr size_t capacity() { return Capacity; }
+
+private:
+    template<typename U>
+    bool push_value(U&& value)
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_cached_head == Capacity) {
+            m_cached_head = m_head.load(std::memory_order_acquire);
+            if (tail - m_cached_head == Capacity) {
+                return false;
+            }
+        }
+
+        m_slots[tail & (Capacity - 1)] = std::forward<U>(value);
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    std::array<T, Capacity> m_slots{};
+
+    // Consumer side.
+    alignas(64) std::atomic<size_t> m_head{0};
+    size_t m_cached_tail{0};
+
+    // Producer side.
+    alignas(64) std::atomic<size_t> m_tail{0};
+    size_t m_cached_head{0};
+};
+
+
+#endif // TRAINPP_SPSC_RING_H
@@ -0,0 +1,321 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <boost/log/trivial.hpp>
+
+#include "uring_receiver.h"
+
+
+// The completion header, control messages and a full datagram fit in one pooled buffer.
+static_assert(sizeof(io_uring_recvmsg_out) + receive_control_size <= ReceiveBufferPool::headroom);
+
+namespace
+{
+    // User data of the multishot receive, and of the request cancelling it.
+    constexpr uint64_t receive_request = 1;
+    constexpr uint64_t cancel_request = 2;
+
+    // There is no glibc wrapper for the io_uring syscalls.
+    int io_uring_setup(unsigned entries, io_uring_params* params)
+    {
+        return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+    }
+
+    int io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+    {
+        return static_cast<int>(::syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0));
+    }
+
+    int io_uring_register(int ring_fd, unsigned opcode, void* arg, unsigned nr_args)
+    {
+        return static_cast<int>(::syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args));
+    }
+
+    template<typename T>
+    T* at_offset(void* base, size_t offset)
+    {
+        return reinterpret_cast<T*>(static_cast<uint8_t*>(base) + offset);
+    }
+}
+
+
+UringReceiver::UringReceiver(ReceiveBufferPool& pool) :
+    m_pool(pool)
+{
+}
+
+UringReceiver::~UringReceiver()
+{
+    stop();
+}
+
+bool UringReceiver::start(int socket_fd)
+{
+    // Room for a completion per lent buffer, and then some, so the multishot receive never overflows.
+    io_uring_params params{};
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = 4 * ring_buffers;
+    m_ring_fd = io_uring_setup(8, &params);
+    if (m_ring_fd < 0 || !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        BOOST_LOG_TRIVIAL(warning) << "io_uring not available: " << std::strerror(errno);
+        stop();
+        return false;
+    }
+
+    m_sq_ring_size = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                              params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    m_sq_ring = ::mmap(nullptr, m_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQ_RING);
+    m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = ::mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQES);
+    m_buf_ring_size = ring_buffers * sizeof(io_uring_buf);
+    void* buf_ring = ::mmap(nullptr, m_buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m_sq_ring == MAP_FAILED || sqes == MAP_FAILED || buf_ring == MAP_FAILED) {
+        BOOST_LOG_TRIVIAL(warning) << "Failed mapping io_uring: " << std::strerror(errno);
+        m_sq_ring = m_sq_ring == MAP_FAILED ? nullptr : m_sq_ring;
+        m_sqes = sqes == MAP_FAILED ? nullptr : static_cast<io_uring_sqe*>(sqes);
+        m_buf_ring = buf_ring == MAP_FAILED ? nullptr : static_cast<io_uring_buf_ring*>(buf_ring);
+        stop();
+        return false;
+    }
+    m_sqes = static_cast<io_uring_sqe*>(sqes);
+    m_buf_ring = static_cast<io_uring_buf_ring*>(buf_ring);
+
+    m_sq_tail = at_offset<unsigned>(m_sq_ring, params.sq_off.tail);
+    m_sq_mask = at_offset<unsigned>(m_sq_ring, params.sq_off.ring_mask);
+    m_sq_array = at_offset<unsigned>(m_sq_ring, params.sq_off.array);
+    m_cq_head = at_offset<unsigned>(m_sq_ring, params.cq_off.head);
+    m_cq_tail = at_offset<unsigned>(m_sq_ring, params.cq_off.tail);
+    m_cq_mask = at_offset<unsigned>(m_sq_ring, params.cq_off.ring_mask);
+    m_cqes = at_offset<io_uring_cqe>(m_sq_ring, params.cq_off.cqes);
+
+    m_event_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_event_fd < 0 || io_uring_register(m_ring_fd, IORING_REGISTER_EVENTFD, &m_event_fd, 1) < 0) {
+        BOOST_LOG_TRIVIAL(warning) << "Failed registering io_uring eventfd: " << std::strerror(errno);
+        stop();
+        return false;
+    }
+
+    // Buffers are picked by the kernel from this ring (buffer group 0), instead of being given per request.
+    io_uring_buf_reg reg{};
+    reg.ring_addr = reinterpret_cast<uintptr_t>(m_buf_ring);
+    reg.ring_entries = ring_buffers;
+    reg.bgid = 0;
+    if (io_uring_register(m_ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        BOOST_LOG_TRIVIAL(warning) << "Failed registering io_uring buffer ring: " << std::strerror(errno);
+        stop();
+        return false;
+    }
+
+    // Only the sizes matter for a multishot recvmsg, the kernel puts name and control data in the buffer.
+    m_socket_fd = socket_fd;
+    m_msghdr = msghdr{};
+    m_msghdr.msg_controllen = receive_control_size;
+    refill();
+    if (!m_armed) {
+        stop();
+        return false;
+    }
+    return true;
+}
+
+void UringReceiver::clear_event()
+{
+    uint64_t count;
+    if (::read(m_event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        BOOST_LOG_TRIVIAL(error) << "Failed reading io_uring eventfd: " << std::strerror(errno);
+    }
+}
+
+bool UringReceiver::next_completion(Completion& completion)
+{
+    std::atomic_ref<unsigned> cq_head(*m_cq_head);
+    std::atomic_ref<unsigned> cq_tail(*m_cq_tail);
+
+    unsigned head = cq_head.load(std::memory_order_relaxed);
+    while (head != cq_tail.load(std::memory_order_acquire)) {
+        io_uring_cqe cqe = m_cqes[head & *m_cq_mask];
+        cq_head.store(++head, std::memory_order_release);
+
+        if (cqe.user_data != receive_request) {
+            continue;
+        }
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            // Stopped, most likely for lack of buffers (ENOBUFS). Restarted by refill().
+            m_armed = false;
+        }
+        if (!(cqe.flags & IORING_CQE_F_BUFFER)) {
+            if (cqe.res < 0 && cqe.res != -ENOBUFS) {
+                BOOST_LOG_TRIVIAL(error) << "io_uring receive failed: " << std::strerror(-cqe.res);
+            }
+            continue;
+        }
+
+        // The buffer is no longer the kernel's, whether or not anything was received into it.
+        ReceiveBufferPool::Buffer buffer = std::move(m_lent[cqe.flags >> IORING_CQE_BUFFER_SHIFT]);
+        size_t offset = sizeof(io_uring_recvmsg_out) + m_msghdr.msg_namelen + m_msghdr.msg_controllen;
+        if (cqe.res < 0 || static_cast<size_t>(cqe.res) < offset) {
+            continue;
+        }
+
+        uint8_t* data = buffer.storage_with_headroom().data();
+        const auto* out = reinterpret_cast<const io_uring_recvmsg_out*>(data);
+        completion.truncated = (out->flags & MSG_TRUNC) || out->payloadlen > ReceiveBufferPool::buffer_size;
+        buffer.set_range(offset, cqe.res - offset);
+
+        msghdr header{};
+        header.msg_control = data + sizeof(io_uring_recvmsg_out) + m_msghdr.msg_namelen;
+        header.msg_controllen = out->controllen;
+        ReceiveControl control = receive_control(header);
+        buffer.set_timestamp(control.timestamp);
+        completion.kernel_drops = control.drops;
+        completion.buffer = std::move(buffer);
+        m_completions.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    return false;
+}
+
+size_t UringReceiver::refill()
+{
+    unsigned added = 0;
+    for (unsigned bid = 0; bid < ring_buffers; bid++) {
+        if (m_lent[bid]) {
+            continue;
+        }
+        m_lent[bid] = m_pool.acquire();
+        if (!m_lent[bid]) {
+            m_buffer_shortages.fetch_add(1, std::memory_order_relaxed);
+            break;
+        }
+
+        std::span<uint8_t> storage = m_lent[bid].storage_with_headroom();
+        // Not m_buf_ring->bufs, the empty struct in front of it takes a byte in C++, moving the array.
+        io_uring_buf& buf = reinterpret_cast<io_uring_buf*>(m_buf_ring)[(m_buf_tail + added) & (ring_buffers - 1)];
+        buf.addr = reinterpret_cast<uintptr_t>(storage.data());
+        buf.len = storage.size();
+        buf.bid = bid;
+        added++;
+    }
+
+    if (added > 0) {
+        m_buf_tail += added;
+        std::atomic_ref<uint16_t>(m_buf_ring->tail).store(m_buf_tail, std::memory_order_release);
+    }
+    return m_armed ? 0 : arm();
+}
+
+size_t UringReceiver::arm()
+{
+    if (std::none_of(m_lent.begin(), m_lent.end(), [](const auto& buffer) { return static_cast<bool>(buffer); })) {
+        return 0;
+    }
+
+    unsigned tail = *m_sq_tail;
+    unsigned index = tail & *m_sq_mask;
+    io_uring_sqe& sqe = m_sqes[index];
+    sqe = io_uring_sqe{};
+    sqe.opcode = IORING_OP_RECVMSG;
+    sqe.fd = m_socket_fd;
+    sqe.addr = reinterpret_cast<uintptr_t>(&m_msghdr);
+    sqe.len = 1;
+    sqe.ioprio = IORING_RECV_MULTISHOT;
+    sqe.flags = IOSQE_BUFFER_SELECT;
+    sqe.buf_group = 0;
+    sqe.user_data = receive_request;
+    m_sq_array[index] = index;
+    std::atomic_ref<unsigned>(*m_sq_tail).store(tail + 1, std::memory_order_release);
+
+    if (io_uring_enter(m_ring_fd, 1, 0, 0) == 1) {
+        m_armed = true;
+        m_arms.fetch_add(1, std::memory_order_relaxed);
+    }
+    else {
+        BOOST_LOG_TRIVIAL(error) << "Failed starting io_uring receive: " << std::strerror(errno);
+    }
+    return 1;
+}
+
+void UringReceiver::stop()
+{
+    // Cancel the receive and wait for it, so the kernel is done with the lent buffers before they go back.
+    if (m_armed) {
+        unsigned tail = *m_sq_tail;
+        unsigned index = tail & *m_sq_mask;
+        io_uring_sqe& sqe = m_sqes[index];
+        sqe = io_uring_sqe{};
+        sqe.opcode = IORING_OP_ASYNC_CANCEL;
+        sqe.fd = -1;
+        sqe.addr = receive_request;
+        sqe.user_data = cancel_request;
+        m_sq_array[index] = index;
+        std::atomic_ref<unsigned>(*m_sq_tail).store(tail + 1, std::memory_order_release);
+
+        std::atomic_ref<unsigned> cq_head(*m_cq_head);
+        std::atomic_ref<unsigned> cq_tail(*m_cq_tail);
+        unsigned to_submit = 1;
+        while (m_armed) {
+            if (io_uring_enter(m_ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+                break;
+            }
+            to_submit = 0;
+
+            unsigned head = cq_head.load(std::memory_order_relaxed);
+            for (; head != cq_tail.load(std::memory_order_acquire); head++) {
+                const io_uring_cqe& cqe = m_cqes[head & *m_cq_mask];
+                if (cqe.user_data == receive_request && !(cqe.flags & IORING_CQE_F_MORE)) {
+                    m_armed = false;
+                }
+            }
+            cq_head.store(head, std::memory_order_release);
+        }
+        m_armed = false;
+    }
+
+    if (m_ring_fd >= 0) {
+        ::close(m_ring_fd);
+        m_ring_fd = -1;
+    }
+    if (m_event_fd >= 0) {
+        ::close(m_event_fd);
+        m_event_fd = -1;
+    }
+    if (m_sq_ring) {
+        ::munmap(m_sq_ring, m_sq_ring_size);
+        m_sq_ring = nullptr;
+    }
+    if (m_sqes) {
+        ::munmap(m_sqes, m_sqes_size);
+        m_sqes = nullptr;
+    }
+    if (m_buf_ring) {
+        ::munmap(m_buf_ring, m_buf_ring_size);
+        m_buf_ring = nullptr;
+    }
+    for (auto& buffer : m_lent) {
+        buffer.reset();
+    }
+}
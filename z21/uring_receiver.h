@@ -0,0 +1,153 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef TRAINPP_URING_RECEIVER_H
+#define TRAINPP_URING_RECEIVER_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <sys/socket.h>
+
+#include "receive_buffer_pool.h"
+
+struct io_uring_buf_ring;
+struct io_uring_cqe;
+struct io_uring_sqe;
+
+
+/**
+ * Receives datagrams from a UDP socket through io_uring (Linux 6.0 or later), with one multishot recvmsg
+ * request and a ring of pooled buffers registered with the kernel, so no receive syscall is made per
+ * datagram and the kernel picks the buffer itself.
+ *
+ * Completions are announced on an eventfd, for the owner to wait on next to its other I/O. Everything but
+ * construction happens on one thread, the listener thread.
+ */
+class UringReceiver
+{
+public:
+    // Buffers lent to the kernel at a time, taken from the pool.
+    static constexpr unsigned ring_buffers = 64;
+
+    /**
+     * A received datagram.
+     */
+    struct Completion
+    {
+        ReceiveBufferPool::Buffer buffer;
+        bool truncated{false};
+
+        // Kernel drop count passed with the datagram, see ReceiveControl.
+        uint32_t kernel_drops{0};
+    };
+
+    explicit UringReceiver(ReceiveBufferPool& pool);
+    ~UringReceiver();
+
+    UringReceiver(const UringReceiver&) = delete;
+    UringReceiver& operator=(const UringReceiver&) = delete;
+
+    /**
+     * Set up the ring and start receiving from socket.
+     * @param socket_fd UDP socket
+     * @return false if io_uring is not available, then nothing is set up
+     */
+    bool start(int socket_fd);
+
+    /**
+     * Eventfd signalled when completions are ready, -1 before start().
+     */
+    int event_fd() const { return m_event_fd; }
+
+    /**
+     * Whether the multishot receive is waiting for datagrams. When not, it could not be restarted for lack
+     * of free buffers and the socket has to be read some other way until reap() manages to.
+     */
+    bool armed() const { return m_armed; }
+
+    /**
+     * Take all completions, lend free pool buffers to the kernel in place of the received ones and restart
+     * the receive if it stopped.
+     * @param handler called with each Completion
+     * @return number of receive syscalls made (restarting the receive), not counting clearing the eventfd
+     */
+    template<typename Handler>
+    size_t reap(Handler&& handler)
+    {
+        clear_event();
+        Completion completion;
+        while (next_completion(completion)) {
+            handler(completion);
+            completion.buffer.reset();
+        }
+        return refill();
+    }
+
+    /**
+     * Datagrams received, multishot receives started and refills that found the pool empty (any thread).
+     */
+    uint64_t completions() const { return m_completions.load(std::memory_order_relaxed); }
+    uint64_t arms() const { return m_arms.load(std::memory_order_relaxed); }
+    uint64_t buffer_shortages() const { return m_buffer_shortages.load(std::memory_order_relaxed); }
+
+private:
+    void clear_event();
+    bool next_completion(Completion& completion);
+    size_t refill();
+    size_t arm();
+    void stop();
+
+    ReceiveBufferPool& m_pool;
+
+    int m_ring_fd{-1};
+    int m_event_fd{-1};
+    int m_socket_fd{-1};
+    bool m_armed{false};
+
+    // Rings shared with the kernel, both in one mapping (IORING_FEAT_SINGLE_MMAP).
+    void* m_sq_ring{nullptr};
+    size_t m_sq_ring_size{0};
+    io_uring_sqe* m_sqes{nullptr};
+    size_t m_sqes_size{0};
+    unsigned* m_sq_tail{nullptr};
+    unsigned* m_sq_mask{nullptr};
+    unsigned* m_sq_array{nullptr};
+    unsigned* m_cq_head{nullptr};
+    unsigned* m_cq_tail{nullptr};
+    unsigned* m_cq_mask{nullptr};
+    io_uring_cqe* m_cqes{nullptr};
+
+    // Buffers lent to the kernel, by buffer ID, and the ring telling the kernel about them.
+    io_uring_buf_ring* m_buf_ring{nullptr};
+    size_t m_buf_ring_size{0};
+    uint16_t m_buf_tail{0};
+    std::array<ReceiveBufferPool::Buffer, ring_buffers> m_lent;
+
+    // Layout of each received buffer: recvmsg header, then the datagram.
+    msghdr m_msghdr{};
+
+    std::atomic<uint64_t> m_completions{0};
+    std::atomic<uint64_t> m_arms{0};
+    std::atomic<uint64_t> m_buffer_shortages{0};
+};
+
+
+#endif // TRAINPP_URING_RECEIVER_H
@@ -16,38 +16,209 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#include <cerrno>
+#include <cstring>
+#include <ctime>
 #include <iostream>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
 #include <boost/program_options.hpp>
 #include <boost/log/trivial.hpp>
 #include <boost/array.hpp>
-#include <boost/bind.hpp>
 
 #include "z21.h"
 
 using boost::asio::ip::udp;
 
 
-Z21::Z21(const std::string& z21_host, const std::string& z21_port) :
-    host(z21_host), port(z21_port),
-    socket(io_context)
+namespace
 {
-    recv_buf.resize(128);
-    command_handlers[Z21_DataSet::LAN_GET_SERIAL_NUMBER] = new LanGetSerialNumber();
-    command_handlers[Z21_DataSet::LAN_GET_CODE] = new LanGetCode();
-    command_handlers[Z21_DataSet::LAN_GET_HWINFO] = new LanGetHWInfo();
-    command_handlers[Z21_DataSet::LAN_GET_BROADCASTFLAGS] = new LanGetBroadcastFlags();
-    command_handlers[Z21_DataSet::LAN_GET_LOCOMODE] = new LanGetLocomode();
-    command_handlers[Z21_DataSet::LAN_GET_TURNOUTMODE] = new LanGetTurnoutmode();
-    command_handlers[Z21_DataSet::LAN_SYSTEMSTATE_DATACHANGED] = new LanSystemstateDatachanged();
-    command_handlers[0x40] = new LanX();
+    // Lane of a command, matching the request methods of Z21.
+    SendPriority priority_of(LanXCommands id)
+    {
+        switch (id) {
+            case LanXCommands::LAN_X_SET_STOP:
+            case LanXCommands::LAN_X_SET_TRACK_POWER_OFF:
+                return SendPriority::EMERGENCY;
+            case LanXCommands::LAN_X_GET_VERSION:
+            case LanXCommands::LAN_X_GET_STATUS:
+            case LanXCommands::LAN_X_DCC_READ_REGISTER:
+            case LanXCommands::LAN_X_CV_READ:
+            case LanXCommands::LAN_X_DCC_WRITE_REGISTER:
+            case LanXCommands::LAN_X_CV_WRITE:
+            case LanXCommands::LAN_X_MM_WRITE_BYTE:
+            case LanXCommands::LAN_X_GET_TURNOUT_INFO:
+            case LanXCommands::LAN_X_GET_EXT_ACCESSORY_INFO:
+            case LanXCommands::LAN_X_GET_LOCO_INFO:
+            case LanXCommands::LAN_X_CV_POM_WRITE_BYTE:
+            case LanXCommands::LAN_X_CV_POM_WRITE_BIT:
+            case LanXCommands::LAN_X_CV_POM_READ_BYTE:
+            case LanXCommands::LAN_X_CV_POM_ACCESSORY_WRITE_BYTE:
+            case LanXCommands::LAN_X_CV_POM_ACCESSORY_WRITE_BIT:
+            case LanXCommands::LAN_X_CV_POM_ACCESSORY_READ_BYTE:
+            case LanXCommands::LAN_X_GET_FIRMWARE_VERSION:
+                return SendPriority::BULK;
+            default:
+                return SendPriority::INTERACTIVE;
+        }
+    }
+
+    // Whether a packed DataSet sent after a stop or track power off could undo it: a track power on, or a loco
+    // drive or function command.
+    bool undoes_stop(std::span<const uint8_t> frame)
+    {
+        if (frame.size() < header_size + 2 || (frame[2] | frame[3] << 8) != Z21_DataSet::LAN_X) {
+            return false;
+        }
+
+        uint8_t x_header = frame[header_size];
+        uint8_t db0 = frame[header_size + 1];
+        switch (x_header) {
+            case 0x21:
+                return db0 == 0x81;                                         // LAN_X_SET_TRACK_POWER_ON
+            case 0xe4:
+                return (db0 >= 0x10 && db0 <= 0x13) ||                      // LAN_X_SET_LOCO_DRIVE
+                       (db0 >= 0x20 && db0 <= 0x23) || (db0 >= 0x28 && db0 <= 0x2b) ||
+                       db0 == 0x50 || db0 == 0x51 ||                        // LAN_X_SET_LOCO_FUNCTION_GROUP
+                       db0 == 0xf8;                                         // LAN_X_SET_LOCO_FUNCTION
+            case 0xe5:
+                return db0 == 0x5f;                                         // LAN_X_SET_LOCO_BINARY_STATE
+            default:
+                return false;
+        }
+    }
+
+    // Visitor made of one lambda per alternative.
+    template<typename... Handlers>
+    struct Overloaded : Handlers...
+    {
+        using Handlers::operator()...;
+    };
+
+    // Fields of a LAN_X_LOCO_INFO that differ from the previous state of its loco, empty if none do.
+    std::optional<event::LocoChanged> loco_change(const std::optional<LocoState>& previous, const message::LocoInfo& info,
+                                                  LocoFunctions changed_functions, ReceiveTimestamp timestamp)
+    {
+        event::LocoChanged change;
+        change.address = info.address;
+        if (!previous || previous->speed != info.speed) {
+            change.speed = info.speed;
+        }
+        if (!previous || previous->direction_forward != info.direction_forward) {
+            change.direction_forward = info.direction_forward;
+        }
+        if (!previous || previous->speed_steps != info.speed_steps) {
+            change.speed_steps = info.speed_steps;
+        }
+        if (!previous || previous->busy != info.busy) {
+            change.busy = info.busy;
+        }
+        change.changed_functions = changed_functions;
+        change.functions = info.functions & changed_functions;
+        change.timestamp = timestamp;
+
+        if (previous && !change.speed && !change.direction_forward && !change.speed_steps && !change.busy &&
+            !changed_functions.any()) {
+            return std::nullopt;
+        }
+        return change;
+    }
+
+    // Set field to value if it differs from previous, and note that something did.
+    template<typename T>
+    void set_changed(std::optional<T>& field, T previous, T value, bool& changed)
+    {
+        if (previous != value) {
+            field = value;
+            changed = true;
+        }
+    }
+
+    // CPU time used by the calling thread.
+    std::chrono::nanoseconds thread_cpu_time()
+    {
+        timespec now;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+        return std::chrono::seconds(now.tv_sec) + std::chrono::nanoseconds(now.tv_nsec);
+    }
+
+    // Raise a max counter, safe against other threads raising it at the same time.
+    void update_max(std::atomic<uint64_t>& counter, uint64_t value)
+    {
+        uint64_t current = counter.load(std::memory_order_relaxed);
+        while (value > current && !counter.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+        }
+    }
+
+    // Set a socket buffer size, beyond the system max if allowed to (CAP_NET_ADMIN).
+    // @return size the kernel settled on, which it doubles for bookkeeping, or zero on failure
+    int set_socket_buffer(int fd, int option, int force_option, int size)
+    {
+        if (size > 0 &&
+            ::setsockopt(fd, SOL_SOCKET, force_option, &size, sizeof(size)) < 0 &&
+            ::setsockopt(fd, SOL_SOCKET, option, &size, sizeof(size)) < 0) {
+            return 0;
+        }
+
+        int actual = 0;
+        socklen_t length = sizeof(actual);
+        ::getsockopt(fd, SOL_SOCKET, option, &actual, &length);
+        return actual;
+    }
+}
+
+
+Z21::Z21(const std::string& z21_host, const std::string& z21_port, const Z21Config& config) :
+    host(z21_host), port(z21_port), config(config),
+    socket(io_context),
+    batch_timer(io_context),
+    bulk_timer(io_context),
+    rate_controller(config.rate_control),
+    rate_timer(io_context),
+    m_events(config.event_executor)
+{
+    // Any DataSet has to fit in a datagram of its own, else it would never be sent.
+    datagrams.fill(Z21_DatagramBatcher(std::max(config.max_datagram_size, Z21_Frame::capacity)));
+
+    // Also a single datagram is received with recvmmsg(), for its control messages.
+    size_t batch = std::max<size_t>(config.receive_batch, 1);
+    recv_batch.resize(batch);
+    recv_batch_buffers.resize(batch);
+    recv_batch_messages.resize(batch);
+    for (size_t i = 0; i < batch; i++) {
+        recv_batch_messages[i] = mmsghdr{};
+        recv_batch_messages[i].msg_hdr.msg_iov = &recv_batch_buffers[i];
+        recv_batch_messages[i].msg_hdr.msg_iovlen = 1;
+    }
 }
 
 Z21::~Z21()
 {
-    listen_thread.join();
+    io_context.stop();
+    if (listen_thread.joinable()) {
+        listen_thread.join();
+    }
 
-    for (auto& item: command_handlers) {
-        delete item.second;
+    busy_poll_running.store(false, std::memory_order_relaxed);
+    if (busy_poll_thread.joinable()) {
+        uint64_t wake = 1;
+        if (::write(busy_poll_event, &wake, sizeof(wake)) < 0) {
+            BOOST_LOG_TRIVIAL(error) << "Failed waking busy-poll thread: " << std::strerror(errno);
+        }
+        busy_poll_thread.join();
+    }
+    if (busy_poll_event >= 0) {
+        ::close(busy_poll_event);
+    }
+
+    decode_running.store(false, std::memory_order_release);
+    decode_wakeups.fetch_add(1, std::memory_order_release);
+    decode_wakeups.notify_one();
+    if (decode_thread.joinable()) {
+        decode_thread.join();
     }
 }
 
@@ -59,6 +230,19 @@ bool Z21::connect()
         udp::resolver resolver(io_context);
         receiver_endpoint = *resolver.resolve(udp::v4(), host, port).begin();
         socket.open(udp::v4());
+
+        int fd = socket.native_handle();
+        if (!enable_receive_control(fd)) {
+            BOOST_LOG_TRIVIAL(warning) << "No kernel receive timestamps or drop counts: " << std::strerror(errno);
+        }
+        socket_receive_buffer = set_socket_buffer(fd, SO_RCVBUF, SO_RCVBUFFORCE, config.receive_buffer_size);
+        if (socket_receive_buffer == 0) {
+            BOOST_LOG_TRIVIAL(warning) << "Failed setting socket receive buffer: " << std::strerror(errno);
+        }
+        socket_send_buffer = set_socket_buffer(fd, SO_SNDBUF, SO_SNDBUFFORCE, config.send_buffer_size);
+        if (socket_send_buffer == 0) {
+            BOOST_LOG_TRIVIAL(warning) << "Failed setting socket send buffer: " << std::strerror(errno);
+        }
     }
     catch(std::exception& e)
     {
@@ -72,7 +256,14 @@ bool Z21::connect()
 
 void Z21::listen()
 {
+    if (config.pipelined) {
+        decode_thread = std::thread(&Z21::decode_thread_fn, this);
+    }
     listen_thread = std::thread(&Z21::listen_thread_fn, this);
+    if (config.receive_backend == ReceiveBackend::BUSY_POLL) {
+        busy_poll_event = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        busy_poll_thread = std::thread(&Z21::busy_poll_thread_fn, this);
+    }
 }
 
 void Z21::listen_thread_fn()
@@ -80,389 +271,1221 @@ void Z21::listen_thread_fn()
     BOOST_LOG_TRIVIAL(debug) << "Running Z21 listener thread";
     try
     {
-        socket.send_to(boost::asio::buffer(LanGetSerialNumber().pack()), receiver_endpoint);
-
-        socket.async_receive_from(boost::asio::buffer(recv_buf), receiver_endpoint,
-                                  boost::bind(&Z21::handle_receive, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+        send(LanGetSerialNumber());
+        if (config.receive_backend == ReceiveBackend::IO_URING && !start_uring()) {
+            BOOST_LOG_TRIVIAL(warning) << "Receiving with asio instead of io_uring";
+        }
+        if (config.receive_backend != ReceiveBackend::BUSY_POLL) {
+            start_receive();
+        }
     }
     catch (std::exception& e)
     {
         std::cerr << e.what() << std::endl;
     }
 
+    // Without a receive pending on it, the io_context would run out of work between sends.
+    auto work = boost::asio::make_work_guard(io_context);
+    if (config.receive_backend != ReceiveBackend::BUSY_POLL) {
+        work.reset();
+    }
     io_context.run();
 }
 
+void Z21::decode_thread_fn()
+{
+    BOOST_LOG_TRIVIAL(debug) << "Running Z21 decode thread";
+
+    ReceivedDatagram received;
+    while (true) {
+        // Read before emptying the ring, so a datagram pushed after the last pop makes the wait return.
+        uint32_t wakeups = decode_wakeups.load(std::memory_order_acquire);
+        while (decode_ring.pop(received)) {
+            auto start = Z21_DatagramBatcher::clock::now();
+            auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(start - received.received).count();
+            total_pipeline_latency_ns.fetch_add(latency, std::memory_order_relaxed);
+            update_max(max_pipeline_latency_ns, latency);
 
-void Z21::handle_receive(const boost::system::error_code& error, std::size_t bytes_transferred)
+            handle_datagram(received.buffer.bytes(), received.buffer, received.buffer.timestamp());
+            received.buffer.reset();
+
+            auto decode_time = Z21_DatagramBatcher::clock::now() - start;
+            decode_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(decode_time).count(), std::memory_order_relaxed);
+        }
+
+        if (!decode_running.load(std::memory_order_acquire)) {
+            break;
+        }
+        decode_wakeups.wait(wakeups, std::memory_order_acquire);
+    }
+}
+
+void Z21::busy_poll_thread_fn()
 {
-//    BOOST_LOG_TRIVIAL(debug) << "- Z21 serial number: " << m_serial_number;
-//    BOOST_LOG_TRIVIAL(debug) << "- Z21 HW type: " << m_hw_type;
-//    BOOST_LOG_TRIVIAL(debug) << "- Z21 firmware version: " << m_fw_version;
-//    BOOST_LOG_TRIVIAL(debug) << "- Main current: " << (int)m_main_current << " mA";
-//    BOOST_LOG_TRIVIAL(debug) << "- Prog current: " << (int)m_prog_current << " mA";
-//    BOOST_LOG_TRIVIAL(debug) << "- Filtered main current: " << (int)m_filtered_main_current << " mA";
-//    BOOST_LOG_TRIVIAL(debug) << "- Temperature: " << (int)m_temperature;
-//    BOOST_LOG_TRIVIAL(debug) << "- Supply voltage: " << (int)m_supply_voltage / 1000 << " V";
-//    BOOST_LOG_TRIVIAL(debug) << "- VCC voltage: " << (int)m_vcc_voltage / 1000 << " V";
-//    BOOST_LOG_TRIVIAL(debug) << "- Emergency stop: " << (emergency_stop ? "yes" : "no");
-//    BOOST_LOG_TRIVIAL(debug) << "- Track voltage off: " << (track_voltage_off ? "yes" : "no");
-//    BOOST_LOG_TRIVIAL(debug) << "- Short circuit: " << (short_cirtcuit ? "yes" : "no");
-//    BOOST_LOG_TRIVIAL(debug) << "- Programming mode: " << (programming_mode ? "yes" : "no");
+    BOOST_LOG_TRIVIAL(debug) << "Running Z21 busy-poll thread";
+    busy_poll_active.store(true, std::memory_order_relaxed);
+
+    if (config.busy_poll_cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(config.busy_poll_cpu, &cpus);
+        int result = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (result != 0) {
+            BOOST_LOG_TRIVIAL(warning) << "Failed pinning busy-poll thread to CPU " << config.busy_poll_cpu << ": " << std::strerror(result);
+        }
+    }
+
+    int fd = socket.native_handle();
+    int busy_poll_us = config.busy_poll_us;
+    if (busy_poll_us > 0 && ::setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_us, sizeof(busy_poll_us)) < 0) {
+        BOOST_LOG_TRIVIAL(warning) << "SO_BUSY_POLL not set, spinning in user space only: " << std::strerror(errno);
+    }
 
-    if (!error || error == boost::asio::error::message_size) {
-        size_t pos = 0;
-        while (bytes_transferred - pos >= 4) {
-            uint16_t size = recv_buf[pos] | (recv_buf[pos + 1] << 8);
-            uint16_t id = recv_buf[pos + 2] | (recv_buf[pos + 3] << 8);
+    // Spin while datagrams keep coming, park in poll() once none came for busy_poll_spin.
+    auto cpu_start = thread_cpu_time();
+    auto last_datagram = std::chrono::steady_clock::now();
+    while (busy_poll_running.load(std::memory_order_relaxed)) {
+        auto now = std::chrono::steady_clock::now();
+        if (receive_available() > 0) {
+            last_datagram = now;
 
-            const auto dataset_start = recv_buf.begin() + pos;
-            const auto data_start = dataset_start + header_size;
-            std::vector<uint8_t> data(data_start, data_start + size - header_size);
+            // Spinning included, as that is the price of this mode.
+            auto cpu_now = thread_cpu_time();
+            receive_cpu_ns.fetch_add((cpu_now - cpu_start).count(), std::memory_order_relaxed);
+            cpu_start = cpu_now;
+            continue;
+        }
+        if (now - last_datagram < config.busy_poll_spin) {
+            continue;
+        }
 
-            handle_dataset(size, id, data);
-            pos += size;
+        receive_cpu_ns.fetch_add((thread_cpu_time() - cpu_start).count(), std::memory_order_relaxed);
+        std::array<pollfd, 2> fds{pollfd{fd, POLLIN, 0}, pollfd{busy_poll_event, POLLIN, 0}};
+        if (::poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR) {
+            BOOST_LOG_TRIVIAL(error) << "Failed waiting for datagrams: " << std::strerror(errno);
         }
+        receive_wakeups.fetch_add(1, std::memory_order_relaxed);
+        cpu_start = thread_cpu_time();
+        last_datagram = std::chrono::steady_clock::now();
     }
+    receive_cpu_ns.fetch_add((thread_cpu_time() - cpu_start).count(), std::memory_order_relaxed);
+}
 
-    socket.async_receive_from(
-            boost::asio::buffer(recv_buf), receiver_endpoint,
-            boost::bind(&Z21::handle_receive, this,
-                        boost::asio::placeholders::error,
-                        boost::asio::placeholders::bytes_transferred));
+void Z21::start_receive()
+{
+    if (uring_active.load(std::memory_order_relaxed)) {
+        auto handler = make_allocating_handler(receive_handler_memory, [this](const boost::system::error_code& error) {
+            handle_uring(error);
+        });
+        if (uring_receiver.armed()) {
+            uring_events.async_wait(boost::asio::posix::descriptor_base::wait_read, std::move(handler));
+        }
+        else {
+            socket.async_wait(udp::socket::wait_read, std::move(handler));
+        }
+    }
+    else {
+        socket.async_wait(udp::socket::wait_read, make_allocating_handler(receive_handler_memory, [this](const boost::system::error_code& error) {
+            handle_readable(error);
+        }));
+    }
 }
 
-// Handlers for all received DataSets and commands.
-void Z21::handle_dataset(uint16_t size, uint16_t id, std::vector<uint8_t>& data)
+void Z21::handle_readable(const boost::system::error_code& error)
 {
-    BOOST_LOG_TRIVIAL(debug) << "Received for ID " << std::hex << (int)id << ": " << PRINT_HEX(data);
-    if (command_handlers.contains(id)) {
-        Z21_DataSet* dataset = command_handlers[id];
-        dataset->unpack(data);
+    if (error == boost::asio::error::operation_aborted) {
+        return;
+    }
 
-        switch(id)
-        {
-            case Z21_DataSet::DataSet::LAN_GET_SERIAL_NUMBER:
-                m_z21_status.id.serial_number = static_cast<LanGetSerialNumber*>(dataset)->serial_number;
-                break;
-            case Z21_DataSet::DataSet::LAN_GET_CODE: {
-                uint8_t code = static_cast<LanGetCode*>(dataset)->code;
-                m_z21_status.id.feature_set = static_cast<Z21FeatureSet>(code);
-                BOOST_LOG_TRIVIAL(debug) << " ---> LAN_GET_CODE: " << (int) m_z21_status.id.feature_set;
-            } break;
-            case Z21_DataSet::DataSet::LAN_GET_HWINFO:
-                m_z21_status.id.hw_type = static_cast<LanGetHWInfo*>(dataset)->hw_type;
-                m_z21_status.id.fw_version = static_cast<LanGetHWInfo*>(dataset)->fw_version;
-                break;
-            case Z21_DataSet::DataSet::LAN_X: {
-                LanX* lanx = static_cast<LanX*>(dataset);
-                LanX_Command* command = lanx->command();
-                if (command) {
-                    handle_lanx_command(command);
+    auto cpu_start = thread_cpu_time();
+    receive_wakeups.fetch_add(1, std::memory_order_relaxed);
+    if (!error) {
+        receive_available();
+    }
+    receive_cpu_ns.fetch_add((thread_cpu_time() - cpu_start).count(), std::memory_order_relaxed);
+
+    start_receive();
+}
+
+size_t Z21::receive_available()
+{
+    size_t total = 0;
+    while (true) {
+        size_t buffers = prepare_receive_batch();
+        int received = ::recvmmsg(socket.native_handle(), recv_batch_messages.data(), buffers, MSG_DONTWAIT, nullptr);
+        receive_syscalls.fetch_add(1, std::memory_order_relaxed);
+        if (received < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                BOOST_LOG_TRIVIAL(error) << "Failed receiving datagrams: " << std::strerror(errno);
+            }
+            break;
+        }
+
+        update_max(max_datagrams_per_syscall, received);
+        total += received;
+        for (int i = 0; i < received; i++) {
+            const msghdr& header = recv_batch_messages[i].msg_hdr;
+            size_t size = recv_batch_messages[i].msg_len;
+            ReceiveControl control = receive_control(header);
+            update_max(kernel_drops, control.drops);
+            if (header.msg_flags & MSG_TRUNC) {
+                // The buffer stays in place for the next call.
+                datagrams_truncated.fetch_add(1, std::memory_order_relaxed);
+                BOOST_LOG_TRIVIAL(error) << "Dropped truncated datagram";
+            }
+            else if (recv_batch[i]) {
+                recv_batch[i].set_size(size);
+                recv_batch[i].set_timestamp(control.timestamp);
+                dispatch_datagram(std::move(recv_batch[i]));
+            }
+            else {
+                dispatch_scratch(size, control.timestamp);
+            }
+        }
+
+        // A short batch means the socket is drained, no need for a call just to learn that. Unbatched, one
+        // datagram is received per wakeup.
+        if (static_cast<size_t>(received) < buffers || config.receive_batch <= 1) {
+            break;
+        }
+    }
+    return total;
+}
+
+bool Z21::start_uring()
+{
+    if (!uring_receiver.start(socket.native_handle())) {
+        return false;
+    }
+
+    // Duplicated, the receiver and the descriptor each close their own.
+    uring_events.assign(::dup(uring_receiver.event_fd()));
+    uring_active.store(true, std::memory_order_relaxed);
+    return true;
+}
+
+void Z21::handle_uring(const boost::system::error_code& error)
+{
+    if (error == boost::asio::error::operation_aborted) {
+        return;
+    }
+
+    auto cpu_start = thread_cpu_time();
+    receive_wakeups.fetch_add(1, std::memory_order_relaxed);
+    size_t datagrams = 0;
+    size_t syscalls = uring_receiver.reap([this, &datagrams](UringReceiver::Completion& completion) {
+        update_max(kernel_drops, completion.kernel_drops);
+        if (completion.truncated) {
+            datagrams_truncated.fetch_add(1, std::memory_order_relaxed);
+            BOOST_LOG_TRIVIAL(error) << "Dropped truncated datagram";
+            return;
+        }
+        datagrams++;
+        dispatch_datagram(std::move(completion.buffer));
+    });
+
+    // Every buffer is held downstream, so the kernel has none to receive into. Read the socket into the
+    // scratch buffer until the pool has some again.
+    if (!uring_receiver.armed()) {
+        receive_pool_exhausted.fetch_add(1, std::memory_order_relaxed);
+        while (receive_pool.available() == 0) {
+            iovec buffer{recv_scratch.data(), recv_scratch.size()};
+            msghdr header{};
+            header.msg_iov = &buffer;
+            header.msg_iovlen = 1;
+            header.msg_control = recv_scratch_control.data();
+            header.msg_controllen = recv_scratch_control.size();
+            ssize_t size = ::recvmsg(socket.native_handle(), &header, MSG_DONTWAIT | MSG_TRUNC);
+            syscalls++;
+            if (size < 0) {
+                if (errno == EINTR) {
+                    continue;
                 }
-            }   break;
-            case Z21_DataSet::DataSet::LAN_GET_BROADCASTFLAGS: {
-                LanGetBroadcastFlags* bf = static_cast<LanGetBroadcastFlags*>(dataset);
-                BOOST_LOG_TRIVIAL(debug) << " ---> LAN_GET_BROADCASTFLAGS: " << std::hex << (int)bf->flags;
-            } break;
-            case Z21_DataSet::DataSet::LAN_GET_LOCOMODE: {
-                LanGetLocomode* lm = static_cast<LanGetLocomode*>(dataset);
-                BOOST_LOG_TRIVIAL(debug) << " ---> LAN_GET_LOCOMODE: " << std::hex << (int)lm->address << " = " <<
-                                                                                    (lm->mode == Locomode::DCC ? "DCC" : "MM");
-            } break;
-            case Z21_DataSet::DataSet::LAN_GET_TURNOUTMODE: {
-                LanGetTurnoutmode* lm = static_cast<LanGetTurnoutmode*>(dataset);
-                BOOST_LOG_TRIVIAL(debug) << " ---> LAN_GET_TURNOUTMODE: " << std::hex << (int)lm->address << " = " << (int)static_cast<uint8_t>(lm->mode);
-            } break;
-            case Z21_DataSet::DataSet::LAN_SYSTEMSTATE_DATACHANGED: {
-                LanSystemstateDatachanged* ss = static_cast<LanSystemstateDatachanged*>(dataset);
-                m_z21_status.track.main_current = ss->main_current;
-                m_z21_status.track.prog_current = ss->prog_current;
-                m_z21_status.track.filtered_main_current = ss->filtered_main_current;
-                m_z21_status.track.supply_voltage = ss->supply_voltage;
-                m_z21_status.track.vcc_voltage = ss->vcc_voltage;
-                m_z21_status.temperature = ss->temperature;
-                m_z21_status.central_state = ss->central_state;
-                m_z21_status.central_state_ex = ss->central_state_ex;
-                m_z21_status.capabilities = ss->capabilities;
-
-                m_z21_status.mode.emergency_stop = ss->emergency_stop;
-                m_z21_status.mode.track_voltage_off = ss->track_voltage_off;
-                m_z21_status.mode.short_cirtcuit = ss->short_cirtcuit;
-                m_z21_status.mode.programming_mode = ss->programming_mode;
-
-            }   break;
-            default:
                 break;
+            }
+            ReceiveControl control = receive_control(header);
+            update_max(kernel_drops, control.drops);
+            if (static_cast<size_t>(size) > recv_scratch.size()) {
+                datagrams_truncated.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            datagrams++;
+            dispatch_scratch(size, control.timestamp);
         }
     }
+
+    receive_syscalls.fetch_add(syscalls, std::memory_order_relaxed);
+    update_max(max_datagrams_per_syscall, datagrams);
+    receive_cpu_ns.fetch_add((thread_cpu_time() - cpu_start).count(), std::memory_order_relaxed);
+
+    start_receive();
 }
 
-void Z21::handle_lanx_command(LanX_Command* command)
+size_t Z21::prepare_receive_batch()
 {
-    switch (command->id)
-    {
-        case LanXCommands::LAN_X_TURNOUT_INFO:
-            BOOST_LOG_TRIVIAL(debug) << " ### LAN_X_TURNOUT_INFO";
-            break;
-        case LanXCommands::LAN_X_EXT_ACCESSORY_INFO:
-            BOOST_LOG_TRIVIAL(debug) << " ### LAN_X_EXT_ACCESSORY_INFO";
+    size_t count = 0;
+    for (; count < recv_batch.size(); count++) {
+        if (!recv_batch[count]) {
+            recv_batch[count] = receive_pool.acquire();
+            if (!recv_batch[count]) {
+                break;
+            }
+        }
+
+        std::span<uint8_t> storage = recv_batch[count].storage();
+        std::span<uint8_t> control = recv_batch[count].control();
+        recv_batch_buffers[count] = iovec{storage.data(), storage.size()};
+        // The kernel shrinks msg_controllen to what it wrote, so it is reset for every call.
+        recv_batch_messages[count].msg_hdr.msg_control = control.data();
+        recv_batch_messages[count].msg_hdr.msg_controllen = receive_control_size;
+    }
+
+    if (count == 0) {
+        receive_pool_exhausted.fetch_add(1, std::memory_order_relaxed);
+        recv_batch_buffers[0] = iovec{recv_scratch.data(), recv_scratch.size()};
+        recv_batch_messages[0].msg_hdr.msg_control = recv_scratch_control.data();
+        recv_batch_messages[0].msg_hdr.msg_controllen = recv_scratch_control.size();
+        return 1;
+    }
+    return count;
+}
+
+void Z21::dispatch_scratch(size_t size, ReceiveTimestamp timestamp)
+{
+    if (config.pipelined) {
+        // The scratch buffer is reused by the next receive, so cannot be passed on.
+        pipeline_drops.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    handle_datagram(std::span<const uint8_t>(recv_scratch.data(), size), {}, timestamp);
+}
+
+void Z21::dispatch_datagram(ReceiveBufferPool::Buffer buffer)
+{
+    if (!config.pipelined) {
+        handle_datagram(buffer.bytes(), buffer, buffer.timestamp());
+        return;
+    }
+
+    if (!decode_ring.push(ReceivedDatagram{std::move(buffer), Z21_DatagramBatcher::clock::now()})) {
+        pipeline_drops.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    update_max(max_pipeline_depth, decode_ring.size());
+    decode_wakeups.fetch_add(1, std::memory_order_release);
+    decode_wakeups.notify_one();
+}
+
+void Z21::handle_datagram(std::span<const uint8_t> datagram, const ReceiveBufferPool::Buffer& buffer, ReceiveTimestamp timestamp)
+{
+    datagrams_received.fetch_add(1, std::memory_order_relaxed);
+    bytes_received.fetch_add(datagram.size(), std::memory_order_relaxed);
+    if (buffer && datagram_handler) {
+        datagram_handler(buffer);
+    }
+
+    size_t pos = 0;
+    while (datagram.size() - pos >= header_size) {
+        uint16_t size = datagram[pos] | (datagram[pos + 1] << 8);
+        uint16_t id = datagram[pos + 2] | (datagram[pos + 3] << 8);
+        if (size < header_size || size > datagram.size() - pos) {
+            BOOST_LOG_TRIVIAL(error) << "Bad DataSet size " << size << " in datagram of " << datagram.size() << " bytes";
             break;
-        case LanXCommands::LAN_X_BC_TRACK_POWER_OFF:
+        }
+
+        datasets_received.fetch_add(1, std::memory_order_relaxed);
+        handle_dataset(size, id, datagram.subspan(pos + header_size, size - header_size), timestamp);
+        pos += size;
+    }
+}
+
+// Handlers for all received DataSets and commands.
+void Z21::handle_dataset(uint16_t size, uint16_t id, std::span<const uint8_t> data, ReceiveTimestamp timestamp)
+{
+    BOOST_LOG_TRIVIAL(debug) << "Received for ID " << std::hex << (int)id << ": " << PRINT_HEX(boost::make_iterator_range(data.begin(), data.end()));
+    Z21Message message = decode_dataset(id, data);
+    if (std::holds_alternative<std::monostate>(message)) {
+        BOOST_LOG_TRIVIAL(debug) << "Unknown or malformed DataSet " << std::hex << (int)id;
+    }
+    else if (message_handler) {
+        message_handler(message, timestamp);
+    }
+    handle_message(message, timestamp);
+}
+
+void Z21::handle_message(const Z21Message& message, ReceiveTimestamp timestamp)
+{
+    bool status_changed = false;
+    std::visit(Overloaded{
+        [this, &status_changed](const message::SerialNumber& serial_number) {
+            m_z21_status.id.serial_number = serial_number.serial_number;
+            status_changed = true;
+        },
+        [this, &status_changed](const message::Code& code) {
+            m_z21_status.id.feature_set = static_cast<Z21FeatureSet>(code.code);
+            status_changed = true;
+            BOOST_LOG_TRIVIAL(debug) << " ---> LAN_GET_CODE: " << (int) m_z21_status.id.feature_set;
+        },
+        [this, &status_changed](const message::HWInfo& hw_info) {
+            m_z21_status.id.hw_type = hw_info.hw_type;
+            m_z21_status.id.set_fw_version(hw_info.fw_version());
+            status_changed = true;
+        },
+        [](const message::BroadcastFlags& flags) {
+            BOOST_LOG_TRIVIAL(debug) << " ---> LAN_GET_BROADCASTFLAGS: " << std::hex << (int)flags.flags;
+        },
+        [](const message::LocoMode& mode) {
+            BOOST_LOG_TRIVIAL(debug) << " ---> LAN_GET_LOCOMODE: " << std::hex << (int)mode.address << " = " <<
+                                                                                (mode.mode == Locomode::DCC ? "DCC" : "MM");
+        },
+        [](const message::TurnoutMode& mode) {
+            BOOST_LOG_TRIVIAL(debug) << " ---> LAN_GET_TURNOUTMODE: " << std::hex << (int)mode.address << " = " << (int)static_cast<uint8_t>(mode.mode);
+        },
+        [this, &status_changed](const message::SystemState& state) {
+            m_z21_status.track.main_current = state.main_current;
+            m_z21_status.track.prog_current = state.prog_current;
+            m_z21_status.track.filtered_main_current = state.filtered_main_current;
+            m_z21_status.track.supply_voltage = state.supply_voltage;
+            m_z21_status.track.vcc_voltage = state.vcc_voltage;
+            m_z21_status.temperature = state.temperature;
+            m_z21_status.central_state = state.central_state;
+            m_z21_status.central_state_ex = state.central_state_ex;
+            m_z21_status.capabilities = state.capabilities;
+
+            m_z21_status.mode.emergency_stop = state.emergency_stop;
+            m_z21_status.mode.track_voltage_off = state.track_voltage_off;
+            m_z21_status.mode.short_cirtcuit = state.short_circuit;
+            m_z21_status.mode.programming_mode = state.programming_mode;
+            status_changed = true;
+        },
+        [this, timestamp](const message::TurnoutInfo& info) {
+            if (!m_accessory_states.update(info)) {
+                return;
+            }
+            m_changes.record(StateChange::TURNOUT, info.address);
+            if (m_events.wanted<event::AccessoryChanged>()) {
+                // As stored, with a status that cannot be decoded as NOT_SWITCHED.
+                m_events.publish(event::AccessoryChanged{event::AccessoryChanged::TURNOUT, info.address,
+                                                         static_cast<uint8_t>(m_accessory_states.turnout(info.address)),
+                                                         true, timestamp});
+            }
+        },
+        [this, timestamp](const message::ExtAccessoryInfo& info) {
+            if (!m_accessory_states.update(info)) {
+                return;
+            }
+            m_changes.record(StateChange::EXT_ACCESSORY, info.address);
+            if (m_events.wanted<event::AccessoryChanged>()) {
+                std::optional<uint8_t> state = m_accessory_states.ext_accessory(info.address);
+                m_events.publish(event::AccessoryChanged{event::AccessoryChanged::EXT_ACCESSORY, info.address,
+                                                         state.value_or(0), state.has_value(), timestamp});
+            }
+        },
+        [this, &status_changed](const message::TrackPowerOff&) {
             m_z21_status.mode.track_voltage_off = true;
-            break;
-        case LanXCommands::LAN_X_BC_TRACK_POWER_ON:
+            status_changed = true;
+        },
+        [this, &status_changed](const message::TrackPowerOn&) {
             m_z21_status.mode.track_voltage_off = false;
-            break;
-        case LanXCommands::LAN_X_BC_PROGRAMMING_MODE:
+            status_changed = true;
+        },
+        [this, &status_changed](const message::ProgrammingMode&) {
             m_z21_status.mode.programming_mode = true;
-            break;
-        case LanXCommands::LAN_X_BC_TRACK_SHORT_CIRCUIT:
+            status_changed = true;
+        },
+        [this, &status_changed](const message::TrackShortCircuit&) {
             m_z21_status.mode.short_cirtcuit = true;
-            break;
-        case LanXCommands::LAN_X_CV_NACK_SC:
+            status_changed = true;
+        },
+        [this, timestamp](const message::CvNackShortCircuit&) {
             BOOST_LOG_TRIVIAL(debug) << " ### LAN_X_CV_NACK_SC";
-            break;
-        case LanXCommands::LAN_X_CV_NACK:
+            if (m_events.wanted<event::CvResult>()) {
+                m_events.publish(event::CvResult{event::CvResult::NACK_SHORT_CIRCUIT, 0, 0, timestamp});
+            }
+        },
+        [this, timestamp](const message::CvNack&) {
             BOOST_LOG_TRIVIAL(debug) << " ### LAN_X_CV_NACK";
-            break;
-        case LanXCommands::LAN_X_UNKNOWN_COMMAND:
+            if (m_events.wanted<event::CvResult>()) {
+                m_events.publish(event::CvResult{event::CvResult::NACK, 0, 0, timestamp});
+            }
+        },
+        [this, &status_changed](const message::UnknownCommand&) {
             m_z21_status.mode.invalid_request = true;
-            break;
-        case LanXCommands::LAN_X_STATUS_CHANGED:
+            status_changed = true;
+            rate_feedback(0, true);
+        },
+        [](const message::StatusChanged&) {
             BOOST_LOG_TRIVIAL(debug) << " ### LAN_X_STATUS_CHANGED";
-            break;
-        case LanXCommands::LAN_X_GET_VERSION_RESPONSE:
+        },
+        [](const message::VersionResponse&) {
             BOOST_LOG_TRIVIAL(debug) << " ### LAN_X_GET_VERSION_RESPONSE";
-            break;
-        case LanXCommands::LAN_X_CV_RESULT:
+        },
+        [this, timestamp](const message::CvResult& result) {
             BOOST_LOG_TRIVIAL(debug) << " ### LAN_X_CV_RESULT";
-            break;
-        case LanXCommands::LAN_X_BC_STOPPED:
+            if (m_events.wanted<event::CvResult>()) {
+                m_events.publish(event::CvResult{event::CvResult::OK, result.cv, result.value, timestamp});
+            }
+        },
+        [this, &status_changed](const message::Stopped&) {
             m_z21_status.mode.emergency_stop = true;
+            status_changed = true;
+        },
+        [this, timestamp](const message::LocoInfo& info) {
+            if (info.address <= LocoStateTable::max_address) {
+                std::optional<LocoState> previous = m_loco_states.get(info.address);
+                LocoFunctions changed_functions = m_loco_states.update(info, timestamp);
+                if (auto change = loco_change(previous, info, changed_functions, timestamp)) {
+                    m_changes.record(StateChange::LOCO, info.address);
+                    if (m_events.wanted<event::LocoChanged>()) {
+                        m_events.publish(*change);
+                    }
+                }
+            }
+            rate_feedback(info.address, false);
+        },
+        [this, &status_changed](const message::FirmwareVersion& version) {
+            m_z21_status.id.set_fw_version(version.version());
+            status_changed = true;
+        },
+        [](const std::monostate&) {
+        },
+    }, message);
+
+    if (status_changed) {
+        m_z21_status.updated = timestamp;
+        Z21Status previous = m_status_snapshot.load();
+        m_status_snapshot.store(m_z21_status);
+
+        // Repeated broadcasts of the same status are not a change for pollers or subscribers.
+        previous.updated = timestamp;
+        if (previous != m_z21_status) {
+            m_changes.record(StateChange::SYSTEM_STATE, 0);
+            if (m_events.wanted<event::SystemStateChanged>() || m_events.wanted<event::PowerChanged>()) {
+                publish_status_changes(previous, timestamp);
+            }
+        }
+    }
+}
+
+void Z21::publish_status_changes(const Z21Status& previous, ReceiveTimestamp timestamp)
+{
+    const Z21Status& current = m_z21_status;
+
+    if (m_events.wanted<event::SystemStateChanged>()) {
+        event::SystemStateChanged change;
+        bool changed = false;
+        set_changed(change.main_current, previous.track.main_current, current.track.main_current, changed);
+        set_changed(change.prog_current, previous.track.prog_current, current.track.prog_current, changed);
+        set_changed(change.filtered_main_current, previous.track.filtered_main_current,
+                    current.track.filtered_main_current, changed);
+        set_changed(change.temperature, previous.temperature, current.temperature, changed);
+        set_changed(change.supply_voltage, previous.track.supply_voltage, current.track.supply_voltage, changed);
+        set_changed(change.vcc_voltage, previous.track.vcc_voltage, current.track.vcc_voltage, changed);
+        set_changed(change.central_state, previous.central_state, current.central_state, changed);
+        set_changed(change.central_state_ex, previous.central_state_ex, current.central_state_ex, changed);
+        set_changed(change.capabilities, previous.capabilities, current.capabilities, changed);
+        if (changed) {
+            change.timestamp = timestamp;
+            m_events.publish(change);
+        }
+    }
+
+    if (m_events.wanted<event::PowerChanged>()) {
+        event::PowerChanged change;
+        bool changed = false;
+        set_changed(change.track_voltage_off, previous.mode.track_voltage_off, current.mode.track_voltage_off, changed);
+        set_changed(change.emergency_stop, previous.mode.emergency_stop, current.mode.emergency_stop, changed);
+        set_changed(change.short_circuit, previous.mode.short_cirtcuit, current.mode.short_cirtcuit, changed);
+        set_changed(change.programming_mode, previous.mode.programming_mode, current.mode.programming_mode, changed);
+        if (changed) {
+            change.timestamp = timestamp;
+            m_events.publish(change);
+        }
+    }
+}
+
+void Z21::rate_feedback(uint16_t address, bool unknown_command)
+{
+    auto now = SendRateController::clock::now();
+    if (handles_off_listener()) {
+        // The rate controller belongs to the listener thread. Lost feedback only counts as a lost echo.
+        if (rate_feedback_ring.push(RateFeedback{address, unknown_command, now})) {
+            schedule_drain();
+        }
+        return;
+    }
+
+    if (unknown_command) {
+        rate_controller.on_unknown_command(now);
+    }
+    else {
+        rate_controller.on_loco_info(address, now);
+    }
+}
+
+Z21SendStats Z21::send_stats() const
+{
+    Z21SendStats stats;
+    stats.datagrams_sent = datagrams_sent.load(std::memory_order_relaxed);
+    stats.datasets_sent = datasets_sent.load(std::memory_order_relaxed);
+    stats.max_datasets_per_datagram = max_datasets_per_datagram.load(std::memory_order_relaxed);
+    stats.send_syscalls = send_syscalls.load(std::memory_order_relaxed);
+    stats.send_errors = send_errors.load(std::memory_order_relaxed);
+    stats.total_send_latency = std::chrono::nanoseconds(total_send_latency_ns.load(std::memory_order_relaxed));
+    stats.max_send_latency = std::chrono::nanoseconds(max_send_latency_ns.load(std::memory_order_relaxed));
+    stats.send_queue_depth = send_queue.size();
+    stats.max_send_queue_depth = max_send_queue_depth.load(std::memory_order_relaxed);
+    stats.bulk_queue_depth = bulk_queue.size();
+    stats.max_bulk_queue_depth = max_bulk_queue_depth.load(std::memory_order_relaxed);
+    stats.emergency_datasets_sent = emergency_datasets_sent.load(std::memory_order_relaxed);
+    stats.send_queue_drops = send_queue_drops.load(std::memory_order_relaxed);
+    stats.loco_commands_superseded = loco_commands_superseded.load(std::memory_order_relaxed);
+    stats.emergency_superseded = emergency_superseded.load(std::memory_order_relaxed);
+    stats.socket_send_buffer = socket_send_buffer;
+    stats.rate_control = rate_controller.stats();
+    return stats;
+}
+
+Z21ReceiveStats Z21::receive_stats() const
+{
+    Z21ReceiveStats stats;
+    stats.datagrams_received = datagrams_received.load(std::memory_order_relaxed);
+    stats.bytes_received = bytes_received.load(std::memory_order_relaxed);
+    stats.kernel_drops = kernel_drops.load(std::memory_order_relaxed);
+    stats.socket_receive_buffer = socket_receive_buffer;
+    stats.datasets_received = datasets_received.load(std::memory_order_relaxed);
+    stats.receive_syscalls = receive_syscalls.load(std::memory_order_relaxed);
+    stats.max_datagrams_per_syscall = max_datagrams_per_syscall.load(std::memory_order_relaxed);
+    stats.receive_wakeups = receive_wakeups.load(std::memory_order_relaxed);
+    if (busy_poll_active.load(std::memory_order_relaxed)) {
+        stats.receive_backend = ReceiveBackend::BUSY_POLL;
+    }
+    else if (uring_active.load(std::memory_order_relaxed)) {
+        stats.receive_backend = ReceiveBackend::IO_URING;
+    }
+    stats.datagrams_truncated = datagrams_truncated.load(std::memory_order_relaxed);
+    stats.receive_pool_exhausted = receive_pool_exhausted.load(std::memory_order_relaxed);
+    stats.receive_buffers_in_use = ReceiveBufferPool::pool_size - receive_pool.available();
+    stats.pipeline_depth = decode_ring.size();
+    stats.max_pipeline_depth = max_pipeline_depth.load(std::memory_order_relaxed);
+    stats.pipeline_drops = pipeline_drops.load(std::memory_order_relaxed);
+    stats.total_pipeline_latency = std::chrono::nanoseconds(total_pipeline_latency_ns.load(std::memory_order_relaxed));
+    stats.max_pipeline_latency = std::chrono::nanoseconds(max_pipeline_latency_ns.load(std::memory_order_relaxed));
+    stats.decode_time = std::chrono::nanoseconds(decode_ns.load(std::memory_order_relaxed));
+    stats.receive_cpu_time = std::chrono::nanoseconds(receive_cpu_ns.load(std::memory_order_relaxed));
+    stats.events_published = m_events.published();
+    stats.event_drops = m_events.dropped();
+    return stats;
+}
+
+size_t Z21::submit(std::span<const LanX_Command* const> commands, std::span<SubmitStatus> status)
+{
+    size_t queued = 0;
+    for (size_t i = 0; i < commands.size(); i++) {
+        Z21_Frame frame = LanX::pack_command(*commands[i]);
+        SubmitStatus result = frame.size > 0 ? enqueue(frame, priority_of(commands[i]->id)) : SubmitStatus::INVALID;
+        if (result == SubmitStatus::QUEUED) {
+            queued++;
+        }
+        if (i < status.size()) {
+            status[i] = result;
+        }
+    }
+
+    if (queued > 0) {
+        schedule_drain();
+    }
+    return queued;
+}
+
+void Z21::send(const Z21_DataSet& dataset, SendPriority priority)
+{
+    if (enqueue(dataset.frame(), priority) == SubmitStatus::QUEUED) {
+        schedule_drain();
+    }
+}
+
+SubmitStatus Z21::enqueue(const Z21_Frame& frame, SendPriority priority)
+{
+    OutboundFrame outbound{frame, Z21_DatagramBatcher::clock::now(), loco_slots.sequence()};
+    bool queued = false;
+    switch (priority) {
+        case SendPriority::EMERGENCY:
+            queued = emergency_queue.push(outbound);
             break;
-        case LanXCommands::LAN_X_LOCO_INFO:
-            BOOST_LOG_TRIVIAL(debug) << " ### LAN_X_LOCO_INFO";
+        case SendPriority::INTERACTIVE:
+            queued = send_queue.push(outbound);
+            update_max(max_send_queue_depth, send_queue.size());
             break;
-        case LanXCommands::LAN_X_GET_FIRMWARE_VERSION_RESPONSE: {
-            LanX_GetFirmwareVersionResponse* lanx_command = static_cast<LanX_GetFirmwareVersionResponse*>(command);
-            m_z21_status.id.fw_version = lanx_command->fw_version;
-        } break;
-        default:
+        case SendPriority::BULK:
+            queued = bulk_queue.push(outbound);
+            update_max(max_bulk_queue_depth, bulk_queue.size());
             break;
     }
+
+    if (!queued) {
+        send_queue_drops.fetch_add(1, std::memory_order_relaxed);
+        return SubmitStatus::QUEUE_FULL;
+    }
+    return SubmitStatus::QUEUED;
+}
+
+void Z21::send_loco_slot(uint16_t address, uint8_t slot, uint8_t value)
+{
+    if (!loco_slots.store(address, slot, value)) {
+        loco_commands_superseded.fetch_add(1, std::memory_order_relaxed);
+    }
+    schedule_drain();
+}
+
+void Z21::schedule_drain()
+{
+    // Only post a drain if none is pending, the pending one will pick up this request as well.
+    if (!drain_scheduled.exchange(true)) {
+        boost::asio::post(io_context, make_allocating_handler(drain_handler_memory, [this]() { drain_send_queue(); }));
+    }
+}
+
+void Z21::drain_send_queue()
+{
+    // Cleared before taking, so a request made after the last take below always schedules a new drain.
+    drain_scheduled.store(false);
+
+    // Emergency DataSets get a datagram of their own, sent right away ahead of all others.
+    OutboundFrame outbound;
+    bool emergency = false;
+    while (emergency_datagram.datasets() < emergency_queue_size && emergency_queue.pop(outbound)) {
+        emergency_datagram.append(outbound.frame.bytes(), outbound.queued);
+        emergency = true;
+    }
+    if (emergency) {
+        drop_superseded(outbound.queued, outbound.loco_sequence);
+    }
+    flush_datagrams();
+
+    if (has_pending_frame && append_frame(pending_frame.frame.bytes(), pending_frame.queued)) {
+        has_pending_frame = false;
+    }
+
+    RateFeedback feedback;
+    while (rate_feedback_ring.pop(feedback)) {
+        if (feedback.unknown_command) {
+            rate_controller.on_unknown_command(feedback.time);
+        }
+        else {
+            rate_controller.on_loco_info(feedback.address, feedback.time);
+        }
+    }
+
+    auto now = Z21_DatagramBatcher::clock::now();
+    rate_controller.expire(now);
+
+    loco_slots.take([this, now](uint16_t address, uint8_t slot, uint8_t value) {
+        if (!may_send(now)) {
+            return false;
+        }
+
+        if (!append_frame(loco_frames.frame(address, slot, value), loco_slots.pending_since(address, slot))) {
+            return false;
+        }
+        rate_controller.on_sent();
+        rate_controller.on_loco_command(address, now);
+        return true;
+    });
+
+    while (!has_pending_frame && may_send(now) && send_queue.pop(outbound)) {
+        if (outbound.queued <= superseded_before && undoes_stop(outbound.frame.bytes())) {
+            emergency_superseded.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        rate_controller.on_sent();
+        if (!append_frame(outbound.frame.bytes(), outbound.queued)) {
+            // All datagrams are waiting for the socket. Keep the DataSet, it is retried first on the next drain.
+            pending_frame = outbound;
+            has_pending_frame = true;
+            break;
+        }
+    }
+
+    if (!has_pending_frame) {
+        drain_bulk_queue();
+    }
+
+    if (datagrams_sealed < datagrams.size() && !filling_datagram().empty()) {
+        auto deadline = filling_datagram().first_append() + config.send_window;
+        if (deadline <= Z21_DatagramBatcher::clock::now()) {
+            seal_datagram();
+        }
+        else if (!batch_timer_armed) {
+            batch_timer_armed = true;
+            batch_timer.expires_at(deadline);
+            batch_timer.async_wait(make_allocating_handler(timer_handler_memory, [this](const boost::system::error_code& error) {
+                handle_batch_timer(error);
+            }));
+        }
+    }
+
+    flush_datagrams();
+}
+
+void Z21::drain_bulk_queue()
+{
+    auto interval = std::chrono::duration_cast<Z21_DatagramBatcher::clock::duration>(
+            std::chrono::duration<double>(config.bulk_rate > 0 ? 1.0 / config.bulk_rate : 0.0));
+
+    // Bulk DataSets never queue up behind more than the datagram in flight, so interactive DataSets
+    // arriving meanwhile do not have to wait long.
+    while (datagrams_sealed < 2) {
+        auto now = Z21_DatagramBatcher::clock::now();
+        if (now < next_bulk_send) {
+            if (!bulk_timer_armed && (has_pending_bulk_frame || bulk_queue.size() > 0)) {
+                bulk_timer_armed = true;
+                bulk_timer.expires_at(next_bulk_send);
+                bulk_timer.async_wait(make_allocating_handler(bulk_timer_handler_memory, [this](const boost::system::error_code& error) {
+                    handle_bulk_timer(error);
+                }));
+            }
+            return;
+        }
+
+        if (!has_pending_bulk_frame) {
+            if (!may_send(now) || !bulk_queue.pop(pending_bulk_frame)) {
+                return;
+            }
+            rate_controller.on_sent();
+            has_pending_bulk_frame = true;
+        }
+
+        // All datagrams are waiting for the socket. Keep the DataSet, it is retried first on the next drain.
+        if (!append_frame(pending_bulk_frame.frame.bytes(), pending_bulk_frame.queued)) {
+            return;
+        }
+        has_pending_bulk_frame = false;
+        next_bulk_send = now + interval;
+    }
+}
+
+bool Z21::may_send(Z21_DatagramBatcher::clock::time_point now)
+{
+    if (rate_controller.can_send(now)) {
+        return true;
+    }
+
+    if (!rate_timer_armed) {
+        rate_timer_armed = true;
+        rate_timer.expires_at(rate_controller.next_send());
+        rate_timer.async_wait(make_allocating_handler(rate_timer_handler_memory, [this](const boost::system::error_code& error) {
+            handle_rate_timer(error);
+        }));
+    }
+    return false;
+}
+
+bool Z21::append_frame(std::span<const uint8_t> frame, Z21_DatagramBatcher::clock::time_point queued)
+{
+    if (filling_datagram().append(frame, queued)) {
+        return true;
+    }
+
+    seal_datagram();
+    if (datagrams_sealed == datagrams.size()) {
+        flush_datagrams();
+    }
+    return datagrams_sealed < datagrams.size() && filling_datagram().append(frame, queued);
+}
+
+void Z21::drop_superseded(Z21_DatagramBatcher::clock::time_point queued, uint32_t loco_sequence)
+{
+    uint64_t dropped = 0;
+
+    // Interactive DataSets still queued are checked against this as they are taken.
+    superseded_before = queued;
+
+    // Packed datagrams only hold DataSets taken before the emergency one was. Repack what is kept from the
+    // first unsent datagram on, which never gets ahead of the datagram being read since less is kept.
+    std::array<uint8_t, Z21_DatagramBatcher::max_datagram_size> packed;
+    size_t unsent = std::min(datagrams_sealed + 1, datagrams.size());
+    size_t repacked = 0;
+    for (size_t i = 0; i < unsent; i++) {
+        Z21_DatagramBatcher& datagram = datagrams[(datagram_head + i) % datagrams.size()];
+        std::span<const uint8_t> bytes = datagram.datagram();
+        std::copy(bytes.begin(), bytes.end(), packed.begin());
+        size_t size = bytes.size();
+        auto first_append = datagram.first_append();
+        datagram.clear();
+
+        size_t frame_size;
+        for (size_t pos = 0; pos + header_size <= size; pos += frame_size) {
+            frame_size = packed[pos] | packed[pos + 1] << 8;
+            std::span<const uint8_t> frame(packed.data() + pos, frame_size);
+            if (undoes_stop(frame)) {
+                dropped++;
+                continue;
+            }
+            if (!datagrams[(datagram_head + repacked) % datagrams.size()].append(frame, first_append)) {
+                repacked++;
+                datagrams[(datagram_head + repacked) % datagrams.size()].append(frame, first_append);
+            }
+        }
+    }
+
+    // All but the last repacked datagram are sealed, the last one is filled on.
+    datagrams_sealed = repacked;
+
+    if (has_pending_frame && pending_frame.queued <= queued && undoes_stop(pending_frame.frame.bytes())) {
+        has_pending_frame = false;
+        dropped++;
+    }
+
+    dropped += loco_slots.discard(loco_sequence);
+
+    emergency_superseded.fetch_add(dropped, std::memory_order_relaxed);
+}
+
+void Z21::seal_datagram()
+{
+    if (filling_datagram().empty()) {
+        return;
+    }
+
+    datagrams_sealed++;
+}
+
+void Z21::flush_datagrams()
+{
+    constexpr size_t max_messages = 1 + std::tuple_size_v<decltype(datagrams)>;
+    std::array<mmsghdr, max_messages> messages;
+    std::array<iovec, max_messages> buffers;
+
+    while (!send_blocked) {
+        // The emergency datagram goes first, then sealed datagrams oldest first.
+        size_t count = 0;
+        auto add = [&](const Z21_DatagramBatcher& datagram) {
+            std::span<const uint8_t> bytes = datagram.datagram();
+            buffers[count] = iovec{const_cast<uint8_t*>(bytes.data()), bytes.size()};
+            messages[count] = mmsghdr{};
+            messages[count].msg_hdr.msg_name = receiver_endpoint.data();
+            messages[count].msg_hdr.msg_namelen = receiver_endpoint.size();
+            messages[count].msg_hdr.msg_iov = &buffers[count];
+            messages[count].msg_hdr.msg_iovlen = 1;
+            count++;
+        };
+
+        if (!emergency_datagram.empty()) {
+            add(emergency_datagram);
+        }
+        for (size_t i = 0; i < datagrams_sealed; i++) {
+            add(datagrams[(datagram_head + i) % datagrams.size()]);
+        }
+        if (count == 0) {
+            return;
+        }
+
+        int sent = ::sendmmsg(socket.native_handle(), messages.data(), count, MSG_DONTWAIT);
+        send_syscalls.fetch_add(1, std::memory_order_relaxed);
+        if (sent > 0) {
+            complete_datagrams(sent, true);
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            send_blocked = true;
+            socket.async_wait(udp::socket::wait_write, make_allocating_handler(send_handler_memory, [this](const boost::system::error_code& error) {
+                handle_writable(error);
+            }));
+        }
+        else if (errno != EINTR) {
+            // Drop the datagram the socket fails on, so it does not hold up the rest.
+            BOOST_LOG_TRIVIAL(error) << "Failed sending datagram: " << std::strerror(errno);
+            complete_datagrams(1, false);
+        }
+    }
+}
+
+void Z21::complete_datagrams(size_t count, bool sent)
+{
+    auto now = Z21_DatagramBatcher::clock::now();
+    for (size_t i = 0; i < count; i++) {
+        bool emergency = !emergency_datagram.empty();
+        Z21_DatagramBatcher& datagram = emergency ? emergency_datagram : datagrams[datagram_head];
+
+        if (sent) {
+            auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(now - datagram.first_append());
+            datagrams_sent.fetch_add(1, std::memory_order_relaxed);
+            datasets_sent.fetch_add(datagram.datasets(), std::memory_order_relaxed);
+            total_send_latency_ns.fetch_add(latency.count(), std::memory_order_relaxed);
+            update_max(max_datasets_per_datagram, datagram.datasets());
+            update_max(max_send_latency_ns, latency.count());
+            if (emergency) {
+                emergency_datasets_sent.fetch_add(datagram.datasets(), std::memory_order_relaxed);
+            }
+        }
+        else {
+            send_errors.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        datagram.clear();
+        if (!emergency) {
+            datagram_head = (datagram_head + 1) % datagrams.size();
+            datagrams_sealed--;
+        }
+    }
+}
+
+void Z21::handle_writable(const boost::system::error_code& error)
+{
+    send_blocked = false;
+    if (!error) {
+        drain_send_queue();
+    }
+}
+
+void Z21::handle_batch_timer(const boost::system::error_code& error)
+{
+    batch_timer_armed = false;
+    if (!error) {
+        drain_send_queue();
+    }
+}
+
+void Z21::handle_bulk_timer(const boost::system::error_code& error)
+{
+    bulk_timer_armed = false;
+    if (!error) {
+        drain_send_queue();
+    }
+}
+
+void Z21::handle_rate_timer(const boost::system::error_code& error)
+{
+    rate_timer_armed = false;
+    if (!error) {
+        drain_send_queue();
+    }
 }
 
 void Z21::get_serial_number()
 {
-    socket.send_to(boost::asio::buffer(LanGetSerialNumber().pack()), receiver_endpoint);
+    send(LanGetSerialNumber(), SendPriority::BULK);
 }
 
 void Z21::get_feature_set()
 {
-    socket.send_to(boost::asio::buffer(LanGetCode().pack()), receiver_endpoint);
+    send(LanGetCode(), SendPriority::BULK);
 }
 
 void Z21::get_hardware_info()
 {
-    socket.send_to(boost::asio::buffer(LanGetHWInfo().pack()), receiver_endpoint);
+    send(LanGetHWInfo(), SendPriority::BULK);
 }
 
 void Z21::logoff()
 {
-    socket.send_to(boost::asio::buffer(LanLogoff().pack()), receiver_endpoint);
+    send(LanLogoff());
 }
 
 void Z21::xbus_get_version()
 {
     LanX_GetVersion lanx_command;
-    socket.send_to(boost::asio::buffer(LanX(&lanx_command).pack()), receiver_endpoint);
+    send(LanX(&lanx_command), SendPriority::BULK);
 }
 
 void Z21::xbus_get_status()
 {
     LanX_GetStatus lanx_command;
-    socket.send_to(boost::asio::buffer(LanX(&lanx_command).pack()), receiver_endpoint);
+    send(LanX(&lanx_command), SendPriority::BULK);
 }
 
 void Z21::xbus_set_track_power_off()
 {
     LanX_SetTrackPowerOff lanx_command;
-    socket.send_to(boost::asio::buffer(LanX(&lanx_command).pack()), receiver_endpoint);
+    send(LanX(&lanx_command), SendPriority::EMERGENCY);
 }
 
 void Z21::xbus_set_track_power_on()
 {
     LanX_SetTrackPowerOn lanx_command;
-    socket.send_to(boost::asio::buffer(LanX(&lanx_command).pack()), receiver_endpoint);
+    send(LanX(&lanx_command));
 }
 
 void Z21::xbus_dcc_read_register(uint8_t reg)
 {
     LanX_DccReadRegister lanx_command(reg);
-    socket.send_to(boost::asio::buffer(LanX(&lanx_command).pack()), receiver_endpoint);
+    send(LanX(&lanx_command), SendPriority::BULK);
 }
 
 void Z21::xbus_cv_read(uint16_t cv)
 {
     LanX_CvRead lanx_command(cv);
-    socket.send_to(boost::asio::buffer(LanX(&lanx_command).pack()), receiver_endpoint);
+    send(LanX(&lanx_command), SendPriority::BULK);
 }
 
 void Z21::xbus_dcc_write_register(uint8_t reg, uint8_t value)
 {
     LanX_DccWriteRegister lanx_command(reg, value);
-    socket.send_to(boost::asio::buffer(LanX(&lanx_command).pack()), receiver_endpoint);
+    send(LanX(&lanx_command), SendPriority::BULK);
 }
 
 void Z21::xbus_cv_write(uint16_t cv, uint8_t value)
 {
     LanX_CvWrite lanx_command(cv, value);
-    socket.send_to(boost::asio::buffer(LanX(&lanx_command).pack()), receiver_endpoint);
+    send(LanX(&lanx_command), SendPriority::BULK);
 }
 
 void Z21::xbus_mm_write_byte(uint8_t reg, uint8_t value)
 {
     LanX_MmWriteByte lanx_command(reg, value);
-    socket.send_to(boost::asio::buffer(LanX(&lanx_command).pack()), receiver_endpoint);
+    send(LanX(&lanx_command), SendPriority::BULK);
 }
 
 void Z21::xbus_get_turnout_info(uint16_t address)
 {
     LanX_GetTurnoutInfo lanx_command(address);
-    socket.send_to(boost::asio::buffer(LanX(&lanx_command).pack()), receiver_endpoint);
+    send(LanX(&lanx_command), SendPriority::BULK);
 }
 
 void Z21::xbus_get_ext_accessory_info(uint16_t address)
 {
     LanX_GetExtAccessoryInfo lanx_command(address);
-    socket.send_to(boost::asio::buffer(LanX(&lanx_command).pack()), receiver_endpoint);
+    send(LanX(&lanx_command), SendPriority::BULK);
 }
 
 void Z21::xbus_set_turnout(uint16_t address, uint8_t value)
 {
     LanX_SetTurnout lanx_command(address, value);
-    socket.send_to(boost::asio::buffer(LanX(&lanx_command).pack()), receiver_endpoint);
+    send(LanX(&lanx_command));
 }
 
 void Z21::xbus_set_ext_accessory(uint16_t address, uint8_t state)
 {
     LanX_SetExtAccessory lanx_command(address, state);
-    socket.send_to(boost::asio::buffer(LanX(&lanx_command).pack()), receiver_endpoint);
+    send(LanX(&lanx_command));
 }
 
 void Z21::xbus_set_stop()
 {
     LanX_SetStop lanx_command;
-    socket.send_to(boost::asio::buffer(LanX(&lanx_command).pack()), receiver_endpoint);
+    send(LanX(&lanx_command), SendPriority::EMERGENCY);
 }
 
 void Z21::xbus_get_loco_info(uint16_t address)
 {
     LanX_GetLocoInfo lanx_command(address);
-    socket.send_to(boost::asio::buffer(LanX(&lanx_command).pack()), receiver_endpoint);
+    send(LanX(&lanx_command), SendPriority::BULK);
 }
 
 void Z21::xbus_set_loco_drive(uint16_t address, uint8_t speed, bool forward)
 {
-    LanX_SetLocoDrive lanx_command(address, speed, forward);
-    socket.send_to(boost::asio::buffer(LanX(&lanx_command).pack()), receiver_endpoint);
+    if (address > LocoSlotTable::max_address) {
+        LanX_SetLocoDrive lanx_command(address, speed, forward);
+        send(LanX(&lanx_command));
+        return;
+    }
+
+    send_loco_slot(address, LocoFrameCache::drive_slot, (speed & 0x7f) + (forward ? 0x80 : 0));
 }
 
 void Z21::xbus_set_loco_function(uint16_t address, uint8_t function)
 {
     LanX_SetLocoFunction lanx_command(address, function);
-    socket.send_to(boost::asio::buffer(LanX(&lanx_command).pack()), receiver_endpoint);
+    send(LanX(&lanx_command));
 }
 
 void Z21::xbus_set_loco_function_group(uint16_t address, LanX_SetLocoFunctionGroup::FunctionGroup group, uint8_t functions)
 {
-    LanX_SetLocoFunctionGroup lanx_command(address, group, functions);
-    socket.send_to(boost::asio::buffer(LanX(&lanx_command).pack()), receiver_endpoint);
+    uint8_t slot = LocoFrameCache::function_group_slot(group);
+    if (address > LocoSlotTable::max_address || slot == LocoFrameCache::slots) {
+        LanX_SetLocoFunctionGroup lanx_command(address, group, functions);
+        send(LanX(&lanx_command));
+        return;
+    }
+
+    send_loco_slot(address, slot, functions);
 }
 
 void Z21::xbus_set_loco_binary_state(uint16_t address, bool on, uint8_t binary_address)
 {
     LanX_SetLocoBinaryState lanx_command(address, on, binary_address);
-    socket.send_to(boost::asio::buffer(LanX(&lanx_command).pack()), receiver_endpoint);
+    send(LanX(&lanx_command));
 }
 
 void Z21::xbus_cv_pom_write_byte(uint16_t address, uint16_t cv, uint8_t value)
 {
     LanX_CvPomWriteByte lanx_command(address, cv, value);
-    socket.send_to(boost::asio::buffer(LanX(&lanx_command).pack()), receiver_endpoint);
+    send(LanX(&lanx_command), SendPriority::BULK);
 }
 
 void Z21::xbus_cv_pom_write_bit(uint16_t address, uint16_t cv, uint8_t bit_position, uint8_t value)
 {
     LanX_CvPomWriteBit lanx_command(address, cv, bit_position, value);
-    socket.send_to(boost::asio::buffer(LanX(&lanx_command).pack()), receiver_endpoint);
+    send(LanX(&lanx_command), SendPriority::BULK);
 }
 
 void Z21::xbus_cv_pom_read_byte(uint16_t address, uint16_t cv)
 {
     LanX_CvPomReadByte lanx_command(address, cv);
-    socket.send_to(boost::asio::buffer(LanX(&lanx_command).pack()), receiver_endpoint);
+    send(LanX(&lanx_command), SendPriority::BULK);
 }
 
 void Z21::xbus_cv_pom_accessory_write_byte(uint16_t address, PomAccessorySelection selction, uint8_t output, uint16_t cv, uint8_t value)
 {
     LanX_CvPomAccessoryWriteByte lanx_command(address, selction, output, cv, value);
-    socket.send_to(boost::asio::buffer(LanX(&lanx_command).pack()), receiver_endpoint);
+    send(LanX(&lanx_command), SendPriority::BULK);
 }
 
 void Z21::xbus_cv_pom_accessory_write_bit(uint16_t address, PomAccessorySelection selction, uint8_t output, uint16_t cv, uint8_t bit_position, uint8_t value)
 {
     LanX_CvPomAccessoryWriteBit lanx_command(address, selction, output, cv, bit_position, value);
-    socket.send_to(boost::asio::buffer(LanX(&lanx_command).pack()), receiver_endpoint);
+    send(LanX(&lanx_command), SendPriority::BULK);
 }
 
 void Z21::xbus_cv_pom_accessory_read_byte(uint16_t address, PomAccessorySelection selction, uint8_t output, uint16_t cv)
 {
     LanX_CvPomAccessoryReadByte lanx_command(address, selction, output, cv);
-    socket.send_to(boost::asio::buffer(LanX(&lanx_command).pack()), receiver_endpoint);
+    send(LanX(&lanx_command), SendPriority::BULK);
 }
 
 void Z21::xbus_get_firmware_version()
 {
     LanX_GetFirmwareVersion lanx_command;
-    socket.send_to(boost::asio::buffer(LanX(&lanx_command).pack()), receiver_endpoint);
+    send(LanX(&lanx_command), SendPriority::BULK);
 }
 
 void Z21::set_broadcast_flags()
 {
     LanSetBroadcastFlags sbf(BroadcastFlags::DRIVING_AND_SWITCHING | BroadcastFlags::Z21_STATUS_CHANGES);
-    socket.send_to(boost::asio::buffer(sbf.pack()), receiver_endpoint);
+    send(sbf);
 }
 
 void Z21::get_broadcast_flags()
 {
-    socket.send_to(boost::asio::buffer(LanGetBroadcastFlags().pack()), receiver_endpoint);
+    send(LanGetBroadcastFlags(), SendPriority::BULK);
 }
 
 void Z21::get_loco_mode(uint16_t address)
 {
-    socket.send_to(boost::asio::buffer(LanGetLocomode(address).pack()), receiver_endpoint);
+    send(LanGetLocomode(address), SendPriority::BULK);
 }
 
 void Z21::set_loco_mode(uint16_t address, Locomode mode)
 {
-    socket.send_to(boost::asio::buffer(LanSetLocomode(address, mode).pack()), receiver_endpoint);
+    send(LanSetLocomode(address, mode));
 }
 
 void Z21::get_turnout_mode(uint16_t address)
 {
-    socket.send_to(boost::asio::buffer(LanGetTurnoutmode(address).pack()), receiver_endpoint);
+    send(LanGetTurnoutmode(address), SendPriority::BULK);
 }
 
 void Z21::set_turnout_mode(uint16_t address, Locomode mode)
 {
-    socket.send_to(boost::asio::buffer(LanSetTurnoutmode(address, mode).pack()), receiver_endpoint);
+    send(LanSetTurnoutmode(address, mode));
 }
 
 void Z21::systemstate_get_data()
 {
-    socket.send_to(boost::asio::buffer(LanSystemstateGetData().pack()), receiver_endpoint);
+    send(LanSystemstateGetData(), SendPriority::BULK);
 }
 
 
@@ -19,13 +19,33 @@
 #ifndef TRAINPP_Z21_H
 #define TRAINPP_Z21_H
 
-#include <map>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <functional>
 
 #include <boost/asio.hpp>
 #include <string>
+#include <string_view>
+#include <sys/socket.h>
 
 #include "z21_dataset.h"
+#include "z21_events.h"
+#include "z21_message.h"
+#include "z21_datagram_batcher.h"
 #include "lan_x_command.h"
+#include "mpsc_queue.h"
+#include "handler_memory.h"
+#include "receive_buffer_pool.h"
+#include "spsc_ring.h"
+#include "seqlock.h"
+#include "uring_receiver.h"
+#include "loco_slot_table.h"
+#include "loco_state_table.h"
+#include "accessory_state_table.h"
+#include "change_log.h"
+#include "loco_frame_cache.h"
+#include "send_rate_controller.h"
 
 class Z21_DataSet;
 
@@ -43,8 +63,20 @@ struct Z21Id
 {
     uint32_t serial_number{0};
     uint32_t hw_type{0};
-    std::string fw_version{};
+
+    // Firmware version text, e.g. "1.42", kept inline so the whole status is trivially copyable.
+    std::array<char, 16> fw_version_text{};
     Z21FeatureSet feature_set{Z21FeatureSet::UNKNOWN};
+
+    std::string_view fw_version() const { return fw_version_text.data(); }
+
+    void set_fw_version(std::string_view version)
+    {
+        fw_version_text.fill('\0');
+        version.copy(fw_version_text.data(), fw_version_text.size() - 1);
+    }
+
+    bool operator==(const Z21Id& other) const = default;
 };
 
 struct TrackStatus
@@ -54,6 +86,8 @@ struct TrackStatus
     int16_t filtered_main_current{0};
     uint16_t supply_voltage{0};
     uint16_t vcc_voltage{0};
+
+    bool operator==(const TrackStatus& other) const = default;
 };
 
 struct Mode
@@ -63,6 +97,8 @@ struct Mode
     bool short_cirtcuit{false};
     bool programming_mode{false};
     bool invalid_request{false};
+
+    bool operator==(const Mode& other) const = default;
 };
 
 struct Z21Status
@@ -77,16 +113,226 @@ struct Z21Status
     uint8_t capabilities{0};
 
     Mode  mode;
+
+    // Kernel receive time of the datagram that last changed the status.
+    ReceiveTimestamp updated{};
+
+    bool operator==(const Z21Status& other) const = default;
+};
+
+
+/**
+ * Send lanes, in the order the listener thread serves them.
+ */
+enum class SendPriority
+{
+    EMERGENCY,      // stop and track power off, sent ahead of everything already queued
+    INTERACTIVE,    // driving, functions, turnouts and other commands a user waits for
+    BULK,           // CV programming and info requests, only sent when nothing else is waiting
+};
+
+
+/**
+ * Outcome of a command passed to Z21::submit().
+ */
+enum class SubmitStatus
+{
+    QUEUED,         // queued in the lane of its priority
+    QUEUE_FULL,     // dropped, the queue of its lane was full
+    INVALID,        // dropped, the command does not pack into a valid DataSet
+};
+
+
+/**
+ * Ways of receiving datagrams from the Z21.
+ */
+enum class ReceiveBackend
+{
+    // Asio, waiting on epoll, with recvmmsg() (Z21Config::receive_batch).
+    ASIO,
+    // One multishot io_uring receive into buffers registered with the kernel, see UringReceiver.
+    IO_URING,
+    // A thread of its own spinning on recvmmsg() without waiting, parking in poll() when idle. Lowest
+    // latency, at the cost of a CPU while spinning.
+    BUSY_POLL,
+};
+
+
+/**
+ * Tuning of the Z21 connection.
+ */
+struct Z21Config
+{
+    // How long to hold back a DataSet waiting for more to pack into the same datagram. With zero, DataSets
+    // are sent as soon as the listener thread gets to them, still packing those that queued up meanwhile.
+    std::chrono::microseconds send_window{0};
+
+    // Max size of a sent datagram, a datagram is sent as soon as the next DataSet does not fit. At least
+    // Z21_Frame::capacity, so every DataSet fits.
+    size_t max_datagram_size{Z21_DatagramBatcher::max_datagram_size};
+
+    // Max bulk DataSets sent per second, zero for no limit.
+    double bulk_rate{0};
+
+    // Adaptive rate of interactive and bulk DataSets, emergency ones are never held back.
+    SendRateConfig rate_control;
+
+    // Max datagrams read per recvmmsg() call. Above 1, each wakeup drains the socket in batches; with 1, one
+    // datagram is received per asio wakeup.
+    size_t receive_batch{1};
+
+    // How datagrams are received. IO_URING falls back to ASIO where io_uring is not available; with it,
+    // receive_batch does not apply.
+    ReceiveBackend receive_backend{ReceiveBackend::ASIO};
+
+    // BUSY_POLL: how long to keep spinning after the last datagram before parking until the socket is
+    // readable, and the CPU to pin the thread to, -1 for none.
+    std::chrono::microseconds busy_poll_spin{std::chrono::milliseconds(10)};
+    int busy_poll_cpu{-1};
+
+    // BUSY_POLL: microseconds the kernel polls the device queue in each receive call (SO_BUSY_POLL), zero to
+    // leave it at the system default (net.core.busy_read).
+    unsigned busy_poll_us{50};
+
+    // Socket receive and send buffer sizes in bytes (SO_RCVBUF, SO_SNDBUF), zero for the system default. A
+    // larger receive buffer holds longer broadcast bursts while the listener is busy. Capped at
+    // net.core.rmem_max / wmem_max unless the process has CAP_NET_ADMIN.
+    int receive_buffer_size{0};
+    int send_buffer_size{0};
+
+    // Decode received datagrams and update state on a thread of their own, fed through a ring by the
+    // listener thread, which then only receives and timestamps datagrams.
+    bool pipelined{false};
+
+    // Where event subscribers are called (Z21::on_loco_changed() and friends), empty for a thread of its own.
+    boost::asio::any_io_executor event_executor{};
+};
+
+/**
+ * Counters for the send path.
+ */
+struct Z21SendStats
+{
+    uint64_t datagrams_sent{0};
+    uint64_t datasets_sent{0};
+    uint64_t max_datasets_per_datagram{0};
+
+    // sendmmsg() calls made, each sending all datagrams ready at the time.
+    uint64_t send_syscalls{0};
+
+    // Datagrams dropped because the socket failed sending them.
+    uint64_t send_errors{0};
+
+    // Time from the oldest DataSet in a datagram being queued until the datagram was handed to the socket,
+    // summed over all datagrams. Includes time waiting in the send window.
+    std::chrono::nanoseconds total_send_latency{0};
+    std::chrono::nanoseconds max_send_latency{0};
+
+    // Interactive DataSets queued by callers and not yet picked up by the listener thread.
+    uint64_t send_queue_depth{0};
+    uint64_t max_send_queue_depth{0};
+
+    // Bulk DataSets queued by callers and not yet picked up by the listener thread.
+    uint64_t bulk_queue_depth{0};
+    uint64_t max_bulk_queue_depth{0};
+
+    // Emergency DataSets sent, each in a datagram of their own ahead of other traffic.
+    uint64_t emergency_datasets_sent{0};
+
+    // DataSets dropped because the queue of their lane was full.
+    uint64_t send_queue_drops{0};
+
+    // Loco drive and function group commands overwritten by a newer one for the same loco before being sent.
+    uint64_t loco_commands_superseded{0};
+
+    // Track power on and loco commands dropped unsent because an emergency DataSet was queued after them, see
+    // Z21::drop_superseded().
+    uint64_t emergency_superseded{0};
+
+    // Socket send buffer size the kernel settled on (SO_SNDBUF), see Z21Config::send_buffer_size.
+    int socket_send_buffer{0};
+
+    SendRateStats rate_control;
+};
+
+/**
+ * Counters for the receive path.
+ */
+struct Z21ReceiveStats
+{
+    uint64_t datagrams_received{0};
+    uint64_t bytes_received{0};
+    uint64_t datasets_received{0};
+
+    // Datagrams dropped by the kernel because the socket receive buffer was full (SO_RXQ_OVFL). Only learnt
+    // from the next datagram received after the drops, so broadcasts lost in a burst show up here, while a
+    // Z21 that stopped sending leaves both this and datagrams_received still.
+    uint64_t kernel_drops{0};
+
+    // Socket receive buffer size the kernel settled on (SO_RCVBUF), see Z21Config::receive_buffer_size.
+    int socket_receive_buffer{0};
+
+    // Receive calls made, each returning up to Z21Config::receive_batch datagrams (or none when the socket
+    // turned out to be empty).
+    uint64_t receive_syscalls{0};
+    uint64_t max_datagrams_per_syscall{0};
+
+    // Times the receiving thread was woken up (from parking, for BUSY_POLL).
+    uint64_t receive_wakeups{0};
+
+    // Backend in use, ASIO if IO_URING was configured but could not be set up.
+    ReceiveBackend receive_backend{ReceiveBackend::ASIO};
+
+    // Datagrams larger than a receive buffer, dropped since only their start was received.
+    uint64_t datagrams_truncated{0};
+
+    // Receive calls that found no free pooled buffer, so received into a scratch buffer. Those datagrams
+    // are decoded but not handed to the datagram handler.
+    uint64_t receive_pool_exhausted{0};
+
+    // Pooled buffers currently held, by the receive path or downstream.
+    uint64_t receive_buffers_in_use{0};
+
+    // Pipelined mode: datagrams waiting for the decode thread, now and at most, and datagrams dropped since
+    // they could not be queued (received into the scratch buffer, or the ring was full).
+    uint64_t pipeline_depth{0};
+    uint64_t max_pipeline_depth{0};
+    uint64_t pipeline_drops{0};
+
+    // Pipelined mode: time from a datagram being received until the decode thread took it, summed and at
+    // most, and decode thread time spent handling datagrams.
+    std::chrono::nanoseconds total_pipeline_latency{0};
+    std::chrono::nanoseconds max_pipeline_latency{0};
+    std::chrono::nanoseconds decode_time{0};
+
+    // Listener thread CPU time spent receiving and handling datagrams (only receiving in pipelined mode).
+    std::chrono::nanoseconds receive_cpu_time{0};
+
+    // Events queued for subscribers, and events dropped because subscribers fell too far behind.
+    uint64_t events_published{0};
+    uint64_t event_drops{0};
 };
 
 
 /**
  * Represents an instance of a Roco Z21.
+ *
+ * Requests from any thread are packed and put on a lock-free queue per SendPriority, which the listener
+ * thread drains into datagrams. All datagrams ready at a time are sent with a single sendmmsg() call.
+ * Emergency requests go out before anything else that is waiting, and track power on and loco commands
+ * queued before them are dropped rather than sent after them. Bulk requests only go out when no interactive ones are
+ * waiting, at most Z21Config::bulk_rate per second. Interactive and bulk requests can also be paced by a
+ * SendRateController adapting to how quickly the Z21 responds.
+ * Received datagrams are handled on the listener thread, optionally read in batches with recvmmsg(), each
+ * into a pooled buffer that can be handed downstream without copying. They can also be received through
+ * io_uring, or by a busy-polling thread of their own. In pipelined mode they are passed on to a decode
+ * thread, so slow handling does not hold up receiving.
+ * Nothing is sent before listen() has been called.
  */
 class Z21
 {
 public:
-    Z21(const std::string& z21_host, const std::string& z21_port);
+    Z21(const std::string& z21_host, const std::string& z21_port, const Z21Config& config = Z21Config());
     ~Z21();
 
     /**
@@ -102,10 +348,114 @@ public:
 
 
     /**
-     * Get a struct with all current Z21 information.
-     * @return struct with all current Z21 information
+     * Get a consistent snapshot of the Z21 status, as of the last DataSet that changed it (any thread). Never
+     * blocks, and never holds up the thread handling DataSets.
+     */
+    Z21Status z21_status() const { return m_status_snapshot.load(); }
+
+    /**
+     * State of every loco, updated from LAN_X_LOCO_INFO broadcasts. Can be read from any thread.
+     */
+    const LocoStateTable& loco_states() const { return m_loco_states; }
+
+    /**
+     * State of every turnout and extended accessory, updated from LAN_X_TURNOUT_INFO and
+     * LAN_X_EXT_ACCESSORY_INFO broadcasts. Can be read from any thread.
+     */
+    const AccessoryStateTable& accessory_states() const { return m_accessory_states; }
+
+    /**
+     * Version of the state, counting every change of the status, a loco, a turnout or an extended accessory
+     * (any thread).
+     */
+    uint64_t state_version() const { return m_changes.version(); }
+
+    /**
+     * Visit the status, locos and accessories that changed after version, each once, without scanning the
+     * rest (any thread). Read their state with z21_status(), loco_states() and accessory_states(), which may
+     * already be newer. See ChangeLog::changes_since().
+     * @param version version returned by the previous call, zero for everything ever changed
+     * @param fn called as fn(const StateChange&)
+     * @return version to pass next time
+     */
+    template<typename Fn>
+    uint64_t changes_since(uint64_t version, Fn fn) const { return m_changes.changes_since(version, std::move(fn)); }
+
+    /**
+     * Get counters for sent datagrams.
+     * @return snapshot of send counters
+     */
+    Z21SendStats send_stats() const;
+
+    /**
+     * Get counters for received datagrams.
+     * @return snapshot of receive counters
+     */
+    Z21ReceiveStats receive_stats() const;
+
+    using DatagramHandler = std::function<void(const ReceiveBufferPool::Buffer&)>;
+
+    /**
+     * Set handler called with every received datagram, before its DataSets are handled (listener thread,
+     * busy-poll thread with ReceiveBackend::BUSY_POLL, or decode thread in pipelined mode).
+     * The handler may keep copies of the buffer, e.g. for capture or to pass to another thread; the buffer
+     * returns to the pool when the last copy is released. Must be set before listen().
+     * @param handler datagram handler
+     */
+    void set_datagram_handler(DatagramHandler handler) { datagram_handler = std::move(handler); }
+
+    using MessageHandler = std::function<void(const Z21Message&, ReceiveTimestamp)>;
+
+    /**
+     * Set handler called with every decoded DataSet, before it updates the status, along with the kernel
+     * receive time of its datagram (same threads as the datagram handler). Must be set before listen().
+     * @param handler message handler
+     */
+    void set_message_handler(MessageHandler handler) { message_handler = std::move(handler); }
+
+    /**
+     * Subscribe to changes of loco state, from LAN_X_LOCO_INFO. Subscribers are called on
+     * Z21Config::event_executor, in order, never on a thread receiving or handling DataSets. Must be
+     * subscribed before listen().
+     * @param handler called with the fields that changed
+     */
+    void on_loco_changed(EventDispatcher::Handler<event::LocoChanged> handler) { m_events.subscribe(std::move(handler)); }
+
+    /**
+     * Subscribe to changes of turnouts and extended accessories, as on_loco_changed().
+     * @param handler called with the accessory that changed
+     */
+    void on_accessory_changed(EventDispatcher::Handler<event::AccessoryChanged> handler) { m_events.subscribe(std::move(handler)); }
+
+    /**
+     * Subscribe to changes of currents, voltages, temperature and central state, as on_loco_changed().
+     * @param handler called with the fields that changed
+     */
+    void on_system_state_changed(EventDispatcher::Handler<event::SystemStateChanged> handler) { m_events.subscribe(std::move(handler)); }
+
+    /**
+     * Subscribe to changes of track power, emergency stop, short circuit and programming mode, as
+     * on_loco_changed().
+     * @param handler called with the fields that changed
+     */
+    void on_power_changed(EventDispatcher::Handler<event::PowerChanged> handler) { m_events.subscribe(std::move(handler)); }
+
+    /**
+     * Subscribe to results of CV reads and writes, as on_loco_changed().
+     * @param handler called with every result
+     */
+    void on_cv_result(EventDispatcher::Handler<event::CvResult> handler) { m_events.subscribe(std::move(handler)); }
+
+    /**
+     * Queue a batch of XBus commands, each in the lane of its priority (as for the matching request
+     * method) and in batch order within the lane. The batch is picked up by a single drain, so when it
+     * needs several datagrams they leave through one sendmmsg() call. Unlike xbus_set_loco_drive(), loco
+     * commands are not merged with earlier ones for the same loco.
+     * @param commands commands to send
+     * @param status status per command, for as many commands as it has room for
+     * @return number of commands queued
      */
-    Z21Status& z21_status() { return m_z21_status; }
+    size_t submit(std::span<const LanX_Command* const> commands, std::span<SubmitStatus> status = {});
 
 
     // =========================================================================================
@@ -143,7 +493,8 @@ public:
     void xbus_get_status();
 
     /**
-     * Request XBus: set track power off (LAN_X_SET_TRACK_POWER_OFF).
+     * Request XBus: set track power off (LAN_X_SET_TRACK_POWER_OFF). Sent with emergency priority, dropping
+     * track power on and loco commands still waiting to be sent.
      */
     void xbus_set_track_power_off();
 
@@ -212,7 +563,8 @@ public:
     void xbus_set_ext_accessory(uint16_t address, uint8_t state);
 
     /**
-     * Reqyest XBus: set stop (LAN_X_SET_STOP).
+     * Reqyest XBus: set stop (LAN_X_SET_STOP). Sent with emergency priority, dropping track power
+     * on and loco commands still waiting to be sent.
      */
     void xbus_set_stop();
 
@@ -224,6 +576,7 @@ public:
 
     /**
      * Request XBus: set loco drive (LAN_X_SET_LOCO_DRIVE).
+     * Latest value wins: a drive command still waiting to be sent for the same loco is replaced.
      * @param address loco address
      * @param speed loco speed
      * @param forward loco direction
@@ -239,6 +592,7 @@ public:
 
     /**
      * Request XBus: set loco function group (LAN_X_SET_LOCO_FUNCTION_GROUP).
+     * Latest value wins: a command still waiting to be sent for the same loco and group is replaced.
      * @param address loco address
      * @param group loco group
      * @param functions loco functions
@@ -358,38 +712,368 @@ private:
     void listen_thread_fn();
 
     /**
-     * Handle received data (from listening thread).
+     * Decode thread function, handling datagrams passed on by the listener thread (pipelined mode).
+     */
+    void decode_thread_fn();
+
+    /**
+     * Busy-poll thread function, receiving and handling datagrams (ReceiveBackend::BUSY_POLL).
+     */
+    void busy_poll_thread_fn();
+
+    /**
+     * Whether datagrams are handled on another thread than the listener thread.
+     */
+    bool handles_off_listener() const { return config.pipelined || config.receive_backend == ReceiveBackend::BUSY_POLL; }
+
+    /**
+     * Wait for the next datagram, in the mode set by Z21Config::receive_batch (listener thread).
+     */
+    void start_receive();
+
+    /**
+     * Handle the socket becoming readable, receiving all waiting datagrams with recvmmsg() (listener thread).
      * @param error possible error code
-     * @param bytes_transferred number of bytes received
      */
-    void handle_receive(const boost::system::error_code& error, std::size_t bytes_transferred);
+    void handle_readable(const boost::system::error_code& error);
+
+    /**
+     * Receive and dispatch all waiting datagrams with recvmmsg() (listener or busy-poll thread).
+     * @return number of datagrams received
+     */
+    size_t receive_available();
+
+    /**
+     * Switch receiving to io_uring, if available (listener thread).
+     * @return false if io_uring could not be set up
+     */
+    bool start_uring();
 
     /**
-     * Handle received dataset (from listening thread).
+     * Handle io_uring completions, or the socket becoming readable while the io_uring receive is stopped
+     * for lack of buffers (listener thread).
+     * @param error possible error code
+     */
+    void handle_uring(const boost::system::error_code& error);
+
+    /**
+     * Take pooled buffers for the next recvmmsg() call, keeping those left unused by the previous call, or
+     * fall back to the scratch buffer if the pool is exhausted (listener or busy-poll thread).
+     * @return number of buffers to receive into
+     */
+    size_t prepare_receive_batch();
+
+    /**
+     * Handle a received datagram right away, or pass it to the decode thread in pipelined mode (listener or
+     * busy-poll thread).
+     * @param buffer pooled buffer holding the datagram
+     */
+    void dispatch_datagram(ReceiveBufferPool::Buffer buffer);
+
+    /**
+     * Handle a datagram received into the scratch buffer, which cannot be passed on, so it is dropped in
+     * pipelined mode (listener or busy-poll thread).
+     * @param size size of datagram
+     * @param timestamp kernel receive time of datagram
+     */
+    void dispatch_scratch(size_t size, ReceiveTimestamp timestamp);
+
+    /**
+     * Hand a received datagram downstream and handle all DataSets in it (listener, busy-poll or decode
+     * thread).
+     * @param datagram received datagram
+     * @param buffer pooled buffer holding the datagram, empty if it was received into the scratch buffer
+     * @param timestamp kernel receive time of datagram
+     */
+    void handle_datagram(std::span<const uint8_t> datagram, const ReceiveBufferPool::Buffer& buffer, ReceiveTimestamp timestamp);
+
+    /**
+     * Handle received dataset (from listening, busy-poll or decode thread).
      * @param size size of dataset
      * @param id ID of dataset
      * @param data dataset data
+     * @param timestamp kernel receive time of its datagram
+     */
+    void handle_dataset(uint16_t size, uint16_t id, std::span<const uint8_t> data, ReceiveTimestamp timestamp);
+
+    /**
+     * Update status from a decoded message (from listening, busy-poll or decode thread).
+     * @param message decoded message
+     * @param timestamp kernel receive time of its datagram
+     */
+    void handle_message(const Z21Message& message, ReceiveTimestamp timestamp);
+
+    /**
+     * Publish what a message changed in the status to event subscribers (from listening, busy-poll or decode
+     * thread).
+     * @param previous status as last published
+     * @param timestamp kernel receive time of the message
+     */
+    void publish_status_changes(const Z21Status& previous, ReceiveTimestamp timestamp);
+
+    /**
+     * Pass a response the send rate depends on to the rate controller, through the listener thread in
+     * pipelined or busy-poll mode (listening, busy-poll or decode thread).
+     * @param address loco address of LAN_X_LOCO_INFO, ignored for LAN_X_UNKNOWN_COMMAND
+     * @param unknown_command true for LAN_X_UNKNOWN_COMMAND
+     */
+    void rate_feedback(uint16_t address, bool unknown_command);
+
+    /**
+     * Pack dataset into an inline frame and queue it for sending to Z21 (any thread). Does not block and
+     * does not allocate.
+     * @param dataset dataset to send
+     * @param priority lane to send dataset in
+     */
+    void send(const Z21_DataSet& dataset, SendPriority priority = SendPriority::INTERACTIVE);
+
+    /**
+     * Queue a packed frame in the lane of priority, without scheduling a drain (any thread).
+     * @param frame packed DataSet
+     * @param priority lane to queue frame in
+     * @return QUEUED, or QUEUE_FULL if the frame was dropped
+     */
+    SubmitStatus enqueue(const Z21_Frame& frame, SendPriority priority);
+
+    /**
+     * Store a loco command in the latest-wins slot table, to be sent on the next drain (any thread).
+     * @param address loco address
+     * @param slot drive or function group slot
+     * @param value speed byte or function bits
+     */
+    void send_loco_slot(uint16_t address, uint8_t slot, uint8_t value);
+
+    /**
+     * Make sure the listener thread drains the send queue soon (any thread).
+     */
+    void schedule_drain();
+
+    /**
+     * Move queued DataSets into datagrams, lane by lane, and start sending (listener thread).
      */
-    void handle_dataset(uint16_t size, uint16_t id, std::vector<uint8_t>& data);
+    void drain_send_queue();
 
     /**
-     * Handle received XBus command (from listening thread).
-     * @param command XBus command to handle
+     * Drop track power on and loco drive and function commands queued before an emergency DataSet and not yet
+     * sent, since sending them after the stop or power off could undo it (listener thread). Other DataSets,
+     * e.g. turnouts and bulk DataSets, are kept: those in datagrams packed but not yet sent are repacked, the
+     * interactive ones still queued are checked as they are taken (see superseded_before).
+     * @param queued time the latest emergency DataSet taken was queued
+     * @param loco_sequence LocoSlotTable::sequence() when it was queued
      */
-    void handle_lanx_command(LanX_Command* command);
+    void drop_superseded(Z21_DatagramBatcher::clock::time_point queued, uint32_t loco_sequence);
+
+    /**
+     * Move bulk DataSets into datagrams, as far as the bulk rate allows (listener thread).
+     */
+    void drain_bulk_queue();
+
+    /**
+     * Check if the adaptive send rate allows sending a DataSet, else arrange a drain when it does (listener
+     * thread).
+     * @param now current time
+     * @return true if a DataSet may be sent
+     */
+    bool may_send(Z21_DatagramBatcher::clock::time_point now);
+
+    /**
+     * Append a packed DataSet to the datagram being filled, sealing it first if full (listener thread).
+     * @return false if all datagrams are in use
+     */
+    bool append_frame(std::span<const uint8_t> frame, Z21_DatagramBatcher::clock::time_point queued);
+
+    /**
+     * Close the datagram being filled, so it is sent on the next flush (listener thread).
+     */
+    void seal_datagram();
+
+    /**
+     * Send the emergency datagram and all sealed datagrams, in one sendmmsg() call as far as the socket
+     * takes them, unless waiting for the socket to become writable (listener thread).
+     */
+    void flush_datagrams();
+
+    /**
+     * Release sent or failed datagrams, oldest first, and count them (listener thread).
+     * @param count number of datagrams
+     * @param sent true if the datagrams were sent, false if they failed
+     */
+    void complete_datagrams(size_t count, bool sent);
+
+    /**
+     * Handle the socket becoming writable after a full send buffer (listener thread).
+     * @param error possible error code
+     */
+    void handle_writable(const boost::system::error_code& error);
+
+    /**
+     * Handle expiry of the send window (listener thread).
+     * @param error possible error code
+     */
+    void handle_batch_timer(const boost::system::error_code& error);
+
+    /**
+     * Handle the bulk rate allowing the next bulk DataSet (listener thread).
+     * @param error possible error code
+     */
+    void handle_bulk_timer(const boost::system::error_code& error);
+
+    /**
+     * Handle the adaptive send rate allowing the next DataSet (listener thread).
+     * @param error possible error code
+     */
+    void handle_rate_timer(const boost::system::error_code& error);
+
+    Z21_DatagramBatcher& filling_datagram() { return datagrams[(datagram_head + datagrams_sealed) % datagrams.size()]; }
+
+    struct OutboundFrame
+    {
+        Z21_Frame frame;
+        Z21_DatagramBatcher::clock::time_point queued;
+
+        // LocoSlotTable::sequence() when queued, for the loco commands an emergency DataSet supersedes.
+        uint32_t loco_sequence{0};
+    };
+
+    struct ReceivedDatagram
+    {
+        ReceiveBufferPool::Buffer buffer;
+        Z21_DatagramBatcher::clock::time_point received;
+    };
+
+    struct RateFeedback
+    {
+        uint16_t address{0};
+        bool unknown_command{false};
+        SendRateController::clock::time_point time;
+    };
 
     const std::string host;
     const std::string port;
+    const Z21Config config;
 
     std::thread listen_thread;
-    std::vector<uint8_t> recv_buf;
-    std::map<uint16_t, Z21_DataSet*> command_handlers;
 
+    // Receive buffers, declared before the handles into it. The scratch buffer is only used when the pool
+    // is exhausted.
+    ReceiveBufferPool receive_pool;
+    std::array<uint8_t, ReceiveBufferPool::buffer_size> recv_scratch;
+    std::array<uint8_t, receive_control_size> recv_scratch_control;
+    DatagramHandler datagram_handler;
+    MessageHandler message_handler;
+
+    // Buffers for receiving, one per datagram of a recvmmsg() call.
+    std::vector<ReceiveBufferPool::Buffer> recv_batch;
+    std::vector<iovec> recv_batch_buffers;
+    std::vector<mmsghdr> recv_batch_messages;
+    HandlerMemory receive_handler_memory;
+
+    // Pipelined mode: the decode thread and the ring feeding it, which has room for every pooled buffer.
+    // Whenever datagrams are handled off the listener thread, responses for the rate controller go back
+    // through rate_feedback_ring, picked up by the next drain.
+    std::thread decode_thread;
+    SpscRing<ReceivedDatagram, ReceiveBufferPool::pool_size> decode_ring;
+    std::atomic<uint32_t> decode_wakeups{0};
+    std::atomic<bool> decode_running{true};
+    SpscRing<RateFeedback, 256> rate_feedback_ring;
     boost::asio::io_context io_context;
     boost::asio::ip::udp::endpoint receiver_endpoint;
     boost::asio::ip::udp::socket socket;
-
+    int socket_receive_buffer{0};
+    int socket_send_buffer{0};
+
+    // io_uring receive, used instead of the socket's own asio operations once started.
+    UringReceiver uring_receiver{receive_pool};
+    boost::asio::posix::stream_descriptor uring_events{io_context};
+    std::atomic<bool> uring_active{false};
+
+    // Busy-poll receive, woken from parking through busy_poll_event to stop.
+    std::thread busy_poll_thread;
+    std::atomic<bool> busy_poll_running{true};
+    std::atomic<bool> busy_poll_active{false};
+    int busy_poll_event{-1};
+
+    // Producer side of the send path, one queue per lane. Interactive loco commands go to loco_slots.
+    static constexpr size_t emergency_queue_size = 64;
+    MpscQueue<OutboundFrame, emergency_queue_size> emergency_queue;
+    MpscQueue<OutboundFrame, 1024> send_queue;
+    MpscQueue<OutboundFrame, 1024> bulk_queue;
+    std::atomic<bool> drain_scheduled{false};
+    HandlerMemory drain_handler_memory;
+    LocoSlotTable loco_slots;
+
+    // Listener thread side of the send path: a ring of datagrams, of which the first `datagrams_sealed`
+    // are waiting to be sent and the next one is being filled.
+    std::array<Z21_DatagramBatcher, 8> datagrams;
+    size_t datagram_head{0};
+    size_t datagrams_sealed{0};
+    bool send_blocked{false};
+    bool batch_timer_armed{false};
+    OutboundFrame pending_frame;
+    bool has_pending_frame{false};
+
+    // Interactive DataSets queued up to this time that could undo a stop or power off are dropped when taken.
+    Z21_DatagramBatcher::clock::time_point superseded_before{};
+    LocoFrameCache loco_frames;
+    boost::asio::steady_timer batch_timer;
+    HandlerMemory send_handler_memory;
+    HandlerMemory timer_handler_memory;
+
+    // A full emergency queue always fits in one datagram, sent before the ring.
+    static_assert(emergency_queue_size * Z21_Frame::capacity <= Z21_DatagramBatcher::max_datagram_size);
+    Z21_DatagramBatcher emergency_datagram;
+
+    Z21_DatagramBatcher::clock::time_point next_bulk_send{};
+    OutboundFrame pending_bulk_frame;
+    bool has_pending_bulk_frame{false};
+    bool bulk_timer_armed{false};
+    boost::asio::steady_timer bulk_timer;
+    HandlerMemory bulk_timer_handler_memory;
+
+    SendRateController rate_controller;
+    bool rate_timer_armed{false};
+    boost::asio::steady_timer rate_timer;
+    HandlerMemory rate_timer_handler_memory;
+
+    std::atomic<uint64_t> datagrams_sent{0};
+    std::atomic<uint64_t> datasets_sent{0};
+    std::atomic<uint64_t> max_datasets_per_datagram{0};
+    std::atomic<uint64_t> send_syscalls{0};
+    std::atomic<uint64_t> send_errors{0};
+    std::atomic<uint64_t> total_send_latency_ns{0};
+    std::atomic<uint64_t> max_send_latency_ns{0};
+    std::atomic<uint64_t> max_send_queue_depth{0};
+    std::atomic<uint64_t> max_bulk_queue_depth{0};
+    std::atomic<uint64_t> emergency_datasets_sent{0};
+    std::atomic<uint64_t> send_queue_drops{0};
+    std::atomic<uint64_t> loco_commands_superseded{0};
+    std::atomic<uint64_t> emergency_superseded{0};
+
+    std::atomic<uint64_t> datagrams_received{0};
+    std::atomic<uint64_t> bytes_received{0};
+    std::atomic<uint64_t> datasets_received{0};
+    std::atomic<uint64_t> kernel_drops{0};
+    std::atomic<uint64_t> receive_syscalls{0};
+    std::atomic<uint64_t> receive_wakeups{0};
+    std::atomic<uint64_t> max_datagrams_per_syscall{0};
+    std::atomic<uint64_t> datagrams_truncated{0};
+    std::atomic<uint64_t> receive_pool_exhausted{0};
+    std::atomic<uint64_t> max_pipeline_depth{0};
+    std::atomic<uint64_t> pipeline_drops{0};
+    std::atomic<uint64_t> total_pipeline_latency_ns{0};
+    std::atomic<uint64_t> max_pipeline_latency_ns{0};
+    std::atomic<uint64_t> decode_ns{0};
+    std::atomic<uint64_t> receive_cpu_ns{0};
+
+    // Status as updated field by field by the thread handling DataSets, published whole to other threads.
     Z21Status m_z21_status;
+    SeqLock<Z21Status> m_status_snapshot;
+    LocoStateTable m_loco_states;
+    AccessoryStateTable m_accessory_states;
+    ChangeLog m_changes;
+
+    // Last, so it is torn down (waiting for a dispatch in progress) while the state is still there.
+    EventDispatcher m_events;
 };
 
 
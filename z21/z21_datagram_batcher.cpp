@@ -0,0 +1,50 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <algorithm>
+#include <cstring>
+
+#include "z21_datagram_batcher.h"
+
+
+Z21_DatagramBatcher::Z21_DatagramBatcher(size_t datagram_size) :
+    m_datagram_size(std::clamp<size_t>(datagram_size, 1, max_datagram_size))
+{
+}
+
+bool Z21_DatagramBatcher::append(std::span<const uint8_t> dataset, clock::time_point now)
+{
+    if (dataset.size() > m_datagram_size - m_size) {
+        return false;
+    }
+
+    if (m_datasets == 0) {
+        m_first_append = now;
+    }
+
+    std::memcpy(m_buffer.data() + m_size, dataset.data(), dataset.size());
+    m_size += dataset.size();
+    m_datasets++;
+    return true;
+}
+
+void Z21_DatagramBatcher::clear()
+{
+    m_size = 0;
+    m_datasets = 0;
+}
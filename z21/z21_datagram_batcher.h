@@ -0,0 +1,79 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef TRAINPP_Z21_DATAGRAM_BATCHER_H
+#define TRAINPP_Z21_DATAGRAM_BATCHER_H
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <span>
+
+
+/**
+ * Packs several Z21 DataSets into one UDP datagram.
+ *
+ * The Z21 accepts any number of DataSets back to back in one datagram, so DataSets issued close in time
+ * can share a packet (and a syscall) instead of being sent one by one.
+ */
+class Z21_DatagramBatcher
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    // Largest UDP payload that fits in one ethernet frame without fragmentation.
+    static constexpr size_t max_datagram_size = 1472;
+
+    /**
+     * @param datagram_size max size of a datagram, capped to max_datagram_size
+     */
+    explicit Z21_DatagramBatcher(size_t datagram_size = max_datagram_size);
+
+    /**
+     * Append a packed DataSet to the datagram.
+     * @param dataset packed DataSet
+     * @param now time the DataSet was issued
+     * @return false if the DataSet does not fit in what is left of the datagram
+     */
+    bool append(std::span<const uint8_t> dataset, clock::time_point now);
+
+    /**
+     * Forget all appended DataSets, to start on a new datagram.
+     */
+    void clear();
+
+    bool empty() const { return m_datasets == 0; }
+    size_t datasets() const { return m_datasets; }
+    size_t datagram_size() const { return m_datagram_size; }
+    std::span<const uint8_t> datagram() const { return {m_buffer.data(), m_size}; }
+
+    /**
+     * Time the first DataSet in the current datagram was issued.
+     */
+    clock::time_point first_append() const { return m_first_append; }
+
+private:
+    std::array<uint8_t, max_datagram_size> m_buffer;
+    size_t m_datagram_size;
+    size_t m_size{0};
+    size_t m_datasets{0};
+    clock::time_point m_first_append;
+};
+
+
+#endif // TRAINPP_Z21_DATAGRAM_BATCHER_H
@@ -19,7 +19,9 @@
 #ifndef TRAINPP_Z21_DATASET_H
 #define TRAINPP_Z21_DATASET_H
 
+#include <array>
 #include <iostream>
+#include <span>
 #include <vector>
 
 #include <boost/algorithm/string.hpp>
@@ -27,6 +29,8 @@
 #include <boost/format.hpp>
 
 #include "lan_x_command_base.h"
+#include "z21_message.h"
+#include "z21_protocol.h"
 
 using boost::adaptors::transformed;
 
@@ -35,6 +39,20 @@ using boost::adaptors::transformed;
 constexpr size_t header_size = 4;
 
 
+/**
+ * Fixed capacity, inline storage for one packed DataSet, used to send without heap allocations.
+ */
+struct Z21_Frame
+{
+    static constexpr size_t capacity = header_size + lan_x_max_size;
+
+    std::array<uint8_t, capacity> data{};
+    size_t size{0};
+
+    std::span<const uint8_t> bytes() const { return {data.data(), size}; }
+};
+
+
 /**
  * Base class for all Z21 DataSets (commands).
  */
@@ -57,19 +75,48 @@ public:
         LAN_SYSTEMSTATE_GETDATA = 0x85
     };
 
-    virtual std::vector<uint8_t> pack();
-    virtual void unpack(std::vector<uint8_t>& data) {}
+    virtual ~Z21_DataSet() = default;
+
+    /**
+     * Pack DataSet into a new vector.
+     * @return packed DataSet
+     */
+    std::vector<uint8_t> pack() const;
+
+    /**
+     * Pack DataSet into caller provided buffer, without allocating.
+     * @param buffer buffer to pack DataSet into
+     * @return number of bytes written, 0 if DataSet does not fit in buffer
+     */
+    size_t pack_into(std::span<uint8_t> buffer) const;
+
+    /**
+     * Pack DataSet into an inline frame, without allocating.
+     * @return packed frame
+     */
+    Z21_Frame frame() const;
+
+    virtual void unpack(std::span<const uint8_t> data) {}
 
     uint16_t id() { return m_id; }
 
 protected:
     uint16_t m_id;
 
-    virtual std::vector<uint8_t> pack_data()
-    {
-        std::vector<uint8_t> result;
-        return result;
-    }
+    /**
+     * Pack DataSet header (size and ID) into buffer, which must have room for it.
+     * @param buffer buffer to pack header into
+     * @param size size of DataSet, including header
+     * @param id DataSet ID
+     */
+    static void pack_header(std::span<uint8_t> buffer, uint16_t size, uint16_t id);
+
+    /**
+     * Pack DataSet data (everything after the header) into buffer.
+     * @param buffer buffer to pack data into
+     * @return number of bytes written
+     */
+    virtual size_t pack_data_into(std::span<uint8_t> buffer) const { return 0; }
 };
 
 enum BroadcastFlags
@@ -85,7 +132,7 @@ class LanGetSerialNumber : public Z21_DataSet
 {
 public:
     LanGetSerialNumber() { m_id = LAN_GET_SERIAL_NUMBER; }
-    virtual void unpack(std::vector<uint8_t>& data);
+    virtual void unpack(std::span<const uint8_t> data);
 
     uint32_t serial_number;
 };
@@ -95,7 +142,7 @@ class LanGetCode : public Z21_DataSet
 {
 public:
     LanGetCode() { m_id = LAN_GET_CODE; }
-    virtual void unpack(std::vector<uint8_t>& data);
+    virtual void unpack(std::span<const uint8_t> data);
 
     uint8_t code{0};
 };
@@ -105,7 +152,7 @@ class LanGetHWInfo : public Z21_DataSet
 {
 public:
     LanGetHWInfo() { m_id = LAN_GET_HWINFO; }
-    virtual void unpack(std::vector<uint8_t>& data);
+    virtual void unpack(std::span<const uint8_t> data);
 
     uint32_t hw_type;
     std::string fw_version;
@@ -122,20 +169,34 @@ public:
 class LanX : public Z21_DataSet
 {
 public:
-    LanX();
+    LanX() { m_id = LAN_X; }
     LanX(LanX_Command* command);
-    virtual ~LanX();
-    virtual void unpack(std::vector<uint8_t>& data);
+
+    /**
+     * Decode a received X-Bus reply with decode_dataset().
+     * @param data DataSet data, after the header
+     */
+    virtual void unpack(std::span<const uint8_t> data);
+
+    // Command to send.
     LanX_Command* command() { return m_command; }
 
+    // Last reply unpacked, std::monostate if unknown or malformed.
+    const Z21Message& message() const { return m_message; }
+
+    /**
+     * Pack an XBus command into an inline frame, without allocating.
+     * @param command command to pack
+     * @return packed frame, empty if command is invalid
+     */
+    static Z21_Frame pack_command(const LanX_Command& command);
+
 protected:
-    virtual std::vector<uint8_t> pack_data();
+    virtual size_t pack_data_into(std::span<uint8_t> buffer) const;
 
 private:
-    bool check_checksum(std::vector<uint8_t>& data);
-
-    std::map<LanXCommands, LanX_Command*> command_handlers;
     LanX_Command* m_command{nullptr};
+    Z21Message m_message;
 };
 
 // LAN_SET_BROADCASTFLAGS (0x50)
@@ -144,7 +205,7 @@ class LanSetBroadcastFlags : public Z21_DataSet
 public:
     LanSetBroadcastFlags(uint32_t flags) : m_flags(flags) { m_id = LAN_SET_BROADCASTFLAGS; }
 private:
-    virtual std::vector<uint8_t> pack_data();
+    virtual size_t pack_data_into(std::span<uint8_t> buffer) const;
     uint32_t m_flags;
 };
 
@@ -153,28 +214,22 @@ class LanGetBroadcastFlags : public Z21_DataSet
 {
 public:
     LanGetBroadcastFlags() { m_id = LAN_GET_BROADCASTFLAGS; }
-    virtual void unpack(std::vector<uint8_t>& data);
+    virtual void unpack(std::span<const uint8_t> data);
     uint32_t flags{0};
 };
 
-enum class Locomode : uint8_t {
-    UNKNOWN = 255,
-    DCC = 0,
-    MM = 1
-};
-
 // LAN_GET_LOCOMODE (0x60)
 class LanGetLocomode : public Z21_DataSet
 {
 public:
     LanGetLocomode(uint16_t address=0) : address(address) { m_id = LAN_GET_LOCOMODE; }
-    virtual void unpack(std::vector<uint8_t>& data);
+    virtual void unpack(std::span<const uint8_t> data);
 
     Locomode mode{Locomode::UNKNOWN};
     uint16_t address;
 
 protected:
-    virtual std::vector<uint8_t> pack_data();
+    virtual size_t pack_data_into(std::span<uint8_t> buffer) const;
 };
 
 // LAN_SET_LOCOMODE (0x61)
@@ -183,7 +238,7 @@ class LanSetLocomode : public Z21_DataSet
 public:
     LanSetLocomode(uint16_t address, Locomode mode) : m_address(address), m_mode(mode) { m_id = LAN_SET_LOCOMODE; }
 private:
-    virtual std::vector<uint8_t> pack_data();
+    virtual size_t pack_data_into(std::span<uint8_t> buffer) const;
 
     uint16_t m_address;
     Locomode m_mode;
@@ -211,7 +266,7 @@ class LanSystemstateDatachanged : public Z21_DataSet
 public:
     LanSystemstateDatachanged() { m_id = LAN_SYSTEMSTATE_DATACHANGED; }
 
-    virtual void unpack(std::vector<uint8_t>& data);
+    virtual void unpack(std::span<const uint8_t> data);
 
     int16_t main_current{0};
     int16_t prog_current{0};
@@ -0,0 +1,98 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "z21_events.h"
+
+#include <boost/log/trivial.hpp>
+
+
+EventDispatcher::EventDispatcher(boost::asio::any_io_executor executor) :
+    m_own_executor(!executor),
+    m_strand(boost::asio::make_strand(m_own_executor ? boost::asio::any_io_executor(m_io_context.get_executor()) : executor))
+{
+}
+
+EventDispatcher::~EventDispatcher()
+{
+    // Waits for a dispatch in progress. Pending ones find the dispatcher gone, however late they run.
+    {
+        std::lock_guard lock(m_liveness->mutex);
+        m_liveness->alive = false;
+    }
+
+    if (m_thread.joinable()) {
+        m_io_context.stop();
+        m_thread.join();
+    }
+}
+
+void EventDispatcher::start()
+{
+    if (m_own_executor && !m_thread.joinable()) {
+        m_thread = std::thread([this]() {
+            BOOST_LOG_TRIVIAL(debug) << "Running Z21 event thread";
+            auto work = boost::asio::make_work_guard(m_io_context);
+            m_io_context.run();
+        });
+    }
+}
+
+bool EventDispatcher::publish(const Z21Event& event)
+{
+    bool queued = m_queue.push(event);
+    if (queued) {
+        m_published.fetch_add(1, std::memory_order_relaxed);
+    }
+    else {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Only post a dispatch if none is pending, the pending one will pick up this event as well.
+    if (!m_scheduled.exchange(true)) {
+        boost::asio::post(m_strand, [this, liveness = m_liveness]() {
+            std::lock_guard lock(liveness->mutex);
+            if (liveness->alive) {
+                dispatch();
+            }
+        });
+    }
+    return queued;
+}
+
+void EventDispatcher::dispatch()
+{
+    // Cleared before popping, so an event queued after the last pop below always posts a new dispatch.
+    m_scheduled.store(false);
+
+    Z21Event event;
+    while (m_queue.pop(event)) {
+        std::visit([this](const auto& changed) {
+            using Event = std::decay_t<decltype(changed)>;
+            for (auto& handler : std::get<std::vector<Handler<Event>>>(m_handlers)) {
+                try
+                {
+                    handler(changed);
+                }
+                catch (std::exception& e)
+                {
+                    BOOST_LOG_TRIVIAL(error) << "Z21 event subscriber failed: " << e.what();
+                }
+            }
+        }, event);
+    }
+}
@@ -0,0 +1,230 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef TRAINPP_Z21_EVENTS_H
+#define TRAINPP_Z21_EVENTS_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "loco_functions.h"
+#include "lan_x_command.h"
+#include "receive_control.h"
+#include "spsc_ring.h"
+
+
+/**
+ * Changes of Z21 state, worked out when a DataSet is handled. Each field is only set if it changed.
+ */
+namespace event
+{
+    // From LAN_X_LOCO_INFO. A loco seen for the first time has every field set, and the functions that are
+    // on as switched.
+    struct LocoChanged
+    {
+        uint16_t address{0};
+        std::optional<uint8_t> speed{};
+        std::optional<bool> direction_forward{};
+        std::optional<LanX_LocoInfo::SpeedSteps> speed_steps{};
+        std::optional<bool> busy{};
+
+        // Functions that were switched, and their new state (only the switched ones set).
+        LocoFunctions changed_functions{};
+        LocoFunctions functions{};
+
+        ReceiveTimestamp timestamp{};
+    };
+
+    // From LAN_X_TURNOUT_INFO and LAN_X_EXT_ACCESSORY_INFO.
+    struct AccessoryChanged
+    {
+        enum Kind : uint8_t
+        {
+            TURNOUT,
+            EXT_ACCESSORY,
+        };
+
+        Kind kind{TURNOUT};
+        uint16_t address{0};
+
+        // New LanX_TurnoutInfo::TurnoutStatus of a turnout, or state of an extended accessory.
+        uint8_t state{0};
+
+        // False for an extended accessory the Z21 reported no valid data for, which is now unknown.
+        bool known{true};
+
+        ReceiveTimestamp timestamp{};
+    };
+
+    // From LAN_SYSTEMSTATE_DATACHANGED, apart from the track power and mode flags (see PowerChanged).
+    struct SystemStateChanged
+    {
+        std::optional<int16_t> main_current{};
+        std::optional<int16_t> prog_current{};
+        std::optional<int16_t> filtered_main_current{};
+        std::optional<int16_t> temperature{};
+        std::optional<uint16_t> supply_voltage{};
+        std::optional<uint16_t> vcc_voltage{};
+        std::optional<uint8_t> central_state{};
+        std::optional<uint8_t> central_state_ex{};
+        std::optional<uint8_t> capabilities{};
+
+        ReceiveTimestamp timestamp{};
+    };
+
+    // From track power, stop, short circuit and programming mode broadcasts, and LAN_SYSTEMSTATE_DATACHANGED.
+    struct PowerChanged
+    {
+        std::optional<bool> track_voltage_off{};
+        std::optional<bool> emergency_stop{};
+        std::optional<bool> short_circuit{};
+        std::optional<bool> programming_mode{};
+
+        ReceiveTimestamp timestamp{};
+    };
+
+    // From LAN_X_CV_RESULT, LAN_X_CV_NACK and LAN_X_CV_NACK_SC. Every result is an event, changed or not.
+    struct CvResult
+    {
+        enum Result : uint8_t
+        {
+            OK,
+            NACK,
+            NACK_SHORT_CIRCUIT,
+        };
+
+        Result result{OK};
+        uint16_t cv{0};         // only for OK
+        uint8_t value{0};       // only for OK
+
+        ReceiveTimestamp timestamp{};
+    };
+}
+
+using Z21Event = std::variant<event::LocoChanged, event::AccessoryChanged, event::SystemStateChanged,
+                              event::PowerChanged, event::CvResult>;
+
+
+/**
+ * Calls subscribers with Z21 events, on an executor of their choice rather than the thread handling DataSets.
+ *
+ * The handling thread queues events on a lock-free ring and posts one dispatch for whatever is queued, so a
+ * slow subscriber never holds up receiving; events arriving while the ring is full are dropped and counted.
+ * Dispatches run through a strand, so subscribers get events one at a time and in order even on an executor
+ * with several threads. Without an executor, a thread of its own is started for them on the first subscriber.
+ *
+ * Subscribe before events are published. Destroying the dispatcher waits for a dispatch in progress, but not
+ * for pending ones: they share a liveness token with the dispatcher and do nothing once it is gone, so the
+ * executor may have stopped by then. Not to be destroyed from a subscriber.
+ */
+class EventDispatcher
+{
+public:
+    template<typename Event>
+    using Handler = std::function<void(const Event&)>;
+
+    static constexpr size_t queue_size = 1024;
+
+    explicit EventDispatcher(boost::asio::any_io_executor executor = {});
+    ~EventDispatcher();
+
+    EventDispatcher(const EventDispatcher&) = delete;
+    EventDispatcher& operator=(const EventDispatcher&) = delete;
+
+    /**
+     * Add a subscriber to events of one type (before any are published).
+     * @param handler called with every event of its type
+     */
+    template<typename Event>
+    void subscribe(Handler<Event> handler)
+    {
+        std::get<std::vector<Handler<Event>>>(m_handlers).push_back(std::move(handler));
+        start();
+    }
+
+    /**
+     * Whether events of a type have subscribers, so working out the change can be skipped when not.
+     */
+    template<typename Event>
+    bool wanted() const
+    {
+        return !std::get<std::vector<Handler<Event>>>(m_handlers).empty();
+    }
+
+    /**
+     * Queue an event and make sure it is dispatched soon (publishing thread only).
+     * @param event event to dispatch
+     * @return false if the event was dropped, the queue being full
+     */
+    bool publish(const Z21Event& event);
+
+    /**
+     * Events queued so far, and events dropped because the queue was full.
+     */
+    uint64_t published() const { return m_published.load(std::memory_order_relaxed); }
+    uint64_t dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+private:
+    /**
+     * Start the thread of its own, if there is no executor and it is not yet running.
+     */
+    void start();
+
+    /**
+     * Call subscribers with all queued events (strand).
+     */
+    void dispatch();
+
+    std::tuple<std::vector<Handler<event::LocoChanged>>, std::vector<Handler<event::AccessoryChanged>>,
+               std::vector<Handler<event::SystemStateChanged>>, std::vector<Handler<event::PowerChanged>>,
+               std::vector<Handler<event::CvResult>>> m_handlers;
+
+    // Without an executor given, dispatches run on m_thread.
+    const bool m_own_executor;
+    boost::asio::io_context m_io_context;
+    std::thread m_thread;
+    boost::asio::strand<boost::asio::any_io_executor> m_strand;
+
+    // Held by the dispatcher and every posted dispatch, which only runs while alive is set.
+    struct Liveness
+    {
+        std::mutex mutex;
+        bool alive{true};
+    };
+
+    SpscRing<Z21Event, queue_size> m_queue;
+    std::atomic<bool> m_scheduled{false};
+    std::shared_ptr<Liveness> m_liveness{std::make_shared<Liveness>()};
+
+    std::atomic<uint64_t> m_published{0};
+    std::atomic<uint64_t> m_dropped{0};
+};
+
+
+#endif // TRAINPP_Z21_EVENTS_H
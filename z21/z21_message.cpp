@@ -0,0 +1,222 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <array>
+
+#include "z21_message.h"
+#include "z21_dataset.h"
+#include "z21_protocol.h"
+
+
+namespace
+{
+    using XBusDecoder = Z21Message (*)(std::span<const uint8_t>);
+
+    // Decode an X-Bus reply with its description, converting the fields into a message.
+    template<typename Description, typename Convert>
+    Z21Message decode_with(std::span<const uint8_t> data, Convert convert)
+    {
+        auto fields = codec::decode<Description>(data);
+        if (!fields) {
+            return std::monostate{};
+        }
+        return convert(*fields);
+    }
+
+    // Decode an X-Bus reply carrying no values.
+    template<typename Description, typename Message>
+    Z21Message decode_empty(std::span<const uint8_t> data)
+    {
+        if (!codec::decode<Description>(data)) {
+            return std::monostate{};
+        }
+        return Message{};
+    }
+
+    Z21Message decode_turnout_info(std::span<const uint8_t> data)
+    {
+        return decode_with<protocol::TurnoutInfo>(data, [](const auto& fields) {
+            message::TurnoutInfo info;
+            info.address = fields.address;
+            info.status = fields.status <= LanX_TurnoutInfo::SWITCHED_P1 ?
+                          static_cast<LanX_TurnoutInfo::TurnoutStatus>(fields.status) : LanX_TurnoutInfo::UNKNOWN;
+            return info;
+        });
+    }
+
+    Z21Message decode_ext_accessory_info(std::span<const uint8_t> data)
+    {
+        return decode_with<protocol::ExtAccessoryInfo>(data, [](const auto& fields) {
+            return message::ExtAccessoryInfo{fields.address, fields.state, fields.status == 0x00};
+        });
+    }
+
+    Z21Message decode_cv_result(std::span<const uint8_t> data)
+    {
+        return decode_with<protocol::CvResult>(data, [](const auto& fields) {
+            return message::CvResult{fields.cv, fields.value};
+        });
+    }
+
+    Z21Message decode_loco_info(std::span<const uint8_t> data)
+    {
+        return decode_with<protocol::LocoInfo>(data, [](const auto& fields) {
+            message::LocoInfo info;
+            info.address = fields.address;
+            info.busy = fields.busy;
+            switch (fields.speed_steps) {
+                case LanX_LocoInfo::DCC_14:
+                case LanX_LocoInfo::DCC_28:
+                case LanX_LocoInfo::DCC_128:
+                    info.speed_steps = static_cast<LanX_LocoInfo::SpeedSteps>(fields.speed_steps);
+                    break;
+                default:
+                    info.speed_steps = LanX_LocoInfo::UNKNOWN;
+            }
+            info.direction_forward = fields.forward;
+            info.speed = fields.speed;
+            info.double_traction = fields.double_traction;
+            info.smart_search = fields.smart_search;
+            info.functions = LocoFunctions{fields.functions, fields.functions_high};
+            return info;
+        });
+    }
+
+    Z21Message decode_firmware_version(std::span<const uint8_t> data)
+    {
+        return decode_with<protocol::GetFirmwareVersionResponse>(data, [](const auto& fields) {
+            return message::FirmwareVersion{fields.version};
+        });
+    }
+
+    // Decoders in the order of protocol::LanXDecoders, selected by its lookup table.
+    constexpr auto xbus_decoders = [] {
+        std::array<XBusDecoder, protocol::LanXDecoders::count> table{};
+        auto add = [&table](LanXCommands id, XBusDecoder decoder) {
+            table[protocol::LanXDecoders::index_of(id)] = decoder;
+        };
+
+        add(LanXCommands::LAN_X_TURNOUT_INFO, decode_turnout_info);
+        add(LanXCommands::LAN_X_EXT_ACCESSORY_INFO, decode_ext_accessory_info);
+        add(LanXCommands::LAN_X_BC_TRACK_POWER_OFF, decode_empty<protocol::BcTrackPowerOff, message::TrackPowerOff>);
+        add(LanXCommands::LAN_X_BC_TRACK_POWER_ON, decode_empty<protocol::BcTrackPowerOn, message::TrackPowerOn>);
+        add(LanXCommands::LAN_X_BC_PROGRAMMING_MODE, decode_empty<protocol::BcProgrammingMode, message::ProgrammingMode>);
+        add(LanXCommands::LAN_X_BC_TRACK_SHORT_CIRCUIT, decode_empty<protocol::BcTrackShortCircuit, message::TrackShortCircuit>);
+        add(LanXCommands::LAN_X_CV_NACK_SC, decode_empty<protocol::CvNackSc, message::CvNackShortCircuit>);
+        add(LanXCommands::LAN_X_CV_NACK, decode_empty<protocol::CvNack, message::CvNack>);
+        add(LanXCommands::LAN_X_UNKNOWN_COMMAND, decode_empty<protocol::UnknownCommand, message::UnknownCommand>);
+        add(LanXCommands::LAN_X_STATUS_CHANGED, decode_empty<protocol::StatusChanged, message::StatusChanged>);
+        add(LanXCommands::LAN_X_GET_VERSION_RESPONSE, decode_empty<protocol::GetVersionResponse, message::VersionResponse>);
+        add(LanXCommands::LAN_X_CV_RESULT, decode_cv_result);
+        add(LanXCommands::LAN_X_BC_STOPPED, decode_empty<protocol::BcStopped, message::Stopped>);
+        add(LanXCommands::LAN_X_LOCO_INFO, decode_loco_info);
+        add(LanXCommands::LAN_X_GET_FIRMWARE_VERSION_RESPONSE, decode_firmware_version);
+        return table;
+    }();
+
+    static_assert(std::find(xbus_decoders.begin(), xbus_decoders.end(), nullptr) == xbus_decoders.end());
+
+    Z21Message decode_xbus(std::span<const uint8_t> data)
+    {
+        // XOR over all bytes including the checksum is zero for an intact reply.
+        uint8_t checksum = 0;
+        for (uint8_t byte: data) {
+            checksum ^= byte;
+        }
+        if (data.empty() || checksum != 0) {
+            return std::monostate{};
+        }
+
+        size_t index = protocol::LanXDecoders::find(data);
+        if (index == protocol::LanXDecoders::count) {
+            return std::monostate{};
+        }
+        return xbus_decoders[index](data);
+    }
+}
+
+
+namespace message
+{
+    std::string HWInfo::fw_version() const
+    {
+        std::array<uint8_t, 4> bcd = {static_cast<uint8_t>(fw_version_bcd), static_cast<uint8_t>(fw_version_bcd >> 8),
+                                      static_cast<uint8_t>(fw_version_bcd >> 16), static_cast<uint8_t>(fw_version_bcd >> 24)};
+        return decode_bcd_version(bcd, true);
+    }
+
+    std::string FirmwareVersion::version() const
+    {
+        std::array<uint8_t, 2> bcd = {static_cast<uint8_t>(version_bcd >> 8), static_cast<uint8_t>(version_bcd)};
+        return decode_bcd_version(bcd, false);
+    }
+}
+
+
+Z21Message decode_dataset(uint16_t id, std::span<const uint8_t> data)
+{
+    switch (id)
+    {
+        case Z21_DataSet::LAN_GET_SERIAL_NUMBER:
+            if (data.size() == codec::size<protocol::SerialNumber>) {
+                return message::SerialNumber{codec::decode<protocol::SerialNumber>(data)->serial_number};
+            }
+            break;
+        case Z21_DataSet::LAN_GET_CODE:
+            if (data.size() == codec::size<protocol::Code>) {
+                return message::Code{codec::decode<protocol::Code>(data)->code};
+            }
+            break;
+        case Z21_DataSet::LAN_GET_HWINFO:
+            if (data.size() == codec::size<protocol::HWInfo>) {
+                auto fields = codec::decode<protocol::HWInfo>(data);
+                return message::HWInfo{fields->hw_type, fields->fw_version};
+            }
+            break;
+        case Z21_DataSet::LAN_X:
+            return decode_xbus(data);
+        case Z21_DataSet::LAN_GET_BROADCASTFLAGS:
+            if (auto fields = codec::decode<protocol::BroadcastFlags>(data)) {
+                return message::BroadcastFlags{fields->flags};
+            }
+            break;
+        case Z21_DataSet::LAN_GET_LOCOMODE:
+            if (auto fields = codec::decode<protocol::Locomode>(data)) {
+                return message::LocoMode{fields->address, static_cast<Locomode>(fields->mode)};
+            }
+            break;
+        case Z21_DataSet::LAN_GET_TURNOUTMODE:
+            if (auto fields = codec::decode<protocol::Locomode>(data)) {
+                return message::TurnoutMode{fields->address, static_cast<Locomode>(fields->mode)};
+            }
+            break;
+        case Z21_DataSet::LAN_SYSTEMSTATE_DATACHANGED:
+            if (data.size() == codec::size<protocol::SystemState>) {
+                auto fields = codec::decode<protocol::SystemState>(data);
+                return message::SystemState{fields->main_current, fields->prog_current, fields->filtered_main_current,
+                                            fields->temperature, fields->supply_voltage, fields->vcc_voltage,
+                                            fields->central_state, fields->central_state_ex, fields->capabilities,
+                                            fields->emergency_stop, fields->track_voltage_off, fields->short_circuit,
+                                            fields->programming_mode};
+            }
+            break;
+        default:
+            break;
+    }
+    return std::monostate{};
+}
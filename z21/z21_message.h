@@ -0,0 +1,186 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef TRAINPP_Z21_MESSAGE_H
+#define TRAINPP_Z21_MESSAGE_H
+
+#include <cstdint>
+#include <span>
+#include <string>
+#include <variant>
+
+#include "lan_x_command.h"
+#include "loco_functions.h"
+
+
+enum class Locomode : uint8_t {
+    UNKNOWN = 255,
+    DCC = 0,
+    MM = 1
+};
+
+
+/**
+ * Messages received from the Z21, decoded into plain values.
+ */
+namespace message
+{
+    // LAN_GET_SERIAL_NUMBER
+    struct SerialNumber
+    {
+        uint32_t serial_number{0};
+    };
+
+    // LAN_GET_CODE
+    struct Code
+    {
+        uint8_t code{0};
+    };
+
+    // LAN_GET_HWINFO
+    struct HWInfo
+    {
+        uint32_t hw_type{0};
+        uint32_t fw_version_bcd{0};
+
+        std::string fw_version() const;
+    };
+
+    // LAN_GET_BROADCASTFLAGS
+    struct BroadcastFlags
+    {
+        uint32_t flags{0};
+    };
+
+    // LAN_GET_LOCOMODE
+    struct LocoMode
+    {
+        uint16_t address{0};
+        Locomode mode{Locomode::UNKNOWN};
+    };
+
+    // LAN_GET_TURNOUTMODE
+    struct TurnoutMode
+    {
+        uint16_t address{0};
+        Locomode mode{Locomode::UNKNOWN};
+    };
+
+    // LAN_SYSTEMSTATE_DATACHANGED
+    struct SystemState
+    {
+        int16_t main_current{0};
+        int16_t prog_current{0};
+        int16_t filtered_main_current{0};
+        int16_t temperature{0};
+
+        uint16_t supply_voltage{0};
+        uint16_t vcc_voltage{0};
+
+        uint8_t central_state{0};
+        uint8_t central_state_ex{0};
+        uint8_t capabilities{0};
+
+        bool emergency_stop{false};
+        bool track_voltage_off{false};
+        bool short_circuit{false};
+        bool programming_mode{false};
+    };
+
+    // LAN_X_TURNOUT_INFO
+    struct TurnoutInfo
+    {
+        uint16_t address{0};
+        LanX_TurnoutInfo::TurnoutStatus status{LanX_TurnoutInfo::UNKNOWN};
+    };
+
+    // LAN_X_EXT_ACCESSORY_INFO
+    struct ExtAccessoryInfo
+    {
+        uint16_t address{0};
+        uint8_t state{0};
+        bool data_valid{false};
+    };
+
+    struct TrackPowerOff {};        // LAN_X_BC_TRACK_POWER_OFF
+    struct TrackPowerOn {};         // LAN_X_BC_TRACK_POWER_ON
+    struct ProgrammingMode {};      // LAN_X_BC_PROGRAMMING_MODE
+    struct TrackShortCircuit {};    // LAN_X_BC_TRACK_SHORT_CIRCUIT
+    struct CvNackShortCircuit {};   // LAN_X_CV_NACK_SC
+    struct CvNack {};               // LAN_X_CV_NACK
+    struct UnknownCommand {};       // LAN_X_UNKNOWN_COMMAND
+    struct StatusChanged {};        // LAN_X_STATUS_CHANGED
+    struct VersionResponse {};      // LAN_X_GET_VERSION_RESPONSE
+    struct Stopped {};              // LAN_X_BC_STOPPED
+
+    // LAN_X_CV_RESULT
+    struct CvResult
+    {
+        uint16_t cv{0};
+        uint8_t value{0};
+    };
+
+    // LAN_X_LOCO_INFO
+    struct LocoInfo
+    {
+        uint16_t address{0};
+        bool busy{false};
+        LanX_LocoInfo::SpeedSteps speed_steps{LanX_LocoInfo::UNKNOWN};
+        bool direction_forward{false};
+        uint8_t speed{0};
+
+        bool double_traction{false};
+        bool smart_search{false};
+
+        LocoFunctions functions;
+
+        bool function(size_t index) const { return functions[index]; }
+    };
+
+    // LAN_X_GET_FIRMWARE_VERSION_RESPONSE
+    struct FirmwareVersion
+    {
+        uint16_t version_bcd{0};
+
+        std::string version() const;
+    };
+}
+
+/**
+ * Any decoded message, std::monostate for DataSets that are unknown or malformed.
+ */
+using Z21Message = std::variant<std::monostate,
+                                message::SerialNumber, message::Code, message::HWInfo, message::BroadcastFlags,
+                                message::LocoMode, message::TurnoutMode, message::SystemState,
+                                message::TurnoutInfo, message::ExtAccessoryInfo, message::TrackPowerOff,
+                                message::TrackPowerOn, message::ProgrammingMode, message::TrackShortCircuit,
+                                message::CvNackShortCircuit, message::CvNack, message::UnknownCommand,
+                                message::StatusChanged, message::VersionResponse, message::CvResult,
+                                message::Stopped, message::LocoInfo, message::FirmwareVersion>;
+
+/**
+ * Decode a received DataSet into a value. Decoding has no shared state and makes no virtual calls, so it
+ * can run on any thread, or on many at once over captured traffic.
+ * @param id DataSet ID
+ * @param data DataSet data, after the header
+ * @return decoded message, std::monostate if unknown or malformed
+ */
+Z21Message decode_dataset(uint16_t id, std::span<const uint8_t> data);
+
+
+#endif // TRAINPP_Z21_MESSAGE_H
@@ -0,0 +1,392 @@
+/* TrainPP
+ * Copyright (C) 2023 Anders Piniesjö
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, version 2
+ * of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef TRAINPP_Z21_PROTOCOL_H
+#define TRAINPP_Z21_PROTOCOL_H
+
+#include "codec.h"
+#include "lan_x_command_base.h"
+
+
+/**
+ * Wire layout of the Z21 messages, described once and used by codec::encode() and codec::decode(). X-Bus
+ * messages start with the X-Header and end with an XOR checksum; DataSet messages are the data after the
+ * DataSet header.
+ */
+namespace protocol
+{
+    using codec::Be16;
+    using codec::Bits;
+    using codec::Byte;
+    using codec::Layout;
+    using codec::Le16;
+    using codec::Le32;
+    using codec::LocoAddress;
+
+    template<uint8_t... Bytes>
+    struct XBus
+    {
+        static constexpr bool checksum = true;
+        static constexpr std::array<uint8_t, sizeof...(Bytes)> pattern = {Bytes...};
+    };
+
+    template<size_t Size>
+    struct DataSet
+    {
+        static constexpr bool checksum = false;
+        static constexpr size_t key_size = 0;
+        static constexpr std::array<uint8_t, Size> pattern{};
+    };
+
+    struct NoFields {};
+
+    template<LanXCommands Id, size_t KeySize, uint8_t... Bytes>
+    struct Constant : XBus<Bytes...>
+    {
+        static constexpr LanXCommands id = Id;
+        static constexpr size_t key_size = KeySize;
+        using Fields = NoFields;
+        using layout = Layout<>;
+    };
+
+
+    // ==== Client to Z21 ====
+
+    using GetVersion = Constant<LanXCommands::LAN_X_GET_VERSION, 2, 0x21, 0x21>;
+    using GetStatus = Constant<LanXCommands::LAN_X_GET_STATUS, 2, 0x21, 0x24>;
+    using SetTrackPowerOff = Constant<LanXCommands::LAN_X_SET_TRACK_POWER_OFF, 2, 0x21, 0x80>;
+    using SetTrackPowerOn = Constant<LanXCommands::LAN_X_SET_TRACK_POWER_ON, 2, 0x21, 0x81>;
+    using SetStop = Constant<LanXCommands::LAN_X_SET_STOP, 1, 0x80>;
+    using GetFirmwareVersion = Constant<LanXCommands::LAN_X_GET_FIRMWARE_VERSION, 2, 0xf1, 0x0a>;
+
+
+    struct DccReadRegister : XBus<0x22, 0x11, 0x00>
+    {
+        static constexpr LanXCommands id = LanXCommands::LAN_X_DCC_READ_REGISTER;
+        static constexpr size_t key_size = 2;
+        struct Fields { uint8_t reg; };
+        using layout = Layout<Byte<&Fields::reg, 2>>;
+    };
+
+
+    struct CvRead : XBus<0x23, 0x11, 0x00, 0x00>
+    {
+        static constexpr LanXCommands id = LanXCommands::LAN_X_CV_READ;
+        static constexpr size_t key_size = 2;
+        struct Fields { uint16_t cv; };
+        using layout = Be16<&Fields::cv, 2, -1>;
+    };
+
+
+    struct DccWriteRegister : XBus<0x23, 0x12, 0x00, 0x00>
+    {
+        static constexpr LanXCommands id = LanXCommands::LAN_X_DCC_WRITE_REGISTER;
+        static constexpr size_t key_size = 2;
+        struct Fields { uint8_t reg; uint8_t value; };
+        using layout = Layout<Byte<&Fields::reg, 2>, Byte<&Fields::value, 3>>;
+    };
+
+
+    struct CvWrite : XBus<0x24, 0x12, 0x00, 0x00, 0x00>
+    {
+        static constexpr LanXCommands id = LanXCommands::LAN_X_CV_WRITE;
+        static constexpr size_t key_size = 2;
+        struct Fields { uint16_t cv; uint8_t value; };
+        using layout = Layout<Be16<&Fields::cv, 2, -1>, Byte<&Fields::value, 4>>;
+    };
+
+
+    struct MmWriteByte : XBus<0x24, 0xff, 0x00, 0x00, 0x00>
+    {
+        static constexpr LanXCommands id = LanXCommands::LAN_X_MM_WRITE_BYTE;
+        static constexpr size_t key_size = 2;
+        struct Fields { uint8_t reg; uint8_t value; };
+        using layout = Layout<Byte<&Fields::reg, 3>, Byte<&Fields::value, 4>>;
+    };
+
+
+    struct GetTurnoutInfo : XBus<0x43, 0x00, 0x00>
+    {
+        static constexpr LanXCommands id = LanXCommands::LAN_X_GET_TURNOUT_INFO;
+        static constexpr size_t key_size = 1;
+        struct Fields { uint16_t address; };
+        using layout = Be16<&Fields::address, 1>;
+    };
+
+
+    struct GetExtAccessoryInfo : XBus<0x44, 0x00, 0x00, 0x00>
+    {
+        static constexpr LanXCommands id = LanXCommands::LAN_X_GET_EXT_ACCESSORY_INFO;
+        static constexpr size_t key_size = 1;
+        struct Fields { uint16_t address; };
+        using layout = Be16<&Fields::address, 1>;
+    };
+
+
+    struct SetTurnout : XBus<0x53, 0x00, 0x00, 0x00>
+    {
+        static constexpr LanXCommands id = LanXCommands::LAN_X_SET_TURNOUT;
+        static constexpr size_t key_size = 1;
+        struct Fields { uint16_t address; uint8_t value; };
+        using layout = Layout<Be16<&Fields::address, 1>, Byte<&Fields::value, 3>>;
+    };
+
+
+    struct SetExtAccessory : XBus<0x54, 0x00, 0x00, 0x00, 0x00>
+    {
+        static constexpr LanXCommands id = LanXCommands::LAN_X_SET_EXT_ACCESSORY;
+        static constexpr size_t key_size = 1;
+        struct Fields { uint16_t address; uint8_t state; };
+        using layout = Layout<Be16<&Fields::address, 1>, Byte<&Fields::state, 3>>;
+    };
+
+
+    struct GetLocoInfo : XBus<0xe3, 0xf0, 0x00, 0x00>
+    {
+        static constexpr LanXCommands id = LanXCommands::LAN_X_GET_LOCO_INFO;
+        static constexpr size_t key_size = 2;
+        struct Fields { uint16_t address; };
+        using layout = LocoAddress<&Fields::address, 2>;
+    };
+
+
+    struct SetLocoDrive : XBus<0xe4, 0x12, 0x00, 0x00, 0x00>
+    {
+        static constexpr LanXCommands id = LanXCommands::LAN_X_SET_LOCO_DRIVE;
+        static constexpr size_t key_size = 2;
+        struct Fields { uint16_t address; uint8_t speed; bool forward; };
+        using layout = Layout<LocoAddress<&Fields::address, 2>, Bits<&Fields::speed, 4, 0, 7>,
+                              Bits<&Fields::forward, 4, 7, 1>>;
+    };
+
+
+    struct SetLocoFunction : XBus<0xe4, 0xf8, 0x00, 0x00, 0x00>
+    {
+        static constexpr LanXCommands id = LanXCommands::LAN_X_SET_LOCO_FUNCTION;
+        static constexpr size_t key_size = 2;
+        struct Fields { uint16_t address; uint8_t function; };
+        using layout = Layout<LocoAddress<&Fields::address, 2>, Byte<&Fields::function, 4>>;
+    };
+
+    // The function group is DB0.
+    struct SetLocoFunctionGroup : XBus<0xe4, 0x00, 0x00, 0x00, 0x00>
+    {
+        static constexpr LanXCommands id = LanXCommands::LAN_X_SET_LOCO_FUNCTION_GROUP;
+        static constexpr size_t key_size = 1;
+        struct Fields { uint16_t address; uint8_t group; uint8_t functions; };
+        using layout = Layout<Byte<&Fields::group, 1>, LocoAddress<&Fields::address, 2>,
+                              Byte<&Fields::functions, 4>>;
+    };
+
+
+    struct SetLocoBinaryState : XBus<0xe5, 0x5f, 0x00, 0x00, 0x00, 0x00>
+    {
+        static constexpr LanXCommands id = LanXCommands::LAN_X_SET_LOCO_BINARY_STATE;
+        static constexpr size_t key_size = 2;
+        struct Fields { uint16_t address; uint16_t binary_address; bool on; };
+        using layout = Layout<LocoAddress<&Fields::address, 2>, Bits<&Fields::binary_address, 4, 0, 7>,
+                              Bits<&Fields::on, 4, 7, 1>, Bits<&Fields::binary_address, 5, 0, 8, 7>>;
+    };
+
+    // Option is 0xec (write byte), 0xe8 (write bit) or 0xe4 (read byte).
+    template<uint8_t Db1, uint8_t Option, LanXCommands Id>
+    struct CvPom : XBus<0xe6, Db1, 0x00, 0x00, Option, 0x00, 0x00>
+    {
+        static constexpr LanXCommands id = Id;
+        static constexpr size_t key_size = 2;
+        struct Fields { uint16_t address; uint8_t selection; uint8_t output; uint16_t cv; uint8_t value; bool bit_value; uint8_t bit_position; };
+        using Cv = Layout<Bits<&Fields::cv, 4, 0, 2, 8, -1>, Bits<&Fields::cv, 5, 0, 8, 0, -1>>;
+        using Value = std::conditional_t<Option == 0xe8,
+                                         Layout<Bits<&Fields::bit_value, 6, 3, 1>, Bits<&Fields::bit_position, 6, 0, 3>>,
+                                         std::conditional_t<Option == 0xec, Layout<Byte<&Fields::value, 6>>, Layout<>>>;
+        using Address = std::conditional_t<Db1 == 0x30,
+                                           LocoAddress<&Fields::address, 2>,
+                                           Layout<Bits<&Fields::address, 2, 0, 5, 4>, Bits<&Fields::address, 3, 4, 4>,
+                                                  Bits<&Fields::selection, 3, 3, 1, 3>, Bits<&Fields::output, 3, 0, 3>>>;
+        using layout = Layout<Address, Cv, Value>;
+    };
+
+    using CvPomWriteByte = CvPom<0x30, 0xec, LanXCommands::LAN_X_CV_POM_WRITE_BYTE>;
+    using CvPomWriteBit = CvPom<0x30, 0xe8, LanXCommands::LAN_X_CV_POM_WRITE_BIT>;
+    using CvPomReadByte = CvPom<0x30, 0xe4, LanXCommands::LAN_X_CV_POM_READ_BYTE>;
+    using CvPomAccessoryWriteByte = CvPom<0x31, 0xec, LanXCommands::LAN_X_CV_POM_ACCESSORY_WRITE_BYTE>;
+    using CvPomAccessoryWriteBit = CvPom<0x31, 0xe8, LanXCommands::LAN_X_CV_POM_ACCESSORY_WRITE_BIT>;
+    using CvPomAccessoryReadByte = CvPom<0x31, 0xe4, LanXCommands::LAN_X_CV_POM_ACCESSORY_READ_BYTE>;
+
+
+    // ==== Z21 to client ====
+
+
+    struct TurnoutInfo : XBus<0x43, 0x00, 0x00, 0x00>
+    {
+        static constexpr LanXCommands id = LanXCommands::LAN_X_TURNOUT_INFO;
+        static constexpr size_t key_size = 1;
+        struct Fields { uint16_t address; uint8_t status; };
+        using layout = Layout<Be16<&Fields::address, 1>, Bits<&Fields::status, 3, 0, 2>>;
+    };
+
+
+    struct ExtAccessoryInfo : XBus<0x44, 0x00, 0x00, 0x00, 0x00>
+    {
+        static constexpr LanXCommands id = LanXCommands::LAN_X_EXT_ACCESSORY_INFO;
+        static constexpr size_t key_size = 1;
+        struct Fields { uint16_t address; uint8_t state; uint8_t status; };
+        using layout = Layout<Be16<&Fields::address, 1>, Byte<&Fields::state, 3>, Byte<&Fields::status, 4>>;
+    };
+
+    using BcTrackPowerOff = Constant<LanXCommands::LAN_X_BC_TRACK_POWER_OFF, 2, 0x61, 0x00>;
+    using BcTrackPowerOn = Constant<LanXCommands::LAN_X_BC_TRACK_POWER_ON, 2, 0x61, 0x01>;
+    using BcProgrammingMode = Constant<LanXCommands::LAN_X_BC_PROGRAMMING_MODE, 2, 0x61, 0x02>;
+    using BcTrackShortCircuit = Constant<LanXCommands::LAN_X_BC_TRACK_SHORT_CIRCUIT, 2, 0x61, 0x08>;
+    using CvNackSc = Constant<LanXCommands::LAN_X_CV_NACK_SC, 2, 0x61, 0x12>;
+    using CvNack = Constant<LanXCommands::LAN_X_CV_NACK, 2, 0x61, 0x13>;
+    using UnknownCommand = Constant<LanXCommands::LAN_X_UNKNOWN_COMMAND, 2, 0x61, 0x82>;
+    using StatusChanged = Constant<LanXCommands::LAN_X_STATUS_CHANGED, 1, 0x62, 0x22, 0x00>;
+    using GetVersionResponse = Constant<LanXCommands::LAN_X_GET_VERSION_RESPONSE, 1, 0x63, 0x21, 0x00, 0x00>;
+    using BcStopped = Constant<LanXCommands::LAN_X_BC_STOPPED, 1, 0x81, 0x00>;
+
+
+    struct CvResult : XBus<0x64, 0x14, 0x00, 0x00, 0x00>
+    {
+        static constexpr LanXCommands id = LanXCommands::LAN_X_CV_RESULT;
+        static constexpr size_t key_size = 1;
+        struct Fields { uint16_t cv; uint8_t value; };
+        using layout = Layout<Be16<&Fields::cv, 2, -1>, Byte<&Fields::value, 4>>;
+    };
+
+    // DB8 (F29-F31) and DB9-DB13 (F32-F68, newer firmware) are optional. Functions are a bit mask with F0 in
+    // bit 0, F64-F68 in functions_high.
+    struct LocoInfo : XBus<0xef, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00>
+    {
+        static constexpr LanXCommands id = LanXCommands::LAN_X_LOCO_INFO;
+        static constexpr size_t key_size = 1;
+        struct Fields
+        {
+            uint16_t address;
+            bool busy;
+            uint8_t speed_steps;
+            bool forward;
+            uint8_t speed;
+            bool double_traction;
+            bool smart_search;
+            uint64_t functions;
+            uint8_t functions_high;
+        };
+        using layout = Layout<LocoAddress<&Fields::address, 1>,
+                              Bits<&Fields::busy, 3, 3, 1>, Bits<&Fields::speed_steps, 3, 0, 3>,
+                              Bits<&Fields::forward, 4, 7, 1>, Bits<&Fields::speed, 4, 0, 7>,
+                              Bits<&Fields::double_traction, 5, 6, 1>, Bits<&Fields::smart_search, 5, 5, 1>,
+                              Bits<&Fields::functions, 5, 4, 1, 0>, Bits<&Fields::functions, 5, 0, 4, 1>,
+                              Bits<&Fields::functions, 6, 0, 8, 5>, Bits<&Fields::functions, 7, 0, 8, 13>,
+                              Bits<&Fields::functions, 8, 0, 8, 21>, Bits<&Fields::functions, 9, 0, 3, 29>,
+                              Bits<&Fields::functions, 10, 0, 8, 32>, Bits<&Fields::functions, 11, 0, 8, 40>,
+                              Bits<&Fields::functions, 12, 0, 8, 48>, Bits<&Fields::functions, 13, 0, 8, 56>,
+                              Bits<&Fields::functions_high, 14, 0, 5, 0>>;
+    };
+
+    // Version is BCD.
+    struct GetFirmwareVersionResponse : XBus<0xf3, 0x0a, 0x00, 0x00>
+    {
+        static constexpr LanXCommands id = LanXCommands::LAN_X_GET_FIRMWARE_VERSION_RESPONSE;
+        static constexpr size_t key_size = 1;
+        struct Fields { uint16_t version; };
+        using layout = Be16<&Fields::version, 2>;
+    };
+
+    /**
+     * Identifies the X-Bus messages received from the Z21.
+     */
+    using LanXDecoders = codec::Dispatcher<TurnoutInfo, ExtAccessoryInfo, BcTrackPowerOff, BcTrackPowerOn,
+                                           BcProgrammingMode, BcTrackShortCircuit, CvNackSc, CvNack, UnknownCommand,
+                                           StatusChanged, GetVersionResponse, CvResult, BcStopped, LocoInfo,
+                                           GetFirmwareVersionResponse>;
+
+
+    // ==== DataSets ====
+
+
+    struct SerialNumber : DataSet<4>
+    {
+        struct Fields { uint32_t serial_number; };
+        using layout = Le32<&Fields::serial_number, 0>;
+    };
+
+
+    struct Code : DataSet<1>
+    {
+        struct Fields { uint8_t code; };
+        using layout = Byte<&Fields::code, 0>;
+    };
+
+    // Firmware version is BCD.
+    struct HWInfo : DataSet<8>
+    {
+        struct Fields { uint32_t hw_type; uint32_t fw_version; };
+        using layout = Layout<Le32<&Fields::hw_type, 0>, Le32<&Fields::fw_version, 4>>;
+    };
+
+    struct BroadcastFlags : DataSet<4>
+    {
+        struct Fields { uint32_t flags; };
+        using layout = Le32<&Fields::flags, 0>;
+    };
+
+    // Address is big endian, used by both loco and turnout mode.
+    struct GetLocomode : DataSet<2>
+    {
+        struct Fields { uint16_t address; };
+        using layout = Be16<&Fields::address, 0>;
+    };
+
+    struct Locomode : DataSet<3>
+    {
+        struct Fields { uint16_t address; uint8_t mode; };
+        using layout = Layout<Be16<&Fields::address, 0>, Byte<&Fields::mode, 2>>;
+    };
+
+
+    struct SystemState : DataSet<16>
+    {
+        struct Fields
+        {
+            int16_t main_current;
+            int16_t prog_current;
+            int16_t filtered_main_current;
+            int16_t temperature;
+            uint16_t supply_voltage;
+            uint16_t vcc_voltage;
+            uint8_t central_state;
+            uint8_t central_state_ex;
+            uint8_t capabilities;
+            bool emergency_stop;
+            bool track_voltage_off;
+            bool short_circuit;
+            bool programming_mode;
+        };
+        using layout = Layout<Le16<&Fields::main_current, 0>, Le16<&Fields::prog_current, 2>,
+                              Le16<&Fields::filtered_main_current, 4>, Le16<&Fields::temperature, 6>,
+                              Le16<&Fields::supply_voltage, 8>, Le16<&Fields::vcc_voltage, 10>,
+                              Byte<&Fields::central_state, 12>, Byte<&Fields::central_state_ex, 13>,
+                              Byte<&Fields::capabilities, 15>,
+                              Bits<&Fields::emergency_stop, 12, 0, 1>, Bits<&Fields::track_voltage_off, 12, 1, 1>,
+                              Bits<&Fields::short_circuit, 12, 2, 1>, Bits<&Fields::programming_mode, 12, 5, 1>>;
+    };
+}
+
+
+#endif // TRAINPP_Z21_PROTOCOL_H